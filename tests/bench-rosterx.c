@@ -0,0 +1,398 @@
+/*
+ * Benchmark of the conversion functions of the XMPP Roster Item Exchange plugin
+ *
+ * Copyright (C) 2017  Dustin Gathmann
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ *
+ */
+
+/*
+ * Built and run by "make bench" against the libpurple stub, like the
+ * regression tests. Synthetic rosters of several sizes and group
+ * fan-outs go through every conversion, from the blist snapshot to the
+ * fallback message. The report on stdout has tab separated values, one
+ * line per stage and roster shape:
+ *   stage, items, groups per item, distinct groups, usec, usec per item,
+ *   allocations per item, bytes allocated per item
+ * Every stage runs REPETITIONS times, the times are their median.
+ *
+ * Allocations are counted by wrapping malloc() and friends, so they
+ * include GLib's and the stub's. Run with G_SLICE=always-malloc on
+ * GLib before 2.76, otherwise g_slice_*() is not counted.
+ *
+ * Lines starting with '#' are comments. At the end, a stage whose
+ * allocations per item grow more than SCALING_LIMIT times between the
+ * smallest and the largest roster, or whose time per item grows that
+ * much between the smallest roster that takes TIME_MIN_USEC and the
+ * largest, is listed as "# superlinear", and the exit status is 1.
+ *
+ * Usage: bench-rosterx [items...]
+ */
+#include "../xmpp-rosterx.c"
+
+#include <stdlib.h>
+
+#define DEFAULT_SIZES    { 10, 100, 1000, 10000, 100000 }
+#define REPETITIONS      5
+#define SCALING_LIMIT    4.0
+#define TIME_MIN_USEC    200   /* shorter stages are too noisy to judge their scaling */
+
+/*
+ * Allocation counting
+ */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+static guint64 alloc_count = 0;
+static guint64 alloc_bytes = 0;
+
+void *
+malloc(size_t size)
+{
+	alloc_count++;
+	alloc_bytes += size;
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+	alloc_count++;
+	alloc_bytes += nmemb * size;
+	return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+	/* Growing a buffer costs like a new allocation */
+	alloc_count++;
+	alloc_bytes += size;
+	return __libc_realloc(ptr, size);
+}
+
+void
+free(void *ptr)
+{
+	__libc_free(ptr);
+}
+
+
+/*
+ * Measurements
+ */
+typedef struct {
+	guint nitems;
+	guint groups_per_item;
+	guint ngroups;  /* distinct groups */
+} Shape;
+
+typedef struct {
+	gint64 start_usec;
+	guint64 start_count;
+	guint64 start_bytes;
+} Measurement;
+
+/* The repetitions of one stage */
+typedef struct {
+	gint64 usec[REPETITIONS];
+	guint n;
+	guint64 count;  /* allocations of the last repetition */
+	guint64 bytes;
+} Samples;
+
+/* One line of the report, kept for the scaling summary */
+typedef struct {
+	const char *stage;
+	Shape shape;
+	double usec_per_item;
+	double allocs_per_item;
+	double bytes_per_item;
+	gint64 usec;
+} Result;
+
+static GArray *results = NULL;  /* entries are Result */
+
+static void
+measure_start(Measurement *m)
+{
+	m->start_count = alloc_count;
+	m->start_bytes = alloc_bytes;
+	m->start_usec = g_get_monotonic_time();
+}
+
+static void
+measure_stop(Measurement *m, Samples *samples)
+{
+	samples->usec[samples->n++] = g_get_monotonic_time() - m->start_usec;
+	samples->count = alloc_count - m->start_count;
+	samples->bytes = alloc_bytes - m->start_bytes;
+}
+
+static int
+_compare_samples(gconstpointer a, gconstpointer b)
+{
+	gint64 x = *(const gint64 *) a, y = *(const gint64 *) b;
+
+	return (x > y) - (x < y);
+}
+
+static void
+report(const char *stage, const Shape *shape, Samples *samples)
+{
+	gint64 usec;
+	double n = MAX(shape->nitems, 1);
+	Result r;
+
+	qsort(samples->usec, samples->n, sizeof(gint64), _compare_samples);
+	usec = samples->usec[samples->n / 2];
+
+	r.stage = stage;
+	r.shape = *shape;
+	r.usec_per_item = usec / n;
+	r.allocs_per_item = samples->count / n;
+	r.bytes_per_item = samples->bytes / n;
+	r.usec = usec;
+
+	g_array_append_val(results, r);
+	printf("%s\t%u\t%u\t%u\t%" G_GINT64_FORMAT "\t%.3f\t%.2f\t%.1f\n",
+			stage, shape->nitems, shape->groups_per_item, shape->ngroups,
+			usec, r.usec_per_item, r.allocs_per_item, r.bytes_per_item);
+}
+
+/*
+ * Runs the statement "run" REPETITIONS times and reports its median
+ * time. "cleanup" releases the result of a repetition before the next
+ * one, the result of the last repetition is kept for the next stages.
+ */
+#define BENCH_STAGE(stage, shape, run, cleanup) \
+	G_STMT_START { \
+		Samples samples = { { 0 }, 0, 0, 0 }; \
+		Measurement m; \
+		guint rep; \
+		for (rep = 0; rep < REPETITIONS; rep++) { \
+			if (rep > 0) { \
+				cleanup; \
+			} \
+			measure_start(&m); \
+			run; \
+			measure_stop(&m, &samples); \
+		} \
+		report((stage), (shape), &samples); \
+	} G_STMT_END
+
+
+/*
+ * Synthetic rosters
+ */
+typedef struct {
+	PurplePlugin plugin;
+	PurpleAccount *account;
+	DummyJabberStream *js;
+} Bench;
+
+static void
+bench_setup(Bench *bench)
+{
+	stub_reset();
+
+	purple_init_plugin(&bench->plugin);
+	bench->account = stub_account_new("bench@example.org", "prpl-jabber");
+	bench->js = g_new0(DummyJabberStream, 1);
+	bench->js->buddies = g_hash_table_new(g_str_hash, g_str_equal);
+	stub_connection_set_protocol_data(purple_account_get_connection(bench->account), bench->js);
+
+	if (!plugin_load(&bench->plugin))
+		g_error("Could not load the plugin");
+}
+
+static void
+bench_teardown(Bench *bench)
+{
+	plugin_unload(&bench->plugin);
+	purple_signals_disconnect_by_handle(&bench->plugin);
+
+	g_hash_table_destroy(bench->js->buddies);
+	g_free(bench->js);
+	stub_reset();
+}
+
+/* Adds the roster to the blist, a buddy per item and group */
+static void
+blist_populate(Bench *bench, const Shape *shape)
+{
+	char jid[64], alias[64], group[64];
+	guint i, g;
+
+	for (i = 0; i < shape->nitems; i++) {
+		g_snprintf(jid, sizeof(jid), "contact%u@bench.example.org", i);
+		g_snprintf(alias, sizeof(alias), "Contact <%u> & co", i);
+		for (g = 0; g < shape->groups_per_item; g++) {
+			g_snprintf(group, sizeof(group), "Group %u", (i + g) % shape->ngroups);
+			purple_blist_add_buddy(purple_buddy_new(bench->account, jid, alias), NULL,
+					purple_group_new(group), NULL);
+		}
+	}
+}
+
+static void
+bench_shape(const Shape *shape)
+{
+	Bench bench;
+	ItemList *itemlist = NULL, *parsed = NULL;
+	PurpleRequestFields *request = NULL;
+	GHashTable *fields = NULL;
+	xmlnode *xnode = NULL;
+	GList *g, *f, *next;
+	gboolean too_large;
+	char *text = NULL;
+
+	bench_setup(&bench);
+	blist_populate(&bench, shape);
+
+	BENCH_STAGE("snapshot -> itemlist", shape,
+			itemlist = itemlist_new_from_snapshot(),
+			itemlist_destroy(itemlist));
+
+	BENCH_STAGE("itemlist -> request", shape,
+			fields = g_hash_table_new(NULL, NULL);
+			request = request_new_from_itemlist(itemlist, fields),
+			purple_request_fields_destroy(request);
+			g_hash_table_destroy(fields));
+
+	for (g = purple_request_fields_get_groups(request); g; g = g_list_next(g))
+		for (f = purple_request_field_group_get_fields(g->data); f; f = g_list_next(f))
+			purple_request_field_bool_set_value(f->data, TRUE);
+
+	/* With every field selected, the itemlist stays as it was */
+	BENCH_STAGE("request -> itemlist", shape,
+			itemlist_select_from_request(itemlist, request, fields),
+			(void) 0);
+	purple_request_fields_destroy(request);
+	g_hash_table_destroy(fields);
+
+	BENCH_STAGE("itemlist -> xnode", shape,
+			xnode = xnode_new_from_itemlist(itemlist_get_items(itemlist), G_MAXSIZE, &next),
+			xmlnode_free(xnode));
+
+	BENCH_STAGE("xnode -> itemlist", shape,
+			parsed = itemlist_new_from_xnode_bounded(xnode, shape->nitems, shape->groups_per_item,
+					&too_large),
+			itemlist_destroy(parsed));
+	itemlist_destroy(parsed);
+	xmlnode_free(xnode);
+
+	BENCH_STAGE("itemlist -> message", shape,
+			text = create_message_from_itemlist(itemlist_get_items(itemlist), NULL, "bench@example.org"),
+			g_free(text));
+	g_free(text);
+
+	itemlist_destroy(itemlist);
+	bench_teardown(&bench);
+}
+
+static gboolean
+same_kind(const Result *a, const Result *b)
+{
+	return g_str_equal(a->stage, b->stage) && a->shape.groups_per_item == b->shape.groups_per_item;
+}
+
+/* Compares the smallest and the largest roster of every stage and fan-out, returns how many grew too much */
+static guint
+report_scaling(void)
+{
+	guint i, j, nsuperlinear = 0;
+
+	for (i = 0; i < results->len; i++) {
+		Result *small = &g_array_index(results, Result, i), *large = small, *timed = NULL;
+		double time_ratio, alloc_ratio;
+		gboolean superlinear;
+
+		for (j = 0; j < results->len; j++) {
+			Result *r = &g_array_index(results, Result, j);
+
+			if (!same_kind(r, small))
+				continue;
+			if (r->shape.nitems < small->shape.nitems)
+				break;
+			if (r->shape.nitems > large->shape.nitems)
+				large = r;
+			if (r->usec >= TIME_MIN_USEC && (!timed || r->shape.nitems < timed->shape.nitems))
+				timed = r;
+		}
+		/* Once per kind, from its smallest roster */
+		if (j < results->len || large == small)
+			continue;
+
+		time_ratio = !timed ? 1.0 : large->usec_per_item / MAX(timed->usec_per_item, 0.001);
+		alloc_ratio = large->allocs_per_item / MAX(small->allocs_per_item, 0.01);
+		superlinear = time_ratio > SCALING_LIMIT || alloc_ratio > SCALING_LIMIT;
+
+		printf("# scaling\t%s\t%u..%u items\t%u groups per item\ttime x%.2f from %u items"
+				"\tallocations x%.2f%s\n",
+				small->stage, small->shape.nitems, large->shape.nitems, small->shape.groups_per_item,
+				time_ratio, timed ? timed->shape.nitems : large->shape.nitems, alloc_ratio,
+				superlinear ? "\tsuperlinear" : "");
+		if (superlinear)
+			nsuperlinear++;
+	}
+	return nsuperlinear;
+}
+
+int
+main(int argc, char *argv[])
+{
+	guint default_sizes[] = DEFAULT_SIZES;
+	guint *sizes = default_sizes, nsizes = G_N_ELEMENTS(default_sizes);
+	guint i, nsuperlinear;
+	int a;
+
+	if (argc > 1) {
+		sizes = g_new(guint, argc - 1);
+		for (a = 1, nsizes = 0; a < argc; a++) {
+			guint64 n = g_ascii_strtoull(argv[a], NULL, 10);
+
+			if (n == 0 || n > G_MAXINT) {
+				fprintf(stderr, "usage: %s [items...]\n", argv[0]);
+				return 2;
+			}
+			sizes[nsizes++] = n;
+		}
+	}
+
+	if (glib_check_version(2, 76, 0) && !g_getenv("G_SLICE"))
+		fprintf(stderr, "%s: G_SLICE=always-malloc is not set, g_slice_*() is not counted\n", argv[0]);
+
+	results = g_array_new(FALSE, FALSE, sizeof(Result));
+	printf("# stage\titems\tgroups_per_item\tgroups\tusec\tusec_per_item\tallocs_per_item\tbytes_per_item\n");
+
+	for (i = 0; i < nsizes; i++) {
+		/* Few large groups, and many small groups with several per item */
+		Shape few = { sizes[i], 1, 8 };
+		Shape many = { sizes[i], 3, MIN(sizes[i] / 10 + 1, 1000) };
+
+		bench_shape(&few);
+		bench_shape(&many);
+	}
+
+	nsuperlinear = report_scaling();
+	g_array_free(results, TRUE);
+	if (sizes != default_sizes)
+		g_free(sizes);
+	return nsuperlinear ? 1 : 0;
+}
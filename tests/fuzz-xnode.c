@@ -0,0 +1,398 @@
+/*
+ * Fuzzer for received Roster Item Exchange payloads
+ *
+ * Copyright (C) 2017  Dustin Gathmann
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ *
+ */
+
+/*
+ * The input is a little program that builds an <x/> payload, see Op.
+ * Every payload is
+ *
+ * - received from a contact through iq_received_cb(), and shown after
+ *   the coalescing window, like a real suggestion;
+ * - parsed by itemlist_new_from_xnode_bounded() at two scales, all
+ *   repeat counts multiplied by 1 and by LARGE_SCALE. The parser must
+ *   not spend more time or arena memory per element on the larger
+ *   payload than SCALING_LIMIT times what it spent on the smaller one.
+ *
+ * A crash, a sanitizer report or an abort() on superlinear growth is a
+ * finding. "make fuzz" builds it with clang's libFuzzer, as
+ * tests/fuzz-xnode-libfuzzer. Without ROSTERX_LIBFUZZER, it is
+ * tests/fuzz-xnode, which runs the payload programs in the files given
+ * as arguments, like crashes found by libFuzzer, or a set of built-in
+ * seeds. "make check" runs the seeds.
+ */
+#include "../xmpp-rosterx.c"
+
+#include <stdlib.h>
+
+#define MAX_ELEMENTS     2000  /* per payload at scale 1 */
+#define MAX_STRING       32
+#define LARGE_SCALE      8
+#define SCALING_LIMIT    3.0
+#define PARSE_RUNS       3     /* the fastest run counts */
+#define TIME_MIN_USEC    2000  /* faster parses are too noisy to judge */
+
+/* Opcodes, each followed by its operands as bytes. A string is a length
+ * byte and up to MAX_STRING bytes. Ops on the current item start an
+ * item if there is none. */
+typedef enum {
+	OP_ITEM,           /* starts a new <item/> */
+	OP_ACTION,         /* string: its action attribute */
+	OP_JID,            /* string */
+	OP_NAME,           /* string */
+	OP_GROUP,          /* string: adds a <group/>, without data if empty */
+	OP_REPEAT_ITEMS,   /* count, mode: copies the item count * scale times,
+	                    * with the same jid if mode is even, numbered otherwise */
+	OP_REPEAT_GROUPS,  /* count, mode: adds count * scale copies of the last
+	                    * group, numbered if mode is odd */
+	OP_JUNK,           /* count: foreign elements between the items */
+	NUM_OPS
+} Op;
+
+typedef struct {
+	const guint8 *data;
+	size_t size;
+	size_t pos;
+} Input;
+
+static const char string_chars[] = "abcdefghijklmnopqrstuvwxyz0123456789@./";
+
+static guint
+input_byte(Input *in)
+{
+	return in->pos < in->size ? in->data[in->pos++] : 0;
+}
+
+/* Printable ASCII, so that every payload is valid UTF-8 */
+static char *
+input_string(Input *in)
+{
+	guint len = input_byte(in), i;
+	char *str;
+
+	len = MIN(len, MAX_STRING);
+	str = g_malloc(len + 1);
+
+	for (i = 0; i < len; i++) {
+		guint c = input_byte(in);
+
+		str[i] = g_ascii_isprint(c) ? c : string_chars[c % (sizeof(string_chars) - 1)];
+	}
+	str[len] = '\0';
+	return str;
+}
+
+/* Counts node and its descendant elements */
+static guint
+element_count(xmlnode *node)
+{
+	xmlnode *child;
+	guint n = 1;
+
+	for (child = node->child; child; child = child->next) {
+		if (child->type == XMLNODE_TYPE_TAG)
+			n += element_count(child);
+	}
+	return n;
+}
+
+/* Builds the <x/> of the input, the number of its elements goes to nelements */
+static xmlnode *
+payload_new(const guint8 *data, size_t size, guint scale, guint *nelements)
+{
+	Input in = { data, size, 0 };
+	xmlnode *xnode = xmlnode_new("x"), *xitem = NULL, *xgroup = NULL;
+	guint max = MAX_ELEMENTS * scale, n = 0, count, mode, copy_size, i;
+	char *str, *numbered;
+
+	xmlnode_set_namespace(xnode, NS_ROSTERX);
+
+	while (in.pos < in.size && n < max) {
+		Op op = input_byte(&in) % NUM_OPS;
+
+		if (!xitem && op != OP_ITEM && op != OP_JUNK) {
+			xitem = xmlnode_new_child(xnode, "item");
+			n++;
+		}
+
+		switch (op) {
+			case OP_ITEM:
+				xitem = xmlnode_new_child(xnode, "item");
+				xgroup = NULL;
+				n++;
+				break;
+			case OP_ACTION:
+			case OP_JID:
+			case OP_NAME:
+				str = input_string(&in);
+				xmlnode_set_attrib(xitem, op == OP_ACTION ? "action" : op == OP_JID ? "jid" : "name", str);
+				g_free(str);
+				break;
+			case OP_GROUP:
+				str = input_string(&in);
+				xgroup = xmlnode_new_child(xitem, "group");
+				if (*str)
+					xmlnode_insert_data(xgroup, str, -1);
+				g_free(str);
+				n++;
+				break;
+			case OP_REPEAT_ITEMS:
+				count = input_byte(&in) * scale;
+				mode = input_byte(&in);
+				copy_size = element_count(xitem);
+				for (i = 0; i < count && n + copy_size <= max; i++, n += copy_size) {
+					xmlnode *copy = xmlnode_copy(xitem);
+					const char *jid = xmlnode_get_attrib(copy, "jid");
+
+					if (jid && (mode & 1)) {
+						numbered = g_strdup_printf("%u.%s", i, jid);
+						xmlnode_set_attrib(copy, "jid", numbered);
+						g_free(numbered);
+					}
+					xmlnode_insert_child(xnode, copy);
+				}
+				break;
+			case OP_REPEAT_GROUPS:
+				count = input_byte(&in) * scale;
+				mode = input_byte(&in);
+				str = xgroup ? xmlnode_get_data(xgroup) : NULL;
+				for (i = 0; i < count && n < max; i++, n++) {
+					xmlnode *copy = xmlnode_new_child(xitem, "group");
+
+					numbered = (mode & 1) ? g_strdup_printf("%s %u", str ? str : "", i) : g_strdup(str);
+					if (numbered && *numbered)
+						xmlnode_insert_data(copy, numbered, -1);
+					g_free(numbered);
+				}
+				g_free(str);
+				break;
+			case OP_JUNK:
+				count = input_byte(&in) * scale;
+				for (i = 0; i < count && n < max; i++, n++)
+					xmlnode_new_child(xnode, i & 1 ? "junk" : "group");
+				break;
+			default:
+				g_assert_not_reached();
+		}
+	}
+	*nelements = n;
+	return xnode;
+}
+
+
+/*
+ * Receive path
+ */
+static PurplePlugin plugin;
+
+static void
+receive_payload(xmlnode *xnode)
+{
+	PurpleAccount *account;
+	PurpleConnection *pc;
+	DummyJabberStream js = { 0 };
+	DummyJabberBuddy jb = { 0 };
+	xmlnode *iq;
+	guint nruns;
+
+	stub_reset();
+	purple_init_plugin(&plugin);
+	account = stub_account_new("alice@example.org", "prpl-jabber");
+	pc = purple_account_get_connection(account);
+	js.buddies = g_hash_table_new(g_str_hash, g_str_equal);
+	stub_connection_set_protocol_data(pc, &js);
+	if (!plugin_load(&plugin))
+		abort();
+
+	purple_blist_add_buddy(purple_buddy_new(account, "bob@example.org", "Bob"), NULL,
+			purple_group_new("Friends"), NULL);
+	jb.subscription = JABBER_SUB_BOTH;
+	g_hash_table_insert(js.buddies, "bob@example.org", &jb);
+
+	iq = xmlnode_new("iq");
+	xmlnode_set_attrib(iq, "type", "set");
+	xmlnode_set_attrib(iq, "id", "fuzz");
+	xmlnode_set_attrib(iq, "from", "bob@example.org/fuzz");
+	xmlnode_insert_child(iq, xmlnode_copy(xnode));
+	iq_received_cb(pc, "set", "fuzz", "bob@example.org/fuzz", iq);
+	xmlnode_free(iq);
+
+	/* Up to the searchresults */
+	for (nruns = 0; stub_timeouts_pending() && nruns < 16; nruns++)
+		stub_timeouts_run();
+
+	plugin_unload(&plugin);
+	purple_signals_disconnect_by_handle(&plugin);
+	g_hash_table_destroy(js.buddies);
+	stub_reset();
+}
+
+
+/*
+ * Scaling of the parser
+ */
+typedef struct {
+	guint nelements;
+	gint64 usec;    /* fastest run */
+	gsize bytes;    /* arena of the itemlist */
+} Parse;
+
+static void
+parse_payload(const guint8 *data, size_t size, guint scale, Parse *parse)
+{
+	xmlnode *xnode = payload_new(data, size, scale, &parse->nelements);
+	int run;
+
+	parse->usec = G_MAXINT64;
+	parse->bytes = 0;
+	for (run = 0; run < PARSE_RUNS; run++) {
+		gint64 start = g_get_monotonic_time();
+		gboolean too_large;
+		ItemList *itemlist = itemlist_new_from_xnode_bounded(xnode, MAX_ITEMS_DEFAULT,
+				MAX_GROUPS_DEFAULT, &too_large);
+
+		parse->usec = MIN(parse->usec, g_get_monotonic_time() - start);
+		if (itemlist)
+			parse->bytes = (gsize) itemlist->arena.nblocks * ARENA_BLOCK_SIZE;
+		itemlist_destroy(itemlist);
+	}
+	xmlnode_free(xnode);
+}
+
+static void
+check_scaling(const guint8 *data, size_t size)
+{
+	Parse small, large;
+	double growth, time_growth, bytes_growth;
+
+	parse_payload(data, size, 1, &small);
+	parse_payload(data, size, LARGE_SCALE, &large);
+
+	/* Nothing to repeat in this payload */
+	if (large.nelements < 2 * MAX(small.nelements, 1))
+		return;
+
+	growth = (double) large.nelements / MAX(small.nelements, 1);
+	time_growth = large.usec < TIME_MIN_USEC ? 0.0 : (double) large.usec / MAX(small.usec, 1);
+	bytes_growth = (double) large.bytes / MAX(small.bytes, ARENA_BLOCK_SIZE);
+
+	if (time_growth > SCALING_LIMIT * growth || bytes_growth > SCALING_LIMIT * growth) {
+		fprintf(stderr, "Superlinear parse: %u elements in %" G_GINT64_FORMAT " us and %" G_GSIZE_FORMAT
+				" bytes, %u elements in %" G_GINT64_FORMAT " us and %" G_GSIZE_FORMAT " bytes\n",
+				small.nelements, small.usec, small.bytes, large.nelements, large.usec, large.bytes);
+		abort();
+	}
+}
+
+int LLVMFuzzerTestOneInput(const guint8 *data, size_t size);
+
+int
+LLVMFuzzerTestOneInput(const guint8 *data, size_t size)
+{
+	guint nelements;
+	xmlnode *xnode = payload_new(data, size, 1, &nelements);
+
+	receive_payload(xnode);
+	xmlnode_free(xnode);
+
+	check_scaling(data, size);
+	return 0;
+}
+
+
+#ifndef ROSTERX_LIBFUZZER
+/*
+ * Replay of payload programs, and seeds of the kinds of payloads that
+ * used to be slow
+ */
+#define S(...)  sizeof((const char[]) { __VA_ARGS__ }), __VA_ARGS__
+
+static const guint8 seed_distinct[] = {
+	OP_ITEM, OP_JID, S('c', '@', 'x'), OP_NAME, S('C'), OP_GROUP, S('G'),
+	OP_REPEAT_ITEMS, 250, 1, OP_REPEAT_ITEMS, 250, 1
+};
+static const guint8 seed_duplicate_jids[] = {
+	OP_ITEM, OP_JID, S('c', '@', 'x'), OP_GROUP, S('G'),
+	OP_REPEAT_ITEMS, 250, 0, OP_REPEAT_ITEMS, 250, 0
+};
+static const guint8 seed_group_twins[] = {
+	OP_ITEM, OP_JID, S('c', '@', 'x'), OP_GROUP, S('G'), OP_REPEAT_GROUPS, 63, 0,
+	OP_REPEAT_ITEMS, 250, 1, OP_REPEAT_ITEMS, 250, 1
+};
+static const guint8 seed_numbered_groups[] = {
+	OP_ITEM, OP_JID, S('c', '@', 'x'), OP_GROUP, S('G'), OP_REPEAT_GROUPS, 250, 1,
+	OP_REPEAT_ITEMS, 250, 1
+};
+static const guint8 seed_missing_attributes[] = {
+	OP_ITEM, OP_GROUP, 0, OP_REPEAT_ITEMS, 250, 1, OP_ITEM, OP_NAME, S('n'), OP_REPEAT_ITEMS, 250, 1
+};
+static const guint8 seed_unknown_actions[] = {
+	OP_ITEM, OP_ACTION, S('f', 'r', 'o', 'b'), OP_JID, S('c', '@', 'x'), OP_REPEAT_ITEMS, 250, 1,
+	OP_ITEM, OP_ACTION, S('A', 'D', 'D'), OP_JID, S('d', '@', 'x'), OP_REPEAT_ITEMS, 250, 1
+};
+static const guint8 seed_interleaved_junk[] = {
+	OP_ITEM, OP_JID, S('c', '@', 'x'), OP_JUNK, 250, OP_ITEM, OP_JID, S('d', '@', 'x'), OP_JUNK, 250,
+	OP_ITEM, OP_JID, S('e', '@', 'x'), OP_REPEAT_ITEMS, 100, 1
+};
+
+#undef S
+
+static const struct {
+	const char *name;
+	const guint8 *data;
+	size_t size;
+} seeds[] = {
+	{ "distinct items", seed_distinct, sizeof(seed_distinct) },
+	{ "duplicate jids", seed_duplicate_jids, sizeof(seed_duplicate_jids) },
+	{ "group twins", seed_group_twins, sizeof(seed_group_twins) },
+	{ "numbered groups", seed_numbered_groups, sizeof(seed_numbered_groups) },
+	{ "missing attributes", seed_missing_attributes, sizeof(seed_missing_attributes) },
+	{ "unknown actions", seed_unknown_actions, sizeof(seed_unknown_actions) },
+	{ "interleaved junk", seed_interleaved_junk, sizeof(seed_interleaved_junk) }
+};
+
+int
+main(int argc, char *argv[])
+{
+	guint i;
+	int a;
+
+	if (argc == 1) {
+		for (i = 0; i < G_N_ELEMENTS(seeds); i++) {
+			LLVMFuzzerTestOneInput(seeds[i].data, seeds[i].size);
+			printf("ok %u - %s\n", i + 1, seeds[i].name);
+		}
+		return 0;
+	}
+
+	for (a = 1; a < argc; a++) {
+		gchar *data;
+		gsize size;
+
+		if (!g_file_get_contents(argv[a], &data, &size, NULL)) {
+			fprintf(stderr, "%s: cannot read %s\n", argv[0], argv[a]);
+			return 2;
+		}
+		LLVMFuzzerTestOneInput((const guint8 *) data, size);
+		printf("ok %d - %s\n", a, argv[a]);
+		g_free(data);
+	}
+	return 0;
+}
+#endif /* ROSTERX_LIBFUZZER */
@@ -0,0 +1,2 @@
+/* See purple.h */
+#include "purple.h"
@@ -0,0 +1,1441 @@
+/*
+ * Minimal stub of the libpurple 2.x API used by xmpp-rosterx.c
+ *
+ * Copyright (C) 2017  Dustin Gathmann
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ *
+ */
+
+#include <glib.h>
+#include <glib/gstdio.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "purple.h"
+
+#define equals(X, Y)     (g_strcmp0(X, Y) == 0)
+
+
+/*
+ * xmlnode
+ */
+static xmlnode *
+new_node(const char *name, XMLNodeType type)
+{
+	xmlnode *node = g_new0(xmlnode, 1);
+
+	node->name = g_strdup(name);
+	node->type = type;
+	return node;
+}
+
+xmlnode *
+xmlnode_new(const char *name)
+{
+	g_return_val_if_fail(name != NULL, NULL);
+
+	return new_node(name, XMLNODE_TYPE_TAG);
+}
+
+xmlnode *
+xmlnode_new_child(xmlnode *parent, const char *name)
+{
+	xmlnode *node = xmlnode_new(name);
+
+	xmlnode_insert_child(parent, node);
+	return node;
+}
+
+void
+xmlnode_insert_child(xmlnode *parent, xmlnode *child)
+{
+	g_return_if_fail(parent != NULL && child != NULL);
+
+	child->parent = parent;
+	if (parent->lastchild)
+		parent->lastchild->next = child;
+	else
+		parent->child = child;
+	parent->lastchild = child;
+}
+
+void
+xmlnode_insert_data(xmlnode *node, const char *data, gssize size)
+{
+	xmlnode *child;
+	gsize len;
+
+	g_return_if_fail(node != NULL && data != NULL && size != 0);
+
+	len = size < 0 ? strlen(data) : (gsize) size;
+	child = new_node(NULL, XMLNODE_TYPE_DATA);
+	child->data = g_strndup(data, len);
+	child->data_sz = len;
+	xmlnode_insert_child(node, child);
+}
+
+static void
+remove_attrib(xmlnode *node, const char *attr)
+{
+	xmlnode *attr_node;
+
+	for (attr_node = node->child; attr_node; attr_node = attr_node->next) {
+		if (attr_node->type == XMLNODE_TYPE_ATTRIB && equals(attr_node->name, attr)) {
+			/* Unlinks it */
+			xmlnode_free(attr_node);
+			return;
+		}
+	}
+}
+
+void
+xmlnode_set_attrib(xmlnode *node, const char *attr, const char *value)
+{
+	xmlnode *attrib_node;
+
+	g_return_if_fail(node != NULL && attr != NULL && value != NULL);
+
+	remove_attrib(node, attr);
+	attrib_node = new_node(attr, XMLNODE_TYPE_ATTRIB);
+	attrib_node->data = g_strdup(value);
+	xmlnode_insert_child(node, attrib_node);
+}
+
+const char *
+xmlnode_get_attrib(const xmlnode *node, const char *attr)
+{
+	xmlnode *x;
+
+	g_return_val_if_fail(node != NULL && attr != NULL, NULL);
+
+	for (x = node->child; x; x = x->next) {
+		if (x->type == XMLNODE_TYPE_ATTRIB && equals(attr, x->name))
+			return x->data;
+	}
+	return NULL;
+}
+
+void
+xmlnode_set_namespace(xmlnode *node, const char *xmlns)
+{
+	g_return_if_fail(node != NULL);
+
+	g_free(node->xmlns);
+	node->xmlns = g_strdup(xmlns);
+}
+
+const char *
+xmlnode_get_namespace(xmlnode *node)
+{
+	g_return_val_if_fail(node != NULL, NULL);
+
+	return node->xmlns;
+}
+
+xmlnode *
+xmlnode_get_child(const xmlnode *parent, const char *name)
+{
+	xmlnode *x;
+
+	g_return_val_if_fail(parent != NULL && name != NULL, NULL);
+
+	for (x = parent->child; x; x = x->next) {
+		if (x->type == XMLNODE_TYPE_TAG && equals(name, x->name))
+			return x;
+	}
+	return NULL;
+}
+
+xmlnode *
+xmlnode_get_next_twin(xmlnode *node)
+{
+	xmlnode *sibling;
+	const char *ns = xmlnode_get_namespace(node);
+
+	g_return_val_if_fail(node->type == XMLNODE_TYPE_TAG, NULL);
+
+	for (sibling = node->next; sibling; sibling = sibling->next) {
+		if (sibling->type == XMLNODE_TYPE_TAG && equals(node->name, sibling->name) &&
+				equals(ns, sibling->xmlns))
+			return sibling;
+	}
+	return NULL;
+}
+
+char *
+xmlnode_get_data(const xmlnode *node)
+{
+	GString *str = NULL;
+	xmlnode *c;
+
+	g_return_val_if_fail(node != NULL, NULL);
+
+	for (c = node->child; c; c = c->next) {
+		if (c->type == XMLNODE_TYPE_DATA) {
+			if (!str)
+				str = g_string_new_len(c->data, c->data_sz);
+			else
+				g_string_append_len(str, c->data, c->data_sz);
+		}
+	}
+	return str ? g_string_free(str, FALSE) : NULL;
+}
+
+static void
+append_escaped(GString *out, const char *text, gssize len)
+{
+	char *escaped = g_markup_escape_text(text, len);
+
+	g_string_append(out, escaped);
+	g_free(escaped);
+}
+
+static void
+node_to_str(const xmlnode *node, GString *out)
+{
+	gboolean has_content = FALSE;
+	xmlnode *c;
+
+	g_string_append_c(out, '<');
+	g_string_append(out, node->name);
+	if (node->xmlns && !(node->parent && equals(node->xmlns, node->parent->xmlns))) {
+		g_string_append(out, " xmlns='");
+		append_escaped(out, node->xmlns, -1);
+		g_string_append_c(out, '\'');
+	}
+	for (c = node->child; c; c = c->next) {
+		if (c->type == XMLNODE_TYPE_ATTRIB) {
+			g_string_append_printf(out, " %s='", c->name);
+			append_escaped(out, c->data, -1);
+			g_string_append_c(out, '\'');
+		} else {
+			has_content = TRUE;
+		}
+	}
+	if (!has_content) {
+		g_string_append(out, "/>");
+		return;
+	}
+	g_string_append_c(out, '>');
+	for (c = node->child; c; c = c->next) {
+		if (c->type == XMLNODE_TYPE_TAG)
+			node_to_str(c, out);
+		else if (c->type == XMLNODE_TYPE_DATA)
+			append_escaped(out, c->data, c->data_sz);
+	}
+	g_string_append_printf(out, "</%s>", node->name);
+}
+
+char *
+xmlnode_to_str(const xmlnode *node, int *len)
+{
+	GString *out = g_string_new(NULL);
+
+	node_to_str(node, out);
+	if (len)
+		*len = out->len;
+	return g_string_free(out, FALSE);
+}
+
+xmlnode *
+xmlnode_copy(const xmlnode *src)
+{
+	xmlnode *ret, *child;
+
+	g_return_val_if_fail(src != NULL, NULL);
+
+	ret = new_node(src->name, src->type);
+	ret->xmlns = g_strdup(src->xmlns);
+	if (src->data && src->data_sz) {  /* data */
+		ret->data = g_strndup(src->data, src->data_sz);
+		ret->data_sz = src->data_sz;
+	} else if (src->data) {           /* attribute value */
+		ret->data = g_strdup(src->data);
+	}
+	for (child = src->child; child; child = child->next)
+		xmlnode_insert_child(ret, xmlnode_copy(child));
+	return ret;
+}
+
+void
+xmlnode_free(xmlnode *node)
+{
+	xmlnode *x, *y;
+
+	g_return_if_fail(node != NULL);
+
+	/* Unlink from the parent, like libpurple does */
+	if (node->parent) {
+		if (node->parent->child == node) {
+			node->parent->child = node->next;
+			if (node->parent->lastchild == node)
+				node->parent->lastchild = node->next;
+		} else {
+			for (x = node->parent->child; x->next != node; x = x->next)
+				;
+			x->next = node->next;
+			if (node->parent->lastchild == node)
+				node->parent->lastchild = x;
+		}
+	}
+	for (x = node->child; x; x = y) {
+		y = x->next;
+		x->parent = NULL;
+		xmlnode_free(x);
+	}
+	g_free(node->name);
+	g_free(node->data);
+	g_free(node->xmlns);
+	g_free(node);
+}
+
+
+/*
+ * debug
+ */
+static void
+debug_vargs(const char *level, const char *category, const char *format, va_list args)
+{
+	if (!g_getenv("STUB_DEBUG"))
+		return;
+	fprintf(stderr, "%s %s: ", level, category);
+	vfprintf(stderr, format, args);
+}
+
+#define DEBUG_FUNC(NAME, LEVEL) \
+	void NAME(const char *category, const char *format, ...) { \
+		va_list args; \
+		va_start(args, format); \
+		debug_vargs(LEVEL, category, format, args); \
+		va_end(args); \
+	}
+
+DEBUG_FUNC(purple_debug_misc, "misc")
+DEBUG_FUNC(purple_debug_info, "info")
+DEBUG_FUNC(purple_debug_warning, "warning")
+DEBUG_FUNC(purple_debug_error, "error")
+
+
+/*
+ * eventloop: timeouts only run from stub_timeouts_run()
+ */
+typedef struct {
+	guint handle;
+	guint interval;  /* msec */
+	GSourceFunc function;
+	gpointer data;
+} StubTimeout;
+
+static GList *timeouts = NULL;  /* entries are StubTimeout*, oldest first */
+static guint next_timeout_handle = 1;
+
+guint
+purple_timeout_add(guint interval, GSourceFunc function, gpointer data)
+{
+	StubTimeout *timeout = g_new0(StubTimeout, 1);
+
+	timeout->handle = next_timeout_handle++;
+	timeout->interval = interval;
+	timeout->function = function;
+	timeout->data = data;
+	timeouts = g_list_append(timeouts, timeout);
+	return timeout->handle;
+}
+
+guint
+purple_timeout_add_seconds(guint interval, GSourceFunc function, gpointer data)
+{
+	return purple_timeout_add(interval * 1000, function, data);
+}
+
+gboolean
+purple_timeout_remove(guint handle)
+{
+	GList *l;
+
+	for (l = timeouts; l; l = l->next) {
+		StubTimeout *timeout = l->data;
+
+		if (timeout->handle == handle) {
+			timeouts = g_list_delete_link(timeouts, l);
+			g_free(timeout);
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+guint
+stub_timeouts_run(void)
+{
+	GList *due = NULL, *l;
+	guint nrun = 0;
+
+	for (l = timeouts; l; l = l->next)
+		due = g_list_append(due, GUINT_TO_POINTER(((StubTimeout *) l->data)->handle));
+
+	/* A callback may remove or add other timeouts */
+	for (l = due; l; l = l->next) {
+		GList *t;
+
+		for (t = timeouts; t; t = t->next) {
+			StubTimeout *timeout = t->data;
+
+			if (timeout->handle == GPOINTER_TO_UINT(l->data)) {
+				nrun++;
+				if (!timeout->function(timeout->data))
+					purple_timeout_remove(GPOINTER_TO_UINT(l->data));
+				break;
+			}
+		}
+	}
+	g_list_free(due);
+	return nrun;
+}
+
+guint
+stub_timeouts_pending(void)
+{
+	return g_list_length(timeouts);
+}
+
+guint
+stub_timeout_last_interval(void)
+{
+	GList *last = g_list_last(timeouts);
+
+	return last ? ((StubTimeout *) last->data)->interval : 0;
+}
+
+
+/*
+ * prefs
+ */
+static GHashTable *prefs = NULL;  /* name -> int value */
+
+static void
+pref_add(const char *name, int value)
+{
+	if (!g_hash_table_contains(prefs, name))
+		g_hash_table_insert(prefs, g_strdup(name), GINT_TO_POINTER(value));
+}
+
+void purple_prefs_add_none(const char *name) { pref_add(name, 0); }
+void purple_prefs_add_bool(const char *name, gboolean value) { pref_add(name, value); }
+void purple_prefs_add_int(const char *name, int value) { pref_add(name, value); }
+
+void
+purple_prefs_set_int(const char *name, int value)
+{
+	g_hash_table_replace(prefs, g_strdup(name), GINT_TO_POINTER(value));
+}
+
+void purple_prefs_set_bool(const char *name, gboolean value) { purple_prefs_set_int(name, value); }
+int purple_prefs_get_int(const char *name) { return GPOINTER_TO_INT(g_hash_table_lookup(prefs, name)); }
+gboolean purple_prefs_get_bool(const char *name) { return purple_prefs_get_int(name) != 0; }
+
+
+/*
+ * signals: the blist and connection signals that the plugin connects to
+ * are emitted by the stub, stanzas sent through "jabber-sending-xmlnode"
+ * are recorded in stub_sent
+ */
+typedef struct {
+	void *instance;
+	char *signal;
+	void *handle;
+	PurpleCallback func;
+	void *data;
+} StubSignalHandler;
+
+static GList *signal_handlers = NULL;  /* entries are StubSignalHandler* */
+static gulong next_signal_id = 1;
+
+GPtrArray *stub_sent = NULL;
+
+gulong
+purple_signal_connect(void *instance, const char *signal, void *handle,
+		PurpleCallback func, void *data)
+{
+	StubSignalHandler *handler = g_new0(StubSignalHandler, 1);
+
+	handler->instance = instance;
+	handler->signal = g_strdup(signal);
+	handler->handle = handle;
+	handler->func = func;
+	handler->data = data;
+	signal_handlers = g_list_append(signal_handlers, handler);
+	return next_signal_id++;
+}
+
+static void
+signal_handler_free(StubSignalHandler *handler)
+{
+	g_free(handler->signal);
+	g_free(handler);
+}
+
+void
+purple_signals_disconnect_by_handle(void *handle)
+{
+	GList *l = signal_handlers;
+
+	while (l) {
+		GList *next = l->next;
+		StubSignalHandler *handler = l->data;
+
+		if (handler->handle == handle) {
+			signal_handler_free(handler);
+			signal_handlers = g_list_delete_link(signal_handlers, l);
+		}
+		l = next;
+	}
+}
+
+void
+purple_signal_emit(void *instance, const char *signal, ...)
+{
+	va_list args;
+	gpointer arg;
+	GList *l;
+
+	va_start(args, signal);
+	if (equals(signal, "jabber-sending-xmlnode")) {
+		xmlnode **packet;
+
+		(void) va_arg(args, PurpleConnection *);
+		packet = va_arg(args, xmlnode **);
+		g_ptr_array_add(stub_sent, xmlnode_to_str(*packet, NULL));
+		va_end(args);
+		return;
+	}
+	/* All other signals that the stub emits have one pointer argument */
+	arg = va_arg(args, gpointer);
+	va_end(args);
+
+	for (l = signal_handlers; l; l = l->next) {
+		StubSignalHandler *handler = l->data;
+
+		if (handler->instance == instance && equals(handler->signal, signal))
+			((void (*)(gpointer, gpointer)) handler->func)(arg, handler->data);
+	}
+}
+
+
+/*
+ * blist
+ */
+struct _PurplePresence {
+	gboolean online;
+};
+
+struct _PurpleBuddy {
+	PurpleBlistNode node;
+	char *name;
+	char *alias;
+	PurpleAccount *account;
+	PurplePresence presence;
+};
+
+struct _PurpleGroup {
+	PurpleBlistNode node;
+	char *name;
+};
+
+static PurpleBlistNode *blist_root = NULL;  /* first group */
+static int blist_handle;
+
+GPtrArray *stub_server_adds = NULL;
+GPtrArray *stub_server_moves = NULL;
+
+void *purple_blist_get_handle(void) { return &blist_handle; }
+PurpleBlistNode *purple_blist_get_root(void) { return blist_root; }
+PurpleBlistNodeType purple_blist_node_get_type(PurpleBlistNode *node) { return node->type; }
+
+PurpleBlistNode *
+purple_blist_node_next(PurpleBlistNode *node, gboolean offline)
+{
+	if (node->child)
+		return node->child;
+	while (node) {
+		if (node->next)
+			return node->next;
+		node = node->parent;
+	}
+	return NULL;
+}
+
+static void
+node_append(PurpleBlistNode **first, PurpleBlistNode *parent, PurpleBlistNode *node)
+{
+	PurpleBlistNode *last = *first;
+
+	node->parent = parent;
+	node->next = NULL;
+	while (last && last->next)
+		last = last->next;
+	node->prev = last;
+	if (last)
+		last->next = node;
+	else
+		*first = node;
+}
+
+static void
+node_unlink(PurpleBlistNode **first, PurpleBlistNode *node)
+{
+	if (node->prev)
+		node->prev->next = node->next;
+	else
+		*first = node->next;
+	if (node->next)
+		node->next->prev = node->prev;
+	node->prev = node->next = node->parent = NULL;
+}
+
+void
+purple_blist_add_group(PurpleGroup *group, PurpleBlistNode *node)
+{
+	PurpleBlistNode *n;
+
+	for (n = blist_root; n; n = n->next) {
+		if (n == &group->node)
+			return;
+	}
+	node_append(&blist_root, NULL, &group->node);
+}
+
+void
+purple_blist_add_buddy(PurpleBuddy *buddy, PurpleContact *contact, PurpleGroup *group,
+		PurpleBlistNode *node)
+{
+	gboolean is_new = (buddy->node.parent == NULL);
+
+	if (!group)
+		group = purple_group_new("Buddies");
+	purple_blist_add_group(group, NULL);
+
+	if (!is_new)
+		node_unlink(&buddy->node.parent->child, &buddy->node);
+	node_append(&group->node.child, &group->node, &buddy->node);
+
+	if (is_new)
+		purple_signal_emit(purple_blist_get_handle(), "buddy-added", buddy);
+}
+
+void
+purple_blist_remove_buddy(PurpleBuddy *buddy)
+{
+	if (buddy->node.parent)
+		node_unlink(&buddy->node.parent->child, &buddy->node);
+	purple_signal_emit(purple_blist_get_handle(), "buddy-removed", buddy);
+
+	g_free(buddy->name);
+	g_free(buddy->alias);
+	g_free(buddy);
+}
+
+void
+purple_blist_alias_buddy(PurpleBuddy *buddy, const char *alias)
+{
+	g_free(buddy->alias);
+	buddy->alias = g_strdup(alias);
+}
+
+void
+purple_blist_request_add_buddy(PurpleAccount *account, const char *username,
+		const char *group, const char *alias)
+{
+}
+
+PurpleBuddy *
+purple_buddy_new(PurpleAccount *account, const char *name, const char *alias)
+{
+	PurpleBuddy *buddy = g_new0(PurpleBuddy, 1);
+
+	buddy->node.type = PURPLE_BLIST_BUDDY_NODE;
+	buddy->name = g_strdup(name);
+	buddy->alias = g_strdup(alias);
+	buddy->account = account;
+	return buddy;
+}
+
+PurpleAccount *purple_buddy_get_account(const PurpleBuddy *buddy) { return buddy->account; }
+const char *purple_buddy_get_name(const PurpleBuddy *buddy) { return buddy->name; }
+const char *purple_buddy_get_alias(PurpleBuddy *buddy) { return buddy->alias ? buddy->alias : buddy->name; }
+const char *purple_buddy_get_local_buddy_alias(PurpleBuddy *buddy) { return buddy->alias; }
+PurpleGroup *purple_buddy_get_group(PurpleBuddy *buddy) { return (PurpleGroup *) buddy->node.parent; }
+PurplePresence *purple_buddy_get_presence(const PurpleBuddy *buddy) { return (PurplePresence *) &buddy->presence; }
+gboolean purple_presence_is_online(const PurplePresence *presence) { return presence->online; }
+void stub_buddy_set_online(PurpleBuddy *buddy, gboolean online) { buddy->presence.online = online; }
+
+PurpleGroup *
+purple_group_new(const char *name)
+{
+	PurpleGroup *group = purple_find_group(name);
+
+	if (!group) {
+		group = g_new0(PurpleGroup, 1);
+		group->node.type = PURPLE_BLIST_GROUP_NODE;
+		group->name = g_strdup(name);
+	}
+	return group;
+}
+
+const char *purple_group_get_name(PurpleGroup *group) { return group ? group->name : NULL; }
+
+PurpleGroup *
+purple_find_group(const char *name)
+{
+	PurpleBlistNode *n;
+
+	for (n = blist_root; n; n = n->next) {
+		if (equals(((PurpleGroup *) n)->name, name))
+			return (PurpleGroup *) n;
+	}
+	return NULL;
+}
+
+/* Like the jabber prpl's normalization: bare jid, lowercased */
+static gboolean
+names_match(const char *a, const char *b)
+{
+	gsize alen = strcspn(a, "/"), blen = strcspn(b, "/");
+
+	return alen == blen && g_ascii_strncasecmp(a, b, alen) == 0;
+}
+
+GSList *
+purple_find_buddies(PurpleAccount *account, const char *name)
+{
+	GSList *buddies = NULL;
+	PurpleBlistNode *g, *b;
+
+	for (g = blist_root; g; g = g->next) {
+		for (b = g->child; b; b = b->next) {
+			PurpleBuddy *buddy = (PurpleBuddy *) b;
+
+			if (buddy->account == account && (!name || names_match(buddy->name, name)))
+				buddies = g_slist_append(buddies, buddy);
+		}
+	}
+	return buddies;
+}
+
+PurpleBuddy *
+purple_find_buddy_in_group(PurpleAccount *account, const char *name, PurpleGroup *group)
+{
+	PurpleBlistNode *b;
+
+	for (b = group ? group->node.child : NULL; b; b = b->next) {
+		PurpleBuddy *buddy = (PurpleBuddy *) b;
+
+		if (buddy->account == account && names_match(buddy->name, name))
+			return buddy;
+	}
+	return NULL;
+}
+
+PurpleBuddy *
+purple_find_buddy(PurpleAccount *account, const char *name)
+{
+	GSList *buddies = purple_find_buddies(account, name);
+	PurpleBuddy *buddy = buddies ? buddies->data : NULL;
+
+	g_slist_free(buddies);
+	return buddy;
+}
+
+
+/*
+ * accounts and connections
+ */
+struct _PurpleAccount {
+	char *username;
+	char *protocol_id;
+	PurpleConnection *gc;
+};
+
+struct _PurpleConnection {
+	PurpleAccount *account;
+	void *proto_data;
+};
+
+static GList *accounts = NULL;     /* entries are PurpleAccount* */
+static GList *connections = NULL;  /* entries are PurpleConnection*, signed on */
+static int connections_handle;
+
+gboolean stub_has_send_raw = TRUE;
+gboolean stub_contact_has_feature = TRUE;
+
+static int
+jabber_send_raw(PurpleConnection *gc, const char *buf, int len)
+{
+	g_ptr_array_add(stub_sent, g_strndup(buf, len));
+	return len;
+}
+
+static PurplePluginProtocolInfo jabber_prpl_info = { jabber_send_raw };
+static PurplePluginProtocolInfo jabber_prpl_info_without_send_raw = { NULL };
+static PurplePluginInfo jabber_info;
+static PurplePlugin jabber_plugin = { TRUE, &jabber_info };
+
+PurpleAccount *
+stub_account_new(const char *username, const char *protocol_id)
+{
+	PurpleAccount *account = g_new0(PurpleAccount, 1);
+
+	account->username = g_strdup(username);
+	account->protocol_id = g_strdup(protocol_id);
+	account->gc = g_new0(PurpleConnection, 1);
+	account->gc->account = account;
+	accounts = g_list_append(accounts, account);
+	connections = g_list_append(connections, account->gc);
+	return account;
+}
+
+void
+stub_connection_set_protocol_data(PurpleConnection *gc, void *proto_data)
+{
+	gc->proto_data = proto_data;
+}
+
+void
+stub_connection_sign_off(PurpleConnection *gc)
+{
+	purple_signal_emit(purple_connections_get_handle(), "signing-off", gc);
+	connections = g_list_remove(connections, gc);
+}
+
+PurpleConnection *purple_account_get_connection(const PurpleAccount *account) { return account->gc; }
+const char *purple_account_get_username(const PurpleAccount *account) { return account->username; }
+const char *purple_account_get_protocol_id(const PurpleAccount *account) { return account->protocol_id; }
+const char *purple_account_get_name_for_display(const PurpleAccount *account) { return account->username; }
+
+void
+purple_account_add_buddy(PurpleAccount *account, PurpleBuddy *buddy)
+{
+	g_ptr_array_add(stub_server_adds, g_strdup(buddy->name));
+}
+
+void purple_account_remove_buddy(PurpleAccount *account, PurpleBuddy *buddy, PurpleGroup *group) { }
+
+PurpleAccount *purple_connection_get_account(const PurpleConnection *gc) { return gc->account; }
+PurplePlugin *purple_connection_get_prpl(const PurpleConnection *gc) { return &jabber_plugin; }
+void *purple_connection_get_protocol_data(const PurpleConnection *gc) { return gc->proto_data; }
+GList *purple_connections_get_all(void) { return connections; }
+void *purple_connections_get_handle(void) { return &connections_handle; }
+
+void serv_alias_buddy(PurpleBuddy *buddy) { }
+
+void
+serv_move_buddy(PurpleBuddy *buddy, PurpleGroup *orig, PurpleGroup *dest)
+{
+	g_ptr_array_add(stub_server_moves, g_strdup(buddy->name));
+}
+
+
+/*
+ * notify and request: windows are kept open until the plugin or a test closes them
+ */
+static GList *windows = NULL;  /* entries are StubWindow*, oldest first */
+static char *notify_last_text = NULL;
+
+static StubWindow *
+window_new(int type, void *handle, void *user_data)
+{
+	StubWindow *window = g_new0(StubWindow, 1);
+
+	window->type = type;
+	window->handle = handle;
+	window->user_data = user_data;
+	windows = g_list_append(windows, window);
+	return window;
+}
+
+static StubWindow *
+window_last(gboolean request)
+{
+	GList *l;
+
+	for (l = g_list_last(windows); l; l = l->prev) {
+		StubWindow *window = l->data;
+
+		if ((window->fields || window->actions) == request)
+			return window;
+	}
+	return NULL;
+}
+
+StubWindow *stub_searchresults_last(void) { return window_last(FALSE); }
+StubWindow *stub_request_last(void) { return window_last(TRUE); }
+guint stub_windows_open(void) { return g_list_length(windows); }
+const char *stub_notify_last_text(void) { return notify_last_text; }
+
+/* Like the UI, which frees the results before libpurple runs the close callback */
+static void
+window_close(StubWindow *window, gboolean run_close_cb)
+{
+	windows = g_list_remove(windows, window);
+
+	if (window->results)
+		purple_notify_searchresults_free(window->results);
+	if (window->fields)
+		purple_request_fields_destroy(window->fields);
+	if (window->actions)
+		g_ptr_array_free(window->actions, TRUE);
+	if (run_close_cb && window->close_cb)
+		window->close_cb(window->user_data);
+	g_free(window->primary);
+	g_free(window->secondary);
+	g_free(window);
+}
+
+static void
+notify_set_last_text(const char *primary, const char *text)
+{
+	g_free(notify_last_text);
+	notify_last_text = g_strconcat(primary ? primary : "", "\n", text ? text : "", NULL);
+}
+
+void *
+purple_notify_message(void *handle, PurpleNotifyMsgType type, const char *title,
+		const char *primary, const char *secondary, PurpleNotifyCloseCallback cb, gpointer user_data)
+{
+	notify_set_last_text(primary, secondary);
+	if (cb)
+		cb(user_data);
+	return NULL;
+}
+
+void *
+purple_notify_formatted(void *handle, const char *title, const char *primary,
+		const char *secondary, const char *text, PurpleNotifyCloseCallback cb, gpointer user_data)
+{
+	notify_set_last_text(primary, text);
+	if (cb)
+		cb(user_data);
+	return NULL;
+}
+
+void *
+purple_notify_searchresults(PurpleConnection *gc, const char *title, const char *primary,
+		const char *secondary, PurpleNotifySearchResults *results, PurpleNotifyCloseCallback cb,
+		gpointer user_data)
+{
+	StubWindow *window = window_new(PURPLE_NOTIFY_SEARCHRESULTS, gc, user_data);
+
+	window->primary = g_strdup(primary);
+	window->results = results;
+	window->close_cb = cb;
+	return window;
+}
+
+void
+purple_notify_close(PurpleNotifyType type, void *ui_handle)
+{
+	if (g_list_find(windows, ui_handle))
+		window_close(ui_handle, TRUE);
+}
+
+void
+purple_notify_close_with_handle(void *handle)
+{
+	GList *l = windows;
+
+	while (l) {
+		StubWindow *window = l->data;
+
+		l = l->next;
+		if (window->handle == handle && !window->fields && !window->actions)
+			window_close(window, TRUE);
+	}
+}
+
+PurpleNotifySearchResults *
+purple_notify_searchresults_new(void)
+{
+	return g_new0(PurpleNotifySearchResults, 1);
+}
+
+static void
+row_free(gpointer row)
+{
+	g_list_free_full(row, g_free);
+}
+
+static void
+column_free(gpointer column)
+{
+	g_free(((PurpleNotifySearchColumn *) column)->title);
+	g_free(column);
+}
+
+static void
+button_free(gpointer button)
+{
+	g_free(((PurpleNotifySearchButton *) button)->label);
+	g_free(button);
+}
+
+void
+purple_notify_searchresults_free(PurpleNotifySearchResults *results)
+{
+	g_list_free_full(results->rows, row_free);
+	g_list_free_full(results->columns, column_free);
+	g_list_free_full(results->buttons, button_free);
+	g_free(results);
+}
+
+PurpleNotifySearchColumn *
+purple_notify_searchresults_column_new(const char *title)
+{
+	PurpleNotifySearchColumn *column = g_new0(PurpleNotifySearchColumn, 1);
+
+	column->title = g_strdup(title);
+	return column;
+}
+
+void
+purple_notify_searchresults_column_add(PurpleNotifySearchResults *results,
+		PurpleNotifySearchColumn *column)
+{
+	results->columns = g_list_append(results->columns, column);
+}
+
+void
+purple_notify_searchresults_row_add(PurpleNotifySearchResults *results, GList *row)
+{
+	results->rows = g_list_append(results->rows, row);
+}
+
+void
+purple_notify_searchresults_button_add(PurpleNotifySearchResults *results,
+		PurpleNotifySearchButtonType type, PurpleNotifySearchResultsCallback cb)
+{
+	PurpleNotifySearchButton *button = g_new0(PurpleNotifySearchButton, 1);
+
+	button->type = type;
+	button->callback = cb;
+	results->buttons = g_list_append(results->buttons, button);
+}
+
+void
+purple_notify_searchresults_button_add_labeled(PurpleNotifySearchResults *results,
+		const char *label, PurpleNotifySearchResultsCallback cb)
+{
+	PurpleNotifySearchButton *button = g_new0(PurpleNotifySearchButton, 1);
+
+	button->type = PURPLE_NOTIFY_BUTTON_LABELED;
+	button->callback = cb;
+	button->label = g_strdup(label);
+	results->buttons = g_list_append(results->buttons, button);
+}
+
+struct _PurpleRequestFields {
+	GList *groups;  /* entries are PurpleRequestFieldGroup* */
+};
+
+struct _PurpleRequestFieldGroup {
+	char *title;
+	GList *fields;  /* entries are PurpleRequestField* */
+};
+
+struct _PurpleRequestField {
+	PurpleRequestFieldType type;
+	char *id;
+	char *label;
+	int value;         /* boolean value or choice index */
+	GList *labels;     /* choice labels */
+};
+
+void *
+purple_request_fields(void *handle, const char *title, const char *primary,
+		const char *secondary, PurpleRequestFields *fields,
+		const char *ok_text, GCallback ok_cb, const char *cancel_text, GCallback cancel_cb,
+		PurpleAccount *account, const char *who, PurpleConversation *conv, void *user_data)
+{
+	StubWindow *window = window_new(PURPLE_REQUEST_FIELDS, handle, user_data);
+
+	window->primary = g_strdup(primary);
+	window->fields = fields;
+	window->ok_cb = ok_cb;
+	window->cancel_cb = cancel_cb;
+	return window;
+}
+
+void *
+purple_request_action(void *handle, const char *title, const char *primary,
+		const char *secondary, int default_action, PurpleAccount *account, const char *who,
+		PurpleConversation *conv, void *user_data, size_t action_count, ...)
+{
+	StubWindow *window = window_new(PURPLE_REQUEST_ACTION, handle, user_data);
+	va_list args;
+	size_t i;
+
+	window->primary = g_strdup(primary);
+	window->secondary = g_strdup(secondary);
+	window->actions = g_ptr_array_new();
+	va_start(args, action_count);
+	for (i = 0; i < action_count; i++) {
+		(void) va_arg(args, const char *);
+		g_ptr_array_add(window->actions, va_arg(args, gpointer));
+	}
+	va_end(args);
+	return window;
+}
+
+void
+purple_request_close(PurpleRequestType type, void *uihandle)
+{
+	if (g_list_find(windows, uihandle))
+		window_close(uihandle, FALSE);
+}
+
+void
+purple_request_close_with_handle(void *handle)
+{
+	GList *l = windows;
+
+	while (l) {
+		StubWindow *window = l->data;
+
+		l = l->next;
+		if (window->handle == handle && (window->fields || window->actions))
+			window_close(window, FALSE);
+	}
+}
+
+void
+stub_request_ok(StubWindow *window)
+{
+	((PurpleRequestFieldsCb) window->ok_cb)(window->user_data, window->fields);
+	window_close(window, FALSE);
+}
+
+void
+stub_request_cancel(StubWindow *window)
+{
+	((PurpleRequestFieldsCb) window->cancel_cb)(window->user_data, window->fields);
+	window_close(window, FALSE);
+}
+
+void
+stub_request_action(StubWindow *window, guint action)
+{
+	PurpleRequestActionCb cb = g_ptr_array_index(window->actions, action);
+
+	if (cb)
+		cb(window->user_data, action);
+	window_close(window, FALSE);
+}
+
+PurpleRequestFields *
+purple_request_fields_new(void)
+{
+	return g_new0(PurpleRequestFields, 1);
+}
+
+static void
+field_free(gpointer _field)
+{
+	PurpleRequestField *field = _field;
+
+	g_list_free_full(field->labels, g_free);
+	g_free(field->id);
+	g_free(field->label);
+	g_free(field);
+}
+
+static void
+field_group_free(gpointer _group)
+{
+	PurpleRequestFieldGroup *group = _group;
+
+	g_list_free_full(group->fields, field_free);
+	g_free(group->title);
+	g_free(group);
+}
+
+void
+purple_request_fields_destroy(PurpleRequestFields *fields)
+{
+	g_list_free_full(fields->groups, field_group_free);
+	g_free(fields);
+}
+
+void
+purple_request_fields_add_group(PurpleRequestFields *fields, PurpleRequestFieldGroup *group)
+{
+	fields->groups = g_list_append(fields->groups, group);
+}
+
+GList *purple_request_fields_get_groups(const PurpleRequestFields *fields) { return fields->groups; }
+
+int
+purple_request_fields_get_choice(const PurpleRequestFields *fields, const char *id)
+{
+	GList *g, *f;
+
+	for (g = fields->groups; g; g = g->next) {
+		for (f = ((PurpleRequestFieldGroup *) g->data)->fields; f; f = f->next) {
+			PurpleRequestField *field = f->data;
+
+			if (field->type == PURPLE_REQUEST_FIELD_CHOICE && equals(field->id, id))
+				return field->value;
+		}
+	}
+	return -1;
+}
+
+PurpleRequestFieldGroup *
+purple_request_field_group_new(const char *title)
+{
+	PurpleRequestFieldGroup *group = g_new0(PurpleRequestFieldGroup, 1);
+
+	group->title = g_strdup(title);
+	return group;
+}
+
+void
+purple_request_field_group_add_field(PurpleRequestFieldGroup *group, PurpleRequestField *field)
+{
+	group->fields = g_list_append(group->fields, field);
+}
+
+const char *purple_request_field_group_get_title(const PurpleRequestFieldGroup *group) { return group->title; }
+GList *purple_request_field_group_get_fields(const PurpleRequestFieldGroup *group) { return group->fields; }
+
+static PurpleRequestField *
+field_new(PurpleRequestFieldType type, const char *id, const char *text, int value)
+{
+	PurpleRequestField *field = g_new0(PurpleRequestField, 1);
+
+	field->type = type;
+	field->id = g_strdup(id);
+	field->label = g_strdup(text);
+	field->value = value;
+	return field;
+}
+
+PurpleRequestField *
+purple_request_field_bool_new(const char *id, const char *text, gboolean default_value)
+{
+	return field_new(PURPLE_REQUEST_FIELD_BOOLEAN, id, text, default_value);
+}
+
+PurpleRequestField *
+purple_request_field_choice_new(const char *id, const char *text, int default_value)
+{
+	return field_new(PURPLE_REQUEST_FIELD_CHOICE, id, text, default_value);
+}
+
+void purple_request_field_bool_set_value(PurpleRequestField *field, gboolean value) { field->value = value; }
+gboolean purple_request_field_bool_get_value(const PurpleRequestField *field) { return field->value; }
+void purple_request_field_choice_set_value(PurpleRequestField *field, int value) { field->value = value; }
+const char *purple_request_field_get_id(const PurpleRequestField *field) { return field->id; }
+const char *purple_request_field_get_label(const PurpleRequestField *field) { return field->label; }
+
+void
+purple_request_field_choice_add(PurpleRequestField *field, const char *label)
+{
+	field->labels = g_list_append(field->labels, g_strdup(label));
+}
+
+
+/*
+ * plugins
+ */
+PurplePlugin *
+purple_plugins_find_with_id(const char *id)
+{
+	return equals(id, "prpl-jabber") ? &jabber_plugin : NULL;
+}
+
+void *
+purple_plugin_ipc_call(PurplePlugin *plugin, const char *command, gboolean *ok, ...)
+{
+	*ok = (plugin == &jabber_plugin);
+	if (*ok && equals(command, "contact_has_feature"))
+		return GINT_TO_POINTER(stub_contact_has_feature);
+	return NULL;
+}
+
+PurplePluginAction *
+purple_plugin_action_new(const char *label, void (*callback)(PurplePluginAction *))
+{
+	PurplePluginAction *action = g_new0(PurplePluginAction, 1);
+
+	action->label = g_strdup(label);
+	action->callback = callback;
+	return action;
+}
+
+/* The preference frame is built but never shown */
+struct _PurplePluginPrefFrame {
+	GList *prefs;
+};
+
+struct _PurplePluginPref {
+	char *name;
+	char *label;
+};
+
+PurplePluginPrefFrame *purple_plugin_pref_frame_new(void) { return g_new0(PurplePluginPrefFrame, 1); }
+
+void
+purple_plugin_pref_frame_add(PurplePluginPrefFrame *frame, PurplePluginPref *pref)
+{
+	frame->prefs = g_list_append(frame->prefs, pref);
+}
+
+PurplePluginPref *
+purple_plugin_pref_new_with_name_and_label(const char *name, const char *label)
+{
+	PurplePluginPref *pref = g_new0(PurplePluginPref, 1);
+
+	pref->name = g_strdup(name);
+	pref->label = g_strdup(label);
+	return pref;
+}
+
+void purple_plugin_pref_set_type(PurplePluginPref *pref, PurplePluginPrefType type) { }
+void purple_plugin_pref_add_choice(PurplePluginPref *pref, const char *label, gpointer choice) { }
+void purple_plugin_pref_set_bounds(PurplePluginPref *pref, int min, int max) { }
+
+
+/*
+ * util
+ */
+static char *user_dir = NULL;
+
+PurpleMenuAction *
+purple_menu_action_new(const char *label, PurpleCallback callback, gpointer data, GList *children)
+{
+	PurpleMenuAction *action = g_new0(PurpleMenuAction, 1);
+
+	action->label = g_strdup(label);
+	action->callback = callback;
+	action->data = data;
+	action->children = children;
+	return action;
+}
+
+const char *
+purple_user_dir(void)
+{
+	if (!user_dir)
+		user_dir = g_dir_make_tmp("rosterx-test-XXXXXX", NULL);
+	return user_dir;
+}
+
+gboolean
+purple_util_write_data_to_file(const char *filename, const char *data, gssize size)
+{
+	char *path = g_build_filename(purple_user_dir(), filename, NULL);
+	gboolean ok = g_file_set_contents(path, data, size, NULL);
+
+	g_free(path);
+	return ok;
+}
+
+gchar *
+purple_strreplace(const char *string, const char *delimiter, const char *replacement)
+{
+	gchar **split = g_strsplit(string, delimiter, 0);
+	gchar *ret = g_strjoinv(replacement, split);
+
+	g_strfreev(split);
+	return ret;
+}
+
+
+/*
+ * Test hooks
+ */
+static void
+user_dir_remove(void)
+{
+	GDir *dir;
+	const char *name;
+
+	if (!user_dir)
+		return;
+	dir = g_dir_open(user_dir, 0, NULL);
+	while (dir && (name = g_dir_read_name(dir))) {
+		char *path = g_build_filename(user_dir, name, NULL);
+
+		g_remove(path);
+		g_free(path);
+	}
+	if (dir)
+		g_dir_close(dir);
+	g_rmdir(user_dir);
+	g_free(user_dir);
+	user_dir = NULL;
+}
+
+void
+stub_reset(void)
+{
+	jabber_info.extra_info = stub_has_send_raw ? &jabber_prpl_info : &jabber_prpl_info_without_send_raw;
+	stub_contact_has_feature = TRUE;
+
+	/* Nothing that is torn down here may reach the plugin */
+	g_list_free_full(signal_handlers, (GDestroyNotify) signal_handler_free);
+	signal_handlers = NULL;
+
+	while (windows)
+		window_close(windows->data, FALSE);
+	while (timeouts)
+		purple_timeout_remove(((StubTimeout *) timeouts->data)->handle);
+	while (blist_root) {
+		PurpleGroup *group = (PurpleGroup *) blist_root;
+
+		while (group->node.child)
+			purple_blist_remove_buddy((PurpleBuddy *) group->node.child);
+		node_unlink(&blist_root, &group->node);
+		g_free(group->name);
+		g_free(group);
+	}
+	while (accounts) {
+		PurpleAccount *account = accounts->data;
+
+		accounts = g_list_delete_link(accounts, accounts);
+		connections = g_list_remove(connections, account->gc);
+		g_free(account->gc);
+		g_free(account->username);
+		g_free(account->protocol_id);
+		g_free(account);
+	}
+	if (prefs)
+		g_hash_table_destroy(prefs);
+	prefs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	if (stub_sent)
+		g_ptr_array_free(stub_sent, TRUE);
+	stub_sent = g_ptr_array_new_with_free_func(g_free);
+	if (stub_server_adds)
+		g_ptr_array_free(stub_server_adds, TRUE);
+	stub_server_adds = g_ptr_array_new_with_free_func(g_free);
+	if (stub_server_moves)
+		g_ptr_array_free(stub_server_moves, TRUE);
+	stub_server_moves = g_ptr_array_new_with_free_func(g_free);
+	g_free(notify_last_text);
+	notify_last_text = NULL;
+
+	user_dir_remove();
+}
@@ -0,0 +1,524 @@
+/*
+ * Minimal stub of the libpurple 2.x API used by xmpp-rosterx.c
+ *
+ * Copyright (C) 2017  Dustin Gathmann
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ *
+ */
+
+/*
+ * Only the functions, macros and struct members that the plugin uses are
+ * declared, with the same names and signatures as in libpurple. They are
+ * implemented in purple.c just far enough for the plugin's conversion and
+ * processing functions to run outside of a client: the blist has groups
+ * with buddies but no contacts, timeouts only fire when a test runs them,
+ * and windows are recorded instead of shown.
+ *
+ * The stub_*() functions at the end drive the stub from the tests.
+ */
+#ifndef ROSTERX_LIBPURPLE_STUB_H
+#define ROSTERX_LIBPURPLE_STUB_H
+
+#include <glib.h>
+#include <time.h>
+
+typedef struct _PurpleAccount PurpleAccount;
+typedef struct _PurpleConnection PurpleConnection;
+typedef struct _PurpleConversation PurpleConversation;
+typedef struct _PurplePlugin PurplePlugin;
+typedef struct _PurplePluginInfo PurplePluginInfo;
+typedef struct _PurplePluginAction PurplePluginAction;
+typedef struct _PurplePresence PurplePresence;
+
+typedef void (*PurpleCallback)(void);
+#define PURPLE_CALLBACK(func) ((PurpleCallback)(func))
+
+
+/*
+ * xmlnode.h
+ */
+typedef enum {
+	XMLNODE_TYPE_TAG,
+	XMLNODE_TYPE_ATTRIB,
+	XMLNODE_TYPE_DATA
+} XMLNodeType;
+
+typedef struct _xmlnode xmlnode;
+struct _xmlnode {
+	char *name;
+	char *xmlns;
+	XMLNodeType type;
+	char *data;
+	size_t data_sz;
+	xmlnode *parent;
+	xmlnode *child;
+	xmlnode *lastchild;
+	xmlnode *next;
+};
+
+xmlnode *xmlnode_new(const char *name);
+xmlnode *xmlnode_new_child(xmlnode *parent, const char *name);
+void xmlnode_insert_child(xmlnode *parent, xmlnode *child);
+void xmlnode_insert_data(xmlnode *node, const char *data, gssize size);
+void xmlnode_set_attrib(xmlnode *node, const char *attr, const char *value);
+const char *xmlnode_get_attrib(const xmlnode *node, const char *attr);
+void xmlnode_set_namespace(xmlnode *node, const char *xmlns);
+const char *xmlnode_get_namespace(xmlnode *node);
+xmlnode *xmlnode_get_child(const xmlnode *parent, const char *name);
+xmlnode *xmlnode_get_next_twin(xmlnode *node);
+char *xmlnode_get_data(const xmlnode *node);
+char *xmlnode_to_str(const xmlnode *node, int *len);
+xmlnode *xmlnode_copy(const xmlnode *src);
+void xmlnode_free(xmlnode *node);
+
+
+/*
+ * debug.h
+ */
+void purple_debug_misc(const char *category, const char *format, ...) G_GNUC_PRINTF(2, 3);
+void purple_debug_info(const char *category, const char *format, ...) G_GNUC_PRINTF(2, 3);
+void purple_debug_warning(const char *category, const char *format, ...) G_GNUC_PRINTF(2, 3);
+void purple_debug_error(const char *category, const char *format, ...) G_GNUC_PRINTF(2, 3);
+
+
+/*
+ * eventloop.h
+ */
+guint purple_timeout_add(guint interval, GSourceFunc function, gpointer data);
+guint purple_timeout_add_seconds(guint interval, GSourceFunc function, gpointer data);
+gboolean purple_timeout_remove(guint handle);
+
+
+/*
+ * prefs.h
+ */
+void purple_prefs_add_none(const char *name);
+void purple_prefs_add_bool(const char *name, gboolean value);
+void purple_prefs_add_int(const char *name, int value);
+void purple_prefs_set_bool(const char *name, gboolean value);
+void purple_prefs_set_int(const char *name, int value);
+gboolean purple_prefs_get_bool(const char *name);
+int purple_prefs_get_int(const char *name);
+
+
+/*
+ * signals.h
+ */
+gulong purple_signal_connect(void *instance, const char *signal, void *handle,
+		PurpleCallback func, void *data);
+void purple_signal_emit(void *instance, const char *signal, ...);
+void purple_signals_disconnect_by_handle(void *handle);
+
+
+/*
+ * blist.h, without contacts: buddies are children of their group
+ */
+typedef enum {
+	PURPLE_BLIST_GROUP_NODE,
+	PURPLE_BLIST_CONTACT_NODE,
+	PURPLE_BLIST_BUDDY_NODE,
+	PURPLE_BLIST_CHAT_NODE,
+	PURPLE_BLIST_OTHER_NODE
+} PurpleBlistNodeType;
+
+typedef struct _PurpleBlistNode PurpleBlistNode;
+struct _PurpleBlistNode {
+	PurpleBlistNodeType type;
+	PurpleBlistNode *prev;
+	PurpleBlistNode *next;
+	PurpleBlistNode *parent;
+	PurpleBlistNode *child;
+};
+
+typedef struct _PurpleBuddy PurpleBuddy;
+typedef struct _PurpleContact PurpleContact;
+typedef struct _PurpleGroup PurpleGroup;
+
+#define PURPLE_BLIST_NODE_IS_BUDDY(n) (purple_blist_node_get_type(n) == PURPLE_BLIST_BUDDY_NODE)
+#define PURPLE_BUDDY_IS_ONLINE(b) \
+	((b) != NULL && purple_presence_is_online(purple_buddy_get_presence(b)))
+
+void *purple_blist_get_handle(void);
+PurpleBlistNode *purple_blist_get_root(void);
+PurpleBlistNode *purple_blist_node_next(PurpleBlistNode *node, gboolean offline);
+PurpleBlistNodeType purple_blist_node_get_type(PurpleBlistNode *node);
+void purple_blist_add_buddy(PurpleBuddy *buddy, PurpleContact *contact, PurpleGroup *group,
+		PurpleBlistNode *node);
+void purple_blist_add_group(PurpleGroup *group, PurpleBlistNode *node);
+void purple_blist_remove_buddy(PurpleBuddy *buddy);
+void purple_blist_alias_buddy(PurpleBuddy *buddy, const char *alias);
+void purple_blist_request_add_buddy(PurpleAccount *account, const char *username,
+		const char *group, const char *alias);
+
+PurpleBuddy *purple_buddy_new(PurpleAccount *account, const char *name, const char *alias);
+PurpleAccount *purple_buddy_get_account(const PurpleBuddy *buddy);
+const char *purple_buddy_get_name(const PurpleBuddy *buddy);
+const char *purple_buddy_get_alias(PurpleBuddy *buddy);
+const char *purple_buddy_get_local_buddy_alias(PurpleBuddy *buddy);
+PurpleGroup *purple_buddy_get_group(PurpleBuddy *buddy);
+PurplePresence *purple_buddy_get_presence(const PurpleBuddy *buddy);
+gboolean purple_presence_is_online(const PurplePresence *presence);
+
+PurpleGroup *purple_group_new(const char *name);
+const char *purple_group_get_name(PurpleGroup *group);
+
+PurpleBuddy *purple_find_buddy(PurpleAccount *account, const char *name);
+PurpleBuddy *purple_find_buddy_in_group(PurpleAccount *account, const char *name,
+		PurpleGroup *group);
+GSList *purple_find_buddies(PurpleAccount *account, const char *name);
+PurpleGroup *purple_find_group(const char *name);
+
+
+/*
+ * account.h, connection.h
+ */
+PurpleConnection *purple_account_get_connection(const PurpleAccount *account);
+const char *purple_account_get_username(const PurpleAccount *account);
+const char *purple_account_get_protocol_id(const PurpleAccount *account);
+const char *purple_account_get_name_for_display(const PurpleAccount *account);
+void purple_account_add_buddy(PurpleAccount *account, PurpleBuddy *buddy);
+void purple_account_remove_buddy(PurpleAccount *account, PurpleBuddy *buddy, PurpleGroup *group);
+
+#define PURPLE_CONNECTION_IS_VALID(gc) (g_list_find(purple_connections_get_all(), (gc)) != NULL)
+
+PurpleAccount *purple_connection_get_account(const PurpleConnection *gc);
+PurplePlugin *purple_connection_get_prpl(const PurpleConnection *gc);
+void *purple_connection_get_protocol_data(const PurpleConnection *gc);
+GList *purple_connections_get_all(void);
+void *purple_connections_get_handle(void);
+
+
+/*
+ * server.h
+ */
+void serv_alias_buddy(PurpleBuddy *buddy);
+void serv_move_buddy(PurpleBuddy *buddy, PurpleGroup *orig, PurpleGroup *dest);
+
+
+/*
+ * notify.h
+ */
+typedef enum {
+	PURPLE_NOTIFY_MESSAGE,
+	PURPLE_NOTIFY_EMAIL,
+	PURPLE_NOTIFY_EMAILS,
+	PURPLE_NOTIFY_FORMATTED,
+	PURPLE_NOTIFY_SEARCHRESULTS,
+	PURPLE_NOTIFY_USERINFO,
+	PURPLE_NOTIFY_URI
+} PurpleNotifyType;
+
+typedef enum {
+	PURPLE_NOTIFY_MSG_ERROR,
+	PURPLE_NOTIFY_MSG_WARNING,
+	PURPLE_NOTIFY_MSG_INFO
+} PurpleNotifyMsgType;
+
+typedef enum {
+	PURPLE_NOTIFY_BUTTON_LABELED,
+	PURPLE_NOTIFY_BUTTON_CONTINUE,
+	PURPLE_NOTIFY_BUTTON_ADD,
+	PURPLE_NOTIFY_BUTTON_INFO,
+	PURPLE_NOTIFY_BUTTON_IM,
+	PURPLE_NOTIFY_BUTTON_JOIN,
+	PURPLE_NOTIFY_BUTTON_INVITE
+} PurpleNotifySearchButtonType;
+
+typedef void (*PurpleNotifyCloseCallback)(gpointer user_data);
+typedef void (*PurpleNotifySearchResultsCallback)(PurpleConnection *c, GList *row, gpointer user_data);
+
+typedef struct {
+	PurpleNotifySearchButtonType type;
+	PurpleNotifySearchResultsCallback callback;
+	char *label;
+} PurpleNotifySearchButton;
+
+typedef struct {
+	char *title;
+} PurpleNotifySearchColumn;
+
+typedef struct {
+	GList *columns;  /* entries are PurpleNotifySearchColumn* */
+	GList *rows;     /* entries are GList* of char* */
+	GList *buttons;  /* entries are PurpleNotifySearchButton* */
+} PurpleNotifySearchResults;
+
+void *purple_notify_message(void *handle, PurpleNotifyMsgType type, const char *title,
+		const char *primary, const char *secondary, PurpleNotifyCloseCallback cb, gpointer user_data);
+void *purple_notify_formatted(void *handle, const char *title, const char *primary,
+		const char *secondary, const char *text, PurpleNotifyCloseCallback cb, gpointer user_data);
+void *purple_notify_searchresults(PurpleConnection *gc, const char *title, const char *primary,
+		const char *secondary, PurpleNotifySearchResults *results, PurpleNotifyCloseCallback cb,
+		gpointer user_data);
+void purple_notify_close(PurpleNotifyType type, void *ui_handle);
+void purple_notify_close_with_handle(void *handle);
+
+#define purple_notify_info(handle, title, primary, secondary) \
+	purple_notify_message((handle), PURPLE_NOTIFY_MSG_INFO, (title), (primary), (secondary), NULL, NULL)
+#define purple_notify_error(handle, title, primary, secondary) \
+	purple_notify_message((handle), PURPLE_NOTIFY_MSG_ERROR, (title), (primary), (secondary), NULL, NULL)
+
+PurpleNotifySearchResults *purple_notify_searchresults_new(void);
+void purple_notify_searchresults_free(PurpleNotifySearchResults *results);
+PurpleNotifySearchColumn *purple_notify_searchresults_column_new(const char *title);
+void purple_notify_searchresults_column_add(PurpleNotifySearchResults *results,
+		PurpleNotifySearchColumn *column);
+void purple_notify_searchresults_row_add(PurpleNotifySearchResults *results, GList *row);
+void purple_notify_searchresults_button_add(PurpleNotifySearchResults *results,
+		PurpleNotifySearchButtonType type, PurpleNotifySearchResultsCallback cb);
+void purple_notify_searchresults_button_add_labeled(PurpleNotifySearchResults *results,
+		const char *label, PurpleNotifySearchResultsCallback cb);
+
+
+/*
+ * request.h
+ */
+typedef enum {
+	PURPLE_REQUEST_INPUT,
+	PURPLE_REQUEST_CHOICE,
+	PURPLE_REQUEST_ACTION,
+	PURPLE_REQUEST_FIELDS,
+	PURPLE_REQUEST_FILE,
+	PURPLE_REQUEST_FOLDER
+} PurpleRequestType;
+
+typedef enum {
+	PURPLE_REQUEST_FIELD_NONE,
+	PURPLE_REQUEST_FIELD_STRING,
+	PURPLE_REQUEST_FIELD_INTEGER,
+	PURPLE_REQUEST_FIELD_BOOLEAN,
+	PURPLE_REQUEST_FIELD_CHOICE
+} PurpleRequestFieldType;
+
+typedef struct _PurpleRequestFields PurpleRequestFields;
+typedef struct _PurpleRequestFieldGroup PurpleRequestFieldGroup;
+typedef struct _PurpleRequestField PurpleRequestField;
+
+typedef void (*PurpleRequestActionCb)(void *user_data, int action);
+typedef void (*PurpleRequestFieldsCb)(void *user_data, PurpleRequestFields *fields);
+
+void *purple_request_fields(void *handle, const char *title, const char *primary,
+		const char *secondary, PurpleRequestFields *fields,
+		const char *ok_text, GCallback ok_cb, const char *cancel_text, GCallback cancel_cb,
+		PurpleAccount *account, const char *who, PurpleConversation *conv, void *user_data);
+void *purple_request_action(void *handle, const char *title, const char *primary,
+		const char *secondary, int default_action, PurpleAccount *account, const char *who,
+		PurpleConversation *conv, void *user_data, size_t action_count, ...);
+void purple_request_close(PurpleRequestType type, void *uihandle);
+void purple_request_close_with_handle(void *handle);
+
+PurpleRequestFields *purple_request_fields_new(void);
+void purple_request_fields_destroy(PurpleRequestFields *fields);
+void purple_request_fields_add_group(PurpleRequestFields *fields, PurpleRequestFieldGroup *group);
+GList *purple_request_fields_get_groups(const PurpleRequestFields *fields);
+int purple_request_fields_get_choice(const PurpleRequestFields *fields, const char *id);
+
+PurpleRequestFieldGroup *purple_request_field_group_new(const char *title);
+void purple_request_field_group_add_field(PurpleRequestFieldGroup *group, PurpleRequestField *field);
+const char *purple_request_field_group_get_title(const PurpleRequestFieldGroup *group);
+GList *purple_request_field_group_get_fields(const PurpleRequestFieldGroup *group);
+
+PurpleRequestField *purple_request_field_bool_new(const char *id, const char *text,
+		gboolean default_value);
+void purple_request_field_bool_set_value(PurpleRequestField *field, gboolean value);
+gboolean purple_request_field_bool_get_value(const PurpleRequestField *field);
+PurpleRequestField *purple_request_field_choice_new(const char *id, const char *text,
+		int default_value);
+void purple_request_field_choice_add(PurpleRequestField *field, const char *label);
+void purple_request_field_choice_set_value(PurpleRequestField *field, int value);
+const char *purple_request_field_get_id(const PurpleRequestField *field);
+const char *purple_request_field_get_label(const PurpleRequestField *field);
+
+
+/*
+ * plugin.h, pluginpref.h, prpl.h
+ */
+typedef enum {
+	PURPLE_PLUGIN_UNKNOWN  = -1,
+	PURPLE_PLUGIN_STANDARD = 0,
+	PURPLE_PLUGIN_LOADER,
+	PURPLE_PLUGIN_PROTOCOL
+} PurplePluginType;
+
+#define PURPLE_PRIORITY_DEFAULT  0
+#define PURPLE_PLUGIN_MAGIC      5
+#define PURPLE_MAJOR_VERSION     2
+#define PURPLE_MINOR_VERSION     10
+
+typedef struct _PurplePluginPrefFrame PurplePluginPrefFrame;
+typedef struct _PurplePluginPref PurplePluginPref;
+
+typedef enum {
+	PURPLE_PLUGIN_PREF_NONE,
+	PURPLE_PLUGIN_PREF_CHOICE,
+	PURPLE_PLUGIN_PREF_INFO,
+	PURPLE_PLUGIN_PREF_STRING_FORMAT
+} PurplePluginPrefType;
+
+typedef struct {
+	PurplePluginPrefFrame *(*get_plugin_pref_frame)(PurplePlugin *plugin);
+	int page_num;
+	PurplePluginPrefFrame *frame;
+	void (*_purple_reserved1)(void);
+	void (*_purple_reserved2)(void);
+	void (*_purple_reserved3)(void);
+	void (*_purple_reserved4)(void);
+} PurplePluginUiInfo;
+
+struct _PurplePluginInfo {
+	unsigned int magic;
+	unsigned int major_version;
+	unsigned int minor_version;
+	PurplePluginType type;
+	char *ui_requirement;
+	unsigned long flags;
+	GList *dependencies;
+	int priority;
+	char *id;
+	char *name;
+	char *version;
+	char *summary;
+	char *description;
+	char *author;
+	char *homepage;
+	gboolean (*load)(PurplePlugin *plugin);
+	gboolean (*unload)(PurplePlugin *plugin);
+	void (*destroy)(PurplePlugin *plugin);
+	void *ui_info;
+	void *extra_info;
+	PurplePluginUiInfo *prefs_info;
+	GList *(*actions)(PurplePlugin *plugin, gpointer context);
+	void (*_purple_reserved1)(void);
+	void (*_purple_reserved2)(void);
+	void (*_purple_reserved3)(void);
+	void (*_purple_reserved4)(void);
+};
+
+struct _PurplePlugin {
+	gboolean loaded;
+	PurplePluginInfo *info;
+};
+
+struct _PurplePluginAction {
+	char *label;
+	void (*callback)(PurplePluginAction *);
+	PurplePlugin *plugin;
+	gpointer context;
+	gpointer user_data;
+};
+
+/* Only the members that the plugin uses */
+typedef struct {
+	int (*send_raw)(PurpleConnection *gc, const char *buf, int len);
+} PurplePluginProtocolInfo;
+
+#define PURPLE_PLUGIN_PROTOCOL_INFO(plugin) ((PurplePluginProtocolInfo *)(plugin)->info->extra_info)
+#define PURPLE_PROTOCOL_PLUGIN_HAS_FUNC(prpl, member) ((prpl)->member != NULL)
+
+#define PURPLE_INIT_PLUGIN(pluginname, initfunc, plugininfo) \
+	gboolean purple_init_plugin(PurplePlugin *plugin); \
+	gboolean purple_init_plugin(PurplePlugin *plugin) { \
+		plugin->info = &(plugininfo); \
+		initfunc((plugin)); \
+		return TRUE; \
+	}
+
+PurplePlugin *purple_plugins_find_with_id(const char *id);
+void *purple_plugin_ipc_call(PurplePlugin *plugin, const char *command, gboolean *ok, ...);
+PurplePluginAction *purple_plugin_action_new(const char *label, void (*callback)(PurplePluginAction *));
+
+PurplePluginPrefFrame *purple_plugin_pref_frame_new(void);
+void purple_plugin_pref_frame_add(PurplePluginPrefFrame *frame, PurplePluginPref *pref);
+PurplePluginPref *purple_plugin_pref_new_with_name_and_label(const char *name, const char *label);
+void purple_plugin_pref_set_type(PurplePluginPref *pref, PurplePluginPrefType type);
+void purple_plugin_pref_add_choice(PurplePluginPref *pref, const char *label, gpointer choice);
+void purple_plugin_pref_set_bounds(PurplePluginPref *pref, int min, int max);
+
+
+/*
+ * util.h
+ */
+typedef struct {
+	char *label;
+	PurpleCallback callback;
+	gpointer data;
+	GList *children;
+} PurpleMenuAction;
+
+PurpleMenuAction *purple_menu_action_new(const char *label, PurpleCallback callback,
+		gpointer data, GList *children);
+const char *purple_user_dir(void);
+gboolean purple_util_write_data_to_file(const char *filename, const char *data, gssize size);
+gchar *purple_strreplace(const char *string, const char *delimiter, const char *replacement);
+
+
+/*
+ * Test hooks
+ */
+
+/* Resets all state and removes the user dir, a temporary directory created on first use */
+void stub_reset(void);
+
+/* Creates an account on a connection that is signed on */
+PurpleAccount *stub_account_new(const char *username, const char *protocol_id);
+void stub_connection_set_protocol_data(PurpleConnection *gc, void *proto_data);
+/* Emits "signing-off", then the connection is no longer valid */
+void stub_connection_sign_off(PurpleConnection *gc);
+void stub_buddy_set_online(PurpleBuddy *buddy, gboolean online);
+
+/* Runs every timeout that is due at the time of the call once, returns how many ran */
+guint stub_timeouts_run(void);
+guint stub_timeouts_pending(void);
+/* Interval in milliseconds of the pending timeout added last, 0 if there is none */
+guint stub_timeout_last_interval(void);
+
+/* Stanzas sent through "jabber-sending-xmlnode" or send_raw, as strings */
+extern GPtrArray *stub_sent;
+/* Names of the buddies pushed to the server by purple_account_add_buddy() */
+extern GPtrArray *stub_server_adds;
+/* Names of the buddies whose groups were pushed by serv_move_buddy() */
+extern GPtrArray *stub_server_moves;
+/* Whether "contact_has_feature" answers TRUE, and whether the prpl has send_raw */
+extern gboolean stub_contact_has_feature;
+extern gboolean stub_has_send_raw;
+
+/* An open window */
+typedef struct {
+	int type;             /* PurpleNotifyType or PurpleRequestType */
+	void *handle;
+	char *primary;
+	char *secondary;
+	PurpleNotifySearchResults *results;
+	PurpleNotifyCloseCallback close_cb;
+	PurpleRequestFields *fields;
+	GCallback ok_cb;
+	GCallback cancel_cb;
+	GPtrArray *actions;   /* PurpleRequestActionCb of each action */
+	void *user_data;
+} StubWindow;
+
+/* The open searchresults or request window created last, or NULL */
+StubWindow *stub_searchresults_last(void);
+StubWindow *stub_request_last(void);
+guint stub_windows_open(void);
+/* Text of the last purple_notify_formatted() or purple_notify_message() */
+const char *stub_notify_last_text(void);
+/* Presses the OK or Cancel button of a fields request, or an action of an action request */
+void stub_request_ok(StubWindow *window);
+void stub_request_cancel(StubWindow *window);
+void stub_request_action(StubWindow *window, guint action);
+
+#endif /* ROSTERX_LIBPURPLE_STUB_H */
@@ -0,0 +1,1896 @@
+/*
+ * Regression tests for the XMPP Roster Item Exchange plugin
+ *
+ * Copyright (C) 2017  Dustin Gathmann
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02111-1301  USA
+ *
+ */
+
+/*
+ * Built by "make check" against the libpurple stub in libpurple-stub/.
+ * The plugin is included as a whole, so that its static functions can
+ * be tested directly.
+ */
+#include "../xmpp-rosterx.c"
+
+typedef struct {
+	PurplePlugin plugin;
+	PurpleAccount *account;
+	PurpleConnection *pc;
+	DummyJabberStream *js;
+} Fixture;
+
+static void
+jabber_buddy_free(DummyJabberBuddy *jb)
+{
+	g_list_free_full(jb->resources, g_free);
+	g_free(jb);
+}
+
+static void
+fixture_setup(Fixture *f, gconstpointer data)
+{
+	stub_reset();
+
+	purple_init_plugin(&f->plugin);
+	f->account = stub_account_new("alice@example.org", "prpl-jabber");
+	f->pc = purple_account_get_connection(f->account);
+	f->js = g_new0(DummyJabberStream, 1);
+	f->js->buddies = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+			(GDestroyNotify) jabber_buddy_free);
+	stub_connection_set_protocol_data(f->pc, f->js);
+
+	g_assert_true(plugin_load(&f->plugin));
+}
+
+static void
+fixture_teardown(Fixture *f, gconstpointer data)
+{
+	plugin_unload(&f->plugin);
+	purple_signals_disconnect_by_handle(&f->plugin);
+
+	g_hash_table_destroy(f->js->buddies);
+	g_free(f->js);
+	stub_reset();
+}
+
+/* Unloads and loads the plugin again, like a restart of the client */
+static void
+plugin_reload(Fixture *f)
+{
+	plugin_unload(&f->plugin);
+	purple_signals_disconnect_by_handle(&f->plugin);
+	g_assert_true(plugin_load(&f->plugin));
+}
+
+/* A buddy of account in group, with a mutual subscription on f's stream */
+static PurpleBuddy *
+buddy_add(Fixture *f, PurpleAccount *account, const char *jid, const char *alias, const char *groupname)
+{
+	PurpleBuddy *b = purple_buddy_new(account, jid, alias);
+	DummyJabberBuddy *jb = g_new0(DummyJabberBuddy, 1);
+	char key[JID_BUFFER_SIZE];
+
+	purple_blist_add_buddy(b, NULL, purple_group_new(groupname), NULL);
+
+	g_assert_true(normalize_bare_jid(jid, key, sizeof(key)));
+	jb->subscription = JABBER_SUB_BOTH;
+	g_hash_table_replace(f->js->buddies, g_strdup(key), jb);
+	return b;
+}
+
+/* Makes b online with the NULL-terminated RosterX-capable resources, in
+ * "most available" order */
+static void
+buddy_set_resources(Fixture *f, PurpleBuddy *b, ...)
+{
+	DummyJabberBuddy *jb = g_hash_table_lookup(f->js->buddies, purple_buddy_get_name(b));
+	const char *name;
+	va_list args;
+
+	va_start(args, b);
+	while ((name = va_arg(args, const char *))) {
+		DummyJabberBuddyResource *jbr = g_new0(DummyJabberBuddyResource, 1);
+
+		jbr->jb = jb;
+		jbr->name = (char *) name;
+		jbr->state = JABBER_BUDDY_STATE_ONLINE;
+		jb->resources = g_list_append(jb->resources, jbr);
+	}
+	va_end(args);
+
+	stub_buddy_set_online(b, TRUE);
+	buddycaps_invalidate(purple_buddy_get_account(b), purple_buddy_get_name(b));
+}
+
+/* Appends an item with the NULL-terminated group names */
+static Item *
+itemlist_add(ItemList *itemlist, ItemAction action, const char *jid, const char *alias, ...)
+{
+	Item *item = item_new(itemlist, jid, alias);
+	const char *groupname;
+	va_list args;
+
+	item->action = action;
+	va_start(args, alias);
+	while ((groupname = va_arg(args, const char *)))
+		item_add_group(itemlist, item, groupname);
+	va_end(args);
+
+	itemlist_append(itemlist, item);
+	return item;
+}
+
+/* Appends an <item/> with the NULL-terminated group names, action and name may be NULL */
+static xmlnode *
+xitem_add(xmlnode *xnode, const char *action, const char *jid, const char *name, ...)
+{
+	xmlnode *xitem = xmlnode_new_child(xnode, "item");
+	const char *groupname;
+	va_list args;
+
+	if (action)
+		xmlnode_set_attrib(xitem, "action", action);
+	if (jid)
+		xmlnode_set_attrib(xitem, "jid", jid);
+	if (name)
+		xmlnode_set_attrib(xitem, "name", name);
+
+	va_start(args, name);
+	while ((groupname = va_arg(args, const char *)))
+		xmlnode_insert_data(xmlnode_new_child(xitem, "group"), groupname, -1);
+	va_end(args);
+	return xitem;
+}
+
+static xmlnode *
+xnode_new_rosterx(void)
+{
+	xmlnode *xnode = xmlnode_new("x");
+
+	xmlnode_set_namespace(xnode, NS_ROSTERX);
+	return xnode;
+}
+
+/* One line "action jid alias group,group" per item */
+static char *
+itemlist_dump(ItemList *itemlist)
+{
+	GString *dump = g_string_new(NULL);
+	GList *i, *g;
+
+	for (i = itemlist_get_items(itemlist); i; i = g_list_next(i)) {
+		Item *item = (Item *) i->data;
+
+		g_string_append_printf(dump, "%s %s %s ", item_action_names[item->action],
+				item->jid, item->alias ? item->alias : "-");
+		for (g = item->entries; g; g = g_list_next(g))
+			g_string_append_printf(dump, "%s%s", (char *) g->data, g->next ? "," : "");
+		g_string_append_c(dump, '\n');
+	}
+	return g_string_free(dump, FALSE);
+}
+
+/* The received rows as "jid group action" lines */
+static char *
+searchresults_dump(PurpleNotifySearchResults *results)
+{
+	GString *dump = g_string_new(NULL);
+	GList *r;
+
+	for (r = results->rows; r; r = g_list_next(r)) {
+		GList *row = r->data;
+
+		g_string_append_printf(dump, "%s %s %s\n", (char *) g_list_nth_data(row, COLUMN_JID),
+				(char *) g_list_nth_data(row, COLUMN_GROUP),
+				(char *) g_list_nth_data(row, COLUMN_ACTION));
+	}
+	return g_string_free(dump, FALSE);
+}
+
+/* Hands a received <iq type='set'/> with a copy of xnode to the plugin */
+static gboolean
+receive_iq(Fixture *f, const char *from, const char *id, xmlnode *xnode)
+{
+	xmlnode *iq = xmlnode_new("iq");
+	gboolean handled;
+
+	xmlnode_set_attrib(iq, "type", "set");
+	xmlnode_set_attrib(iq, "id", id);
+	xmlnode_set_attrib(iq, "from", from);
+	xmlnode_insert_child(iq, xmlnode_copy(xnode));
+
+	handled = iq_received_cb(f->pc, "set", id, from, iq);
+	xmlnode_free(iq);
+	return handled;
+}
+
+/* Items contact0@example.org and so on, in one group */
+static ItemList *
+itemlist_new_numbered(guint n)
+{
+	ItemList *itemlist = itemlist_new();
+	char jid[64];
+	guint i;
+
+	for (i = 0; i < n; i++) {
+		g_snprintf(jid, sizeof(jid), "contact%u@example.org", i);
+		itemlist_add(itemlist, ITEM_ACTION_ADD, jid, "Contact", "Group", NULL);
+	}
+	return itemlist;
+}
+
+static guint
+count_substrings(const char *haystack, const char *needle)
+{
+	guint n = 0;
+
+	for (; (haystack = strstr(haystack, needle)); haystack += strlen(needle))
+		n++;
+	return n;
+}
+
+
+/* The unanswered <iq/> sent to full_jid */
+static PendingIq *
+pending_iq_lookup(const char *full_jid)
+{
+	GList *e, *i;
+
+	for (e = pending_exchanges; e; e = e->next)
+		for (i = ((PendingExchange *) e->data)->iqs; i; i = i->next)
+			if (g_str_equal(((PendingIq *) i->data)->full_jid, full_jid))
+				return i->data;
+	return NULL;
+}
+
+/* Answers the <iq/> sent to full_jid with a result, or an <error type=error_type/> */
+static gboolean
+answer_iq(Fixture *f, const char *full_jid, const char *error_type)
+{
+	PendingIq *piq = pending_iq_lookup(full_jid);
+	const char *type = error_type ? "error" : "result";
+	xmlnode *iq = xmlnode_new("iq");
+	char *id;
+	gboolean handled;
+
+	g_assert_nonnull(piq);
+	g_assert_nonnull(piq->id);
+	id = g_strdup(piq->id);
+	xmlnode_set_attrib(iq, "type", type);
+	xmlnode_set_attrib(iq, "id", id);
+	xmlnode_set_attrib(iq, "from", full_jid);
+	if (error_type)
+		xmlnode_set_attrib(xmlnode_new_child(iq, "error"), "type", error_type);
+
+	handled = iq_received_cb(f->pc, type, id, full_jid, iq);
+	xmlnode_free(iq);
+	g_free(id);
+	return handled;
+}
+
+/* Sends a suggestion as <iq/>s to every resource of b, and stops the timeout of the exchange */
+static PendingExchange *
+exchange_start(Fixture *f, PurpleBuddy *b)
+{
+	PendingExchange *exchange;
+
+	purple_prefs_set_int(PREF_COMPATIBLE, COMPATIBLE_XEP);
+	purple_prefs_set_int(PREF_TARGET, TARGET_ALL_RESOURCES);
+
+	outgoing_suggestion_start(f->pc, purple_buddy_get_name(b), itemlist_new_numbered(3));
+	g_assert_cmpuint(g_list_length(pending_exchanges), ==, 1);
+	exchange = pending_exchanges->data;
+
+	purple_timeout_remove(exchange->timer);
+	exchange->timer = 0;
+	g_ptr_array_set_size(stub_sent, 0);
+	return exchange;
+}
+
+/*
+ * Conversion between itemlists and <x/>
+ */
+static void
+test_xnode_roundtrip(Fixture *f, gconstpointer data)
+{
+	ItemList *itemlist = itemlist_new(), *parsed;
+	xmlnode *xnode;
+	GList *next;
+	gboolean too_large;
+	char *expected, *dump;
+
+	itemlist_add(itemlist, ITEM_ACTION_ADD, "bob@example.org", "Bob <&> 'B'", "Friends", "Work", NULL);
+	itemlist_add(itemlist, ITEM_ACTION_MODIFY, "carol@example.org", "Carol", "Friends", NULL);
+	itemlist_add(itemlist, ITEM_ACTION_DELETE, "dave@example.org", NULL, NULL);
+	itemlist_add(itemlist, ITEM_ACTION_ADD, "erin@example.org", "Erin", NULL);
+
+	xnode = xnode_new_from_itemlist(itemlist_get_items(itemlist), G_MAXSIZE, &next);
+	g_assert_null(next);
+	g_assert_cmpstr(xmlnode_get_namespace(xnode), ==, NS_ROSTERX);
+
+	parsed = itemlist_new_from_xnode_bounded(xnode, 10, 10, &too_large);
+	g_assert_nonnull(parsed);
+	g_assert_false(too_large);
+
+	expected = itemlist_dump(itemlist);
+	dump = itemlist_dump(parsed);
+	g_assert_cmpstr(dump, ==, expected);
+
+	g_free(dump);
+	g_free(expected);
+	itemlist_destroy(parsed);
+	xmlnode_free(xnode);
+	itemlist_destroy(itemlist);
+}
+
+/* Every item ends up in exactly one chunk, and every chunk has at least one */
+static void
+test_xnode_chunks(Fixture *f, gconstpointer data)
+{
+	ItemList *itemlist = itemlist_new();
+	GList *start, *next;
+	guint i, nchunks = 0, nitems = 0;
+	char jid[64];
+
+	for (i = 0; i < 100; i++) {
+		g_snprintf(jid, sizeof(jid), "contact%u@example.org", i);
+		itemlist_add(itemlist, ITEM_ACTION_ADD, jid, "Contact", "Group", NULL);
+	}
+
+	for (start = itemlist_get_items(itemlist); start; start = next) {
+		xmlnode *xnode = xnode_new_from_itemlist(start, STANZA_OVERHEAD_BYTES + 1024, &next);
+		xmlnode *xitem;
+		guint n = 0;
+
+		for (xitem = xmlnode_get_child(xnode, "item"); xitem; xitem = xmlnode_get_next_twin(xitem)) {
+			g_snprintf(jid, sizeof(jid), "contact%u@example.org", nitems + n);
+			g_assert_cmpstr(xmlnode_get_attrib(xitem, "jid"), ==, jid);
+			n++;
+		}
+		g_assert_cmpuint(n, >, 0);
+		nitems += n;
+		nchunks++;
+		xmlnode_free(xnode);
+	}
+	g_assert_cmpuint(nitems, ==, 100);
+	g_assert_cmpuint(nchunks, >, 1);
+
+	itemlist_destroy(itemlist);
+}
+
+
+/*
+ * Bounded parsing of received <x/>
+ */
+static void
+test_parser_max_items(Fixture *f, gconstpointer data)
+{
+	xmlnode *xnode = xnode_new_rosterx();
+	ItemList *itemlist;
+	gboolean too_large;
+
+	xitem_add(xnode, NULL, "bob@example.org", NULL, NULL);
+	xitem_add(xnode, NULL, "carol@example.org", NULL, NULL);
+	xitem_add(xnode, NULL, "dave@example.org", NULL, NULL);
+
+	g_assert_null(itemlist_new_from_xnode_bounded(xnode, 2, 10, &too_large));
+	g_assert_true(too_large);
+
+	itemlist = itemlist_new_from_xnode_bounded(xnode, 3, 10, &too_large);
+	g_assert_nonnull(itemlist);
+	g_assert_false(too_large);
+	g_assert_cmpuint(g_queue_get_length(&itemlist->items), ==, 3);
+
+	itemlist_destroy(itemlist);
+	xmlnode_free(xnode);
+}
+
+/* Duplicates, unknown actions and items without jid count towards the limit */
+static void
+test_parser_ignored_items_count(Fixture *f, gconstpointer data)
+{
+	xmlnode *xnode = xnode_new_rosterx();
+	ItemList *itemlist;
+	gboolean too_large;
+	char *dump;
+
+	xitem_add(xnode, "add", "bob@example.org", "Bob", "Friends", NULL);
+	xitem_add(xnode, "modify", "bob@example.org", "Robert", "Work", NULL);
+	xitem_add(xnode, "promote", "carol@example.org", NULL, NULL);
+	xitem_add(xnode, "add", NULL, "Nobody", NULL);
+	xitem_add(xnode, "delete", "dave@example.org", NULL, NULL);
+
+	g_assert_null(itemlist_new_from_xnode_bounded(xnode, 4, 10, &too_large));
+	g_assert_true(too_large);
+
+	itemlist = itemlist_new_from_xnode_bounded(xnode, 5, 10, &too_large);
+	g_assert_nonnull(itemlist);
+
+	/* The first of the duplicates counts */
+	dump = itemlist_dump(itemlist);
+	g_assert_cmpstr(dump, ==,
+			"add bob@example.org Bob Friends\n"
+			"delete dave@example.org - \n");
+
+	g_free(dump);
+	itemlist_destroy(itemlist);
+	xmlnode_free(xnode);
+}
+
+static void
+test_parser_max_groups(Fixture *f, gconstpointer data)
+{
+	xmlnode *xnode = xnode_new_rosterx();
+	ItemList *itemlist;
+	gboolean too_large;
+	char *dump;
+
+	/* Duplicate groups count as well */
+	xitem_add(xnode, NULL, "bob@example.org", "Bob", "Friends", "Friends", "Work", NULL);
+
+	g_assert_null(itemlist_new_from_xnode_bounded(xnode, 10, 2, &too_large));
+	g_assert_true(too_large);
+
+	itemlist = itemlist_new_from_xnode_bounded(xnode, 10, 3, &too_large);
+	g_assert_nonnull(itemlist);
+	dump = itemlist_dump(itemlist);
+	g_assert_cmpstr(dump, ==, "add bob@example.org Bob Friends,Work\n");
+
+	g_free(dump);
+	itemlist_destroy(itemlist);
+	xmlnode_free(xnode);
+}
+
+static void
+test_parser_empty(Fixture *f, gconstpointer data)
+{
+	xmlnode *xnode = xnode_new_rosterx();
+	ItemList *itemlist;
+	gboolean too_large;
+
+	xmlnode_new_child(xnode, "junk");
+	itemlist = itemlist_new_from_xnode_bounded(xnode, 10, 10, &too_large);
+	g_assert_nonnull(itemlist);
+	g_assert_false(too_large);
+	g_assert_true(itemlist_is_empty(itemlist));
+
+	itemlist_destroy(itemlist);
+	xmlnode_free(xnode);
+}
+
+
+/*
+ * Filtering of received items against the roster
+ */
+static void
+test_filter_applicable(Fixture *f, gconstpointer data)
+{
+	PurpleAccount *work = stub_account_new("alice@work.example", "prpl-jabber");
+	PurpleAccount *irc = stub_account_new("alice", "prpl-irc");
+	ItemList *itemlist = itemlist_new();
+	AuxData *aux = auxdata_new(f->pc);
+	char *dump;
+
+	/* Known on another XMPP account, with a resource and in other case */
+	buddy_add(f, work, "Dave@Example.ORG/phone", "Dave", "Work");
+	/* Known only on a non-XMPP account */
+	buddy_add(f, irc, "erin@example.org", "Erin", "IRC");
+	/* Known on the receiving account */
+	buddy_add(f, f->account, "frank@example.org", "Frank", "Friends");
+
+	itemlist_add(itemlist, ITEM_ACTION_ADD, "dave@example.org", "Dave", NULL);
+	itemlist_add(itemlist, ITEM_ACTION_ADD, "erin@example.org", "Erin", NULL);
+	itemlist_add(itemlist, ITEM_ACTION_ADD, "frank@example.org", "Frank", NULL);
+	itemlist_add(itemlist, ITEM_ACTION_MODIFY, "frank@example.org/home", "Franky", NULL);
+	itemlist_add(itemlist, ITEM_ACTION_MODIFY, "dave@example.org/home", "Davy", NULL);
+	itemlist_add(itemlist, ITEM_ACTION_DELETE, "gina@example.org", NULL, NULL);
+
+	itemlist_filter(itemlist, _item_is_applicable, aux);
+	dump = itemlist_dump(itemlist);
+	g_assert_cmpstr(dump, ==,
+			"add erin@example.org Erin \n"
+			"modify frank@example.org/home Franky \n");
+
+	g_free(dump);
+	auxdata_destroy(aux);
+	itemlist_destroy(itemlist);
+}
+
+/* The jid index follows buddies that are added and removed later */
+static void
+test_filter_follows_blist(Fixture *f, gconstpointer data)
+{
+	PurpleBuddy *b = buddy_add(f, f->account, "bob@example.org", "Bob", "Friends");
+
+	g_assert_true(roster_members_contains("bob@example.org"));
+	purple_blist_remove_buddy(b);
+	g_assert_false(roster_members_contains("bob@example.org"));
+}
+
+
+/*
+ * Coalescing of received suggestions
+ */
+static void
+test_coalesce(Fixture *f, gconstpointer data)
+{
+	xmlnode *first = xnode_new_rosterx(), *second = xnode_new_rosterx();
+	StubWindow *window;
+	char *dump;
+
+	buddy_add(f, f->account, "bob@example.org", "Bob", "Friends");
+	xitem_add(first, NULL, "carol@example.org", "Carol", "Friends", NULL);
+	xitem_add(first, NULL, "dave@example.org", "Dave", NULL);
+	xitem_add(second, NULL, "carol@example.org", "Carol", "Work", NULL);
+	xitem_add(second, NULL, "erin@example.org", "Erin", "Work", NULL);
+
+	g_assert_true(receive_iq(f, "bob@example.org/laptop", "a1", first));
+	g_assert_true(receive_iq(f, "bob@example.org/phone", "a2", second));
+	g_assert_cmpuint(stub_sent->len, ==, 2);
+	g_assert_nonnull(strstr(g_ptr_array_index(stub_sent, 0), "type='result'"));
+	g_assert_nonnull(strstr(g_ptr_array_index(stub_sent, 1), "type='result'"));
+
+	/* Nothing is shown before the window ends */
+	g_assert_null(stub_searchresults_last());
+	g_assert_cmpuint(stub_timeouts_pending(), ==, 1);
+	g_assert_cmpuint(stub_timeout_last_interval(), ==, COALESCE_MSEC_DEFAULT);
+	stub_timeouts_run();
+
+	window = stub_searchresults_last();
+	g_assert_nonnull(window);
+	dump = searchresults_dump(window->results);
+	g_assert_cmpstr(dump, ==,
+			"carol@example.org Friends add\n"
+			"carol@example.org Work add\n"
+			"dave@example.org (null) add\n"
+			"erin@example.org Work add\n");
+	g_assert_cmpuint(stub_windows_open(), ==, 1);
+
+	g_free(dump);
+	xmlnode_free(second);
+	xmlnode_free(first);
+}
+
+/* Suggestions from other senders get windows of their own */
+static void
+test_coalesce_per_sender(Fixture *f, gconstpointer data)
+{
+	xmlnode *xnode = xnode_new_rosterx();
+
+	buddy_add(f, f->account, "bob@example.org", "Bob", "Friends");
+	buddy_add(f, f->account, "carol@example.org", "Carol", "Friends");
+	xitem_add(xnode, NULL, "dave@example.org", "Dave", NULL);
+
+	g_assert_true(receive_iq(f, "bob@example.org/laptop", "a1", xnode));
+	g_assert_true(receive_iq(f, "carol@example.org/laptop", "a2", xnode));
+	g_assert_cmpuint(stub_timeouts_pending(), ==, 2);
+	stub_timeouts_run();
+	g_assert_cmpuint(stub_windows_open(), ==, 2);
+
+	xmlnode_free(xnode);
+}
+
+/* The merged window is bounded like a single stanza */
+static void
+test_coalesce_bounded(Fixture *f, gconstpointer data)
+{
+	xmlnode *first = xnode_new_rosterx(), *second = xnode_new_rosterx();
+	ItemList *itemlist = itemlist_new(), *more = itemlist_new();
+	char *dump;
+
+	purple_prefs_set_int(PREF_MAX_ITEMS, 3);
+	purple_prefs_set_int(PREF_MAX_GROUPS, 2);
+
+	buddy_add(f, f->account, "bob@example.org", "Bob", "Friends");
+	xitem_add(first, NULL, "carol@example.org", "Carol", "Friends", "Work", NULL);
+	xitem_add(first, NULL, "dave@example.org", "Dave", "Friends", NULL);
+	xitem_add(second, NULL, "carol@example.org", "Carol", "Work", "Family", NULL);
+	xitem_add(second, NULL, "erin@example.org", "Erin", NULL);
+	xitem_add(second, NULL, "frank@example.org", "Frank", NULL);
+
+	g_assert_true(receive_iq(f, "bob@example.org/laptop", "a1", first));
+	g_assert_true(receive_iq(f, "bob@example.org/phone", "a2", second));
+	stub_timeouts_run();
+
+	dump = searchresults_dump(stub_searchresults_last()->results);
+	g_assert_cmpstr(dump, ==,
+			"carol@example.org Friends add\n"
+			"carol@example.org Work add\n"
+			"dave@example.org Friends add\n"
+			"erin@example.org (null) add\n");
+	g_free(dump);
+
+	/* Duplicates are not counted as left out */
+	itemlist_add(itemlist, ITEM_ACTION_ADD, "bob@example.org", "Bob", "Friends", "Work", NULL);
+	itemlist_add(more, ITEM_ACTION_ADD, "bob@example.org", "Bob", "Work", "Friends", "Family", NULL);
+	itemlist_add(more, ITEM_ACTION_ADD, "carol@example.org", "Carol", NULL);
+	g_assert_cmpuint(itemlist_merge(itemlist, more, 1, 2), ==, 2);
+	g_assert_cmpuint(itemlist_merge(itemlist, more, 2, 2), ==, 1);
+	dump = itemlist_dump(itemlist);
+	g_assert_cmpstr(dump, ==,
+			"add bob@example.org Bob Friends,Work\n"
+			"add carol@example.org Carol \n");
+	g_free(dump);
+
+	itemlist_destroy(more);
+	itemlist_destroy(itemlist);
+	xmlnode_free(second);
+	xmlnode_free(first);
+}
+
+static void
+test_receive_unknown_sender(Fixture *f, gconstpointer data)
+{
+	xmlnode *xnode = xnode_new_rosterx();
+
+	xitem_add(xnode, NULL, "dave@example.org", "Dave", NULL);
+	g_assert_true(receive_iq(f, "mallory@example.org/bot", "a1", xnode));
+	g_assert_cmpuint(stub_sent->len, ==, 1);
+	g_assert_nonnull(strstr(g_ptr_array_index(stub_sent, 0), "<not-authorized"));
+	g_assert_cmpuint(stub_timeouts_pending(), ==, 0);
+
+	xmlnode_free(xnode);
+}
+
+
+/*
+ * Rate limiting of received suggestions
+ */
+static void
+test_rate_limit_burst(Fixture *f, gconstpointer data)
+{
+	purple_prefs_set_int(PREF_RATE_BURST, 2);
+	purple_prefs_set_int(PREF_RATE_PER_MINUTE, 6);
+
+	g_assert_true(rate_limit_allows("bob@example.org/laptop"));
+	g_assert_true(rate_limit_allows("bob@example.org/phone"));
+	g_assert_false(rate_limit_allows("bob@example.org/laptop"));
+	g_assert_cmpuint(rate_dropped_total, ==, 1);
+
+	/* Every sender has a bucket of its own */
+	g_assert_true(rate_limit_allows("carol@example.org/laptop"));
+
+	/* One token per 10 s, never more than the burst */
+	((RateBucket *) g_hash_table_lookup(rate_buckets, "bob@example.org"))->last_refill -=
+			10 * G_USEC_PER_SEC;
+	g_assert_true(rate_limit_allows("bob@example.org/laptop"));
+	g_assert_false(rate_limit_allows("bob@example.org/laptop"));
+	((RateBucket *) g_hash_table_lookup(rate_buckets, "bob@example.org"))->last_refill -=
+			(gint64) 3600 * G_USEC_PER_SEC;
+	g_assert_true(rate_limit_allows("bob@example.org/laptop"));
+	g_assert_true(rate_limit_allows("bob@example.org/laptop"));
+	g_assert_false(rate_limit_allows("bob@example.org/laptop"));
+}
+
+static void
+test_rate_limit_off(Fixture *f, gconstpointer data)
+{
+	guint i;
+
+	purple_prefs_set_int(PREF_RATE_PER_MINUTE, 0);
+	for (i = 0; i < 100; i++)
+		g_assert_true(rate_limit_allows("bob@example.org/laptop"));
+	g_assert_cmpuint(g_hash_table_size(rate_buckets), ==, 0);
+}
+
+/* A sender over the limit gets a resource-constraint error, and no table */
+static void
+test_rate_limit_received(Fixture *f, gconstpointer data)
+{
+	xmlnode *xnode = xnode_new_rosterx();
+	char id[8];
+	guint i;
+
+	buddy_add(f, f->account, "bob@example.org", "Bob", "Friends");
+	xitem_add(xnode, NULL, "dave@example.org", "Dave", NULL);
+	purple_prefs_set_int(PREF_RATE_BURST, 2);
+
+	for (i = 0; i < 3; i++) {
+		g_snprintf(id, sizeof(id), "a%u", i);
+		g_assert_true(receive_iq(f, "bob@example.org/laptop", id, xnode));
+	}
+	g_assert_cmpuint(stub_sent->len, ==, 3);
+	g_assert_null(strstr(g_ptr_array_index(stub_sent, 1), "<error"));
+	g_assert_nonnull(strstr(g_ptr_array_index(stub_sent, 2), "<resource-constraint"));
+
+	xmlnode_free(xnode);
+}
+
+
+/*
+ * Capabilities of buddies
+ */
+static RosterxResource *
+resource_new(GList **resources, const char *full_jid, int priority, gboolean available, time_t idle)
+{
+	RosterxResource *res = g_new0(RosterxResource, 1);
+
+	res->full_jid = g_strdup(full_jid);
+	res->priority = priority;
+	res->available = available;
+	res->idle = idle;
+	*resources = g_list_append(*resources, res);
+	return res;
+}
+
+static void
+test_choose_resource_best(Fixture *f, gconstpointer data)
+{
+	BuddyCaps *bc = g_new0(BuddyCaps, 1);
+	RosterxResource *away, *best;
+
+	away = resource_new(&bc->resources, "bob@example.org/away", 5, FALSE, 0);
+	resource_new(&bc->resources, "bob@example.org/negative", -1, TRUE, 0);
+	best = resource_new(&bc->resources, "bob@example.org/desktop", 0, TRUE, 100);
+	resource_new(&bc->resources, "bob@example.org/phone", 1, TRUE, 0);
+	g_assert_true(choose_resource(bc, TARGET_BEST_RESOURCE) == best);
+
+	/* None is available with a non-negative priority */
+	g_list_free_full(g_list_remove(bc->resources, away), rosterx_resource_destroy);
+	bc->resources = g_list_append(NULL, away);
+	resource_new(&bc->resources, "bob@example.org/negative", -1, TRUE, 0);
+	g_assert_true(choose_resource(bc, TARGET_BEST_RESOURCE) == away);
+
+	buddycaps_destroy(bc);
+}
+
+static void
+test_choose_resource_recent(Fixture *f, gconstpointer data)
+{
+	BuddyCaps *bc = g_new0(BuddyCaps, 1);
+	RosterxResource *away, *recent, *active;
+
+	away = resource_new(&bc->resources, "bob@example.org/away", 5, FALSE, 0);
+	resource_new(&bc->resources, "bob@example.org/old", 5, TRUE, 100);
+	recent = resource_new(&bc->resources, "bob@example.org/recent", -1, TRUE, 300);
+	resource_new(&bc->resources, "bob@example.org/older", 5, TRUE, 200);
+	g_assert_true(choose_resource(bc, TARGET_RECENT_RESOURCE) == recent);
+
+	active = resource_new(&bc->resources, "bob@example.org/active", 0, TRUE, 0);
+	g_assert_true(choose_resource(bc, TARGET_RECENT_RESOURCE) == active);
+
+	/* Only unavailable ones */
+	g_list_free_full(g_list_remove(bc->resources, away), rosterx_resource_destroy);
+	bc->resources = g_list_append(NULL, away);
+	g_assert_true(choose_resource(bc, TARGET_RECENT_RESOURCE) == away);
+
+	buddycaps_destroy(bc);
+}
+
+/* The caps of a buddy are kept until its next presence */
+static void
+test_caps_cache_presence(Fixture *f, gconstpointer data)
+{
+	PurpleBuddy *b = buddy_add(f, f->account, "bob@example.org", "Bob", "Friends");
+	DummyJabberBuddy *jb = g_hash_table_lookup(f->js->buddies, "bob@example.org");
+	static DummyJabberCapsClientInfo info = { .tuple = { "http://example.org", "ver1", "sha-1" } };
+
+	buddy_set_resources(f, b, "laptop", "phone", NULL);
+	((DummyJabberBuddyResource *) jb->resources->data)->caps.info = &info;
+	((DummyJabberBuddyResource *) jb->resources->next->data)->caps.info = &info;
+	g_assert_true(buddycaps_lookup(b)->rosterx_capable);
+	g_assert_true(buddycaps_lookup(b)->complete);
+	g_assert_cmpuint(g_list_length(buddycaps_lookup(b)->resources), ==, 2);
+
+	stub_contact_has_feature = FALSE;
+	g_assert_true(buddycaps_lookup(b)->rosterx_capable);
+
+	/* The features of a caps ver do not change, those of a resource may */
+	presence_received_cb(f->pc, NULL, "bob@example.org/laptop", NULL);
+	g_assert_true(buddycaps_lookup(b)->rosterx_capable);
+	((DummyJabberBuddyResource *) jb->resources->data)->caps.info = NULL;
+	((DummyJabberBuddyResource *) jb->resources->next->data)->caps.info = NULL;
+	g_assert_true(buddycaps_lookup(b)->rosterx_capable);
+	presence_received_cb(f->pc, NULL, "bob@example.org/phone", NULL);
+	g_assert_false(buddycaps_lookup(b)->rosterx_capable);
+
+	/* Unknown caps are asked again later */
+	g_assert_false(buddycaps_lookup(b)->complete);
+	stub_contact_has_feature = TRUE;
+	g_assert_false(buddycaps_lookup(b)->rosterx_capable);
+	buddycaps_lookup(b)->retry_after = 0;
+	g_assert_true(buddycaps_lookup(b)->rosterx_capable);
+	g_assert_true(buddycaps_lookup(b)->complete);
+}
+
+/*
+ * Sending suggestions
+ */
+static void
+test_send_chunks(Fixture *f, gconstpointer data)
+{
+	gsize max_stanza = MAX_BODY_BYTES_DEFAULT + 2048;
+	guint i, nitems = 0;
+
+	buddy_add(f, f->account, "bob@example.org", "Bob", "Friends");
+	purple_prefs_set_int(PREF_MAX_STANZA_BYTES, max_stanza);
+
+	outgoing_suggestion_start(f->pc, "bob@example.org", itemlist_new_numbered(100));
+	while (stub_timeouts_pending()) {
+		/* The receiver's bucket always has a token in this test */
+		pace_bucket_lookup(f->pc, "bob@example.org")->tokens = RATE_BURST_DEFAULT;
+		stub_timeouts_run();
+	}
+
+	g_assert_cmpuint(stub_sent->len, >, 1);
+	for (i = 0; i < stub_sent->len; i++) {
+		const char *stanza = g_ptr_array_index(stub_sent, i);
+
+		g_assert_true(g_str_has_prefix(stanza, "<message "));
+		g_assert_cmpuint(strlen(stanza), <=, max_stanza);
+		nitems += count_substrings(stanza, "<item ");
+	}
+	g_assert_cmpuint(nitems, ==, 100);
+}
+
+/* Field of the send dialog for jid in groupname */
+static PurpleRequestField *
+request_field_find(StubWindow *window, const char *groupname, const char *jid)
+{
+	GList *g, *l;
+
+	for (g = purple_request_fields_get_groups(window->fields); g; g = g_list_next(g)) {
+		if (g_strcmp0(purple_request_field_group_get_title(g->data), groupname))
+			continue;
+		for (l = purple_request_field_group_get_fields(g->data); l; l = g_list_next(l))
+			if (!g_strcmp0(purple_request_field_get_id(l->data), jid))
+				return l->data;
+	}
+	g_assert_not_reached();
+	return NULL;
+}
+
+/* Only the selected contacts are sent, each with the groups it was selected in */
+static void
+test_send_dialog_selection(Fixture *f, gconstpointer data)
+{
+	PurpleBuddy *bob = buddy_add(f, f->account, "bob@example.org", "Bob", "Friends");
+	StubWindow *window;
+	const char *stanza;
+
+	buddy_add(f, f->account, "carol@example.org", "Carol", "Friends");
+	buddy_add(f, f->account, "carol@example.org", "Carol", "Work");
+	buddy_add(f, f->account, "dave@example.org", "Dave", "Work");
+
+	select_contacts((PurpleBlistNode *) bob, &f->plugin);
+	window = stub_request_last();
+	g_assert_nonnull(window);
+	purple_request_field_bool_set_value(request_field_find(window, "Friends", "bob@example.org"), TRUE);
+	purple_request_field_bool_set_value(request_field_find(window, "Work", "carol@example.org"), TRUE);
+	stub_request_ok(window);
+
+	g_assert_cmpuint(stub_sent->len, ==, 1);
+	stanza = g_ptr_array_index(stub_sent, 0);
+	g_assert_cmpuint(count_substrings(stanza, "<item "), ==, 2);
+	g_assert_nonnull(strstr(stanza, "jid='bob@example.org' name='Bob'><group>Friends</group></item>"));
+	g_assert_nonnull(strstr(stanza, "jid='carol@example.org' name='Carol'><group>Work</group></item>"));
+	g_assert_null(strstr(stanza, "dave@example.org"));
+}
+
+/* Fields map to their items, whatever the alias in their label looks like */
+static void
+test_send_dialog_alias(Fixture *f, gconstpointer data)
+{
+	PurpleBuddy *bob = buddy_add(f, f->account, "bob@example.org", "Bob", "Friends");
+	StubWindow *window;
+	PurpleRequestField *field;
+
+	buddy_add(f, f->account, "carol@example.org", "Carol <dave@example.org>", "Friends");
+	buddy_add(f, f->account, "dave@example.org", "Dave", "Friends");
+
+	select_contacts((PurpleBlistNode *) bob, &f->plugin);
+	window = stub_request_last();
+	field = request_field_find(window, "Friends", "carol@example.org");
+	g_assert_cmpstr(purple_request_field_get_label(field), ==,
+			"Carol <dave@example.org> <carol@example.org>");
+	purple_request_field_bool_set_value(field, TRUE);
+	stub_request_ok(window);
+
+	g_assert_cmpuint(stub_sent->len, ==, 1);
+	g_assert_cmpuint(count_substrings(g_ptr_array_index(stub_sent, 0), "<item "), ==, 1);
+	g_assert_nonnull(strstr(g_ptr_array_index(stub_sent, 0),
+				"jid='carol@example.org' name='Carol &lt;dave@example.org&gt;'>"));
+}
+
+/* Choice field of the group dialog for groupname */
+static PurpleRequestField *
+request_choice_find(StubWindow *window, const char *groupname)
+{
+	char *prefix = g_strconcat(groupname, " (", NULL);
+	GList *g, *l;
+
+	for (g = purple_request_fields_get_groups(window->fields); g; g = g_list_next(g))
+		for (l = purple_request_field_group_get_fields(g->data); l; l = g_list_next(l))
+			if (g_str_has_prefix(purple_request_field_get_label(l->data), prefix)) {
+				g_free(prefix);
+				return l->data;
+			}
+	g_assert_not_reached();
+	return NULL;
+}
+
+/* Large rosters are chosen by group first, then one by one in the chosen groups */
+static void
+test_send_group_dialog(Fixture *f, gconstpointer data)
+{
+	PurpleBuddy *bob = buddy_add(f, f->account, "bob@example.org", "Bob", "Friends");
+	guint64 calls = stage_metrics[STAGE_ITEMLIST_TO_REQUEST].calls;
+	StubWindow *window;
+	const char *stanza;
+
+	buddy_add(f, f->account, "carol@example.org", "Carol", "Friends");
+	buddy_add(f, f->account, "dave@example.org", "Dave", "Work");
+	buddy_add(f, f->account, "erin@example.org", "Erin", "Work");
+	buddy_add(f, f->account, "frank@example.org", "Frank", "Family");
+	purple_prefs_set_int(PREF_GROUP_DIALOG_THRESHOLD, 3);
+
+	select_contacts((PurpleBlistNode *) bob, &f->plugin);
+	window = stub_request_last();
+	g_assert_true(window->ok_cb == G_CALLBACK(select_groups_ok));
+	purple_request_field_choice_set_value(request_choice_find(window, "Friends"), GROUP_CHOICE_ALL);
+	purple_request_field_choice_set_value(request_choice_find(window, "Work"), GROUP_CHOICE_CHOOSE);
+	stub_request_ok(window);
+
+	/* The second dialog has the Work group only */
+	window = stub_request_last();
+	g_assert_true(window->ok_cb == G_CALLBACK(select_contacts_ok));
+	g_assert_cmpuint(g_list_length(purple_request_fields_get_groups(window->fields)), ==, 1);
+	g_assert_cmpuint(stage_metrics[STAGE_ITEMLIST_TO_REQUEST].calls, ==, calls + 1);
+	purple_request_field_bool_set_value(request_field_find(window, "Work", "erin@example.org"), TRUE);
+	stub_request_ok(window);
+
+	g_assert_cmpuint(stub_sent->len, ==, 1);
+	stanza = g_ptr_array_index(stub_sent, 0);
+	g_assert_cmpuint(count_substrings(stanza, "<item "), ==, 3);
+	g_assert_nonnull(strstr(stanza, "jid='bob@example.org' name='Bob'><group>Friends</group></item>"));
+	g_assert_nonnull(strstr(stanza, "jid='carol@example.org'"));
+	g_assert_nonnull(strstr(stanza, "jid='erin@example.org' name='Erin'><group>Work</group></item>"));
+}
+
+/* Groups sent whole need no second dialog */
+static void
+test_send_group_dialog_all(Fixture *f, gconstpointer data)
+{
+	PurpleBuddy *bob = buddy_add(f, f->account, "bob@example.org", "Bob", "Friends");
+	StubWindow *window;
+
+	buddy_add(f, f->account, "carol@example.org", "Carol", "Friends");
+	buddy_add(f, f->account, "dave@example.org", "Dave", "Work");
+	purple_prefs_set_int(PREF_GROUP_DIALOG_THRESHOLD, 2);
+
+	select_contacts((PurpleBlistNode *) bob, &f->plugin);
+	window = stub_request_last();
+	purple_request_field_choice_set_value(request_choice_find(window, "Work"), GROUP_CHOICE_ALL);
+	stub_request_ok(window);
+
+	g_assert_cmpuint(stub_windows_open(), ==, 0);
+	g_assert_cmpuint(stub_sent->len, ==, 1);
+	g_assert_cmpuint(count_substrings(g_ptr_array_index(stub_sent, 0), "<item "), ==, 1);
+	g_assert_nonnull(strstr(g_ptr_array_index(stub_sent, 0), "jid='dave@example.org'"));
+}
+
+/* The batched <iq/>s are complete stanzas of their own */
+static void
+test_send_iqs_batched(Fixture *f, gconstpointer data)
+{
+	PurpleBuddy *b = buddy_add(f, f->account, "bob@example.org", "Bob", "Friends");
+	const char *batch;
+
+	buddy_set_resources(f, b, "laptop", "phone", NULL);
+	purple_prefs_set_int(PREF_COMPATIBLE, COMPATIBLE_XEP);
+	purple_prefs_set_int(PREF_TARGET, TARGET_ALL_RESOURCES);
+
+	outgoing_suggestion_start(f->pc, "bob@example.org", itemlist_new_numbered(3));
+	g_assert_cmpuint(stub_sent->len, ==, 1);
+	batch = g_ptr_array_index(stub_sent, 0);
+
+	g_assert_cmpuint(count_substrings(batch, "<iq xmlns='jabber:client' type='set' "), ==, 2);
+	g_assert_nonnull(strstr(batch, " to='bob@example.org/laptop' from='alice@example.org'>"
+				"<x xmlns='" NS_ROSTERX "'><item action='add' jid='contact0@example.org'"));
+	g_assert_nonnull(strstr(batch, " to='bob@example.org/phone' "));
+	g_assert_cmpuint(count_substrings(batch, "<item "), ==, 6);
+	g_assert_true(g_str_has_suffix(batch, "</x></iq>"));
+}
+
+/* Stanzas are paced to the receiver's default rate limit */
+static void
+test_send_paced(Fixture *f, gconstpointer data)
+{
+	guint i, refill_msec = 60 * 1000 / RATE_PER_MINUTE_DEFAULT;
+
+	buddy_add(f, f->account, "bob@example.org", "Bob", "Friends");
+	purple_prefs_set_int(PREF_MAX_STANZA_BYTES, MAX_BODY_BYTES_DEFAULT + 1024);
+
+	outgoing_suggestion_start(f->pc, "bob@example.org", itemlist_new_numbered(200));
+	g_assert_cmpuint(stub_sent->len, ==, 1);
+
+	/* The burst goes out with a short pause */
+	for (i = 1; i < RATE_BURST_DEFAULT; i++) {
+		g_assert_cmpuint(stub_timeout_last_interval(), ==, SEND_INTERVAL_MSEC);
+		stub_timeouts_run();
+		g_assert_cmpuint(stub_sent->len, ==, i + 1);
+	}
+
+	/* Then one stanza per token */
+	g_assert_cmpuint(stub_timeout_last_interval(), >, refill_msec - 100);
+	g_assert_cmpuint(stub_timeout_last_interval(), <=, refill_msec + 1);
+	stub_timeouts_run();
+	g_assert_cmpuint(stub_sent->len, ==, RATE_BURST_DEFAULT);
+
+	pace_bucket_lookup(f->pc, "bob@example.org")->last_refill -= refill_msec * 1000;
+	stub_timeouts_run();
+	g_assert_cmpuint(stub_sent->len, ==, RATE_BURST_DEFAULT + 1);
+
+	/* Another suggestion to the same contact waits as well */
+	outgoing_suggestion_start(f->pc, "Bob@example.org", itemlist_new_numbered(1));
+	g_assert_cmpuint(stub_sent->len, ==, RATE_BURST_DEFAULT + 1);
+}
+
+
+/* The pace follows the rate limit preferences */
+static void
+test_send_paced_prefs(Fixture *f, gconstpointer data)
+{
+	buddy_add(f, f->account, "bob@example.org", "Bob", "Friends");
+	purple_prefs_set_int(PREF_MAX_STANZA_BYTES, MAX_BODY_BYTES_DEFAULT + 1024);
+	purple_prefs_set_int(PREF_RATE_BURST, 2);
+	purple_prefs_set_int(PREF_RATE_PER_MINUTE, 30);
+
+	outgoing_suggestion_start(f->pc, "bob@example.org", itemlist_new_numbered(200));
+	g_assert_cmpuint(stub_timeout_last_interval(), ==, SEND_INTERVAL_MSEC);
+	stub_timeouts_run();
+	g_assert_cmpuint(stub_sent->len, ==, 2);
+	g_assert_cmpuint(stub_timeout_last_interval(), >, 2000 - 100);
+	g_assert_cmpuint(stub_timeout_last_interval(), <=, 2000 + 1);
+}
+
+/* Without a rate limit, stanzas only keep the short pause */
+static void
+test_send_unpaced(Fixture *f, gconstpointer data)
+{
+	guint i;
+
+	buddy_add(f, f->account, "bob@example.org", "Bob", "Friends");
+	purple_prefs_set_int(PREF_MAX_STANZA_BYTES, MAX_BODY_BYTES_DEFAULT + 1024);
+	purple_prefs_set_int(PREF_RATE_PER_MINUTE, 0);
+
+	outgoing_suggestion_start(f->pc, "bob@example.org", itemlist_new_numbered(200));
+	for (i = 1; stub_timeouts_pending(); i++) {
+		g_assert_cmpuint(stub_timeout_last_interval(), ==, SEND_INTERVAL_MSEC);
+		stub_timeouts_run();
+		g_assert_cmpuint(stub_sent->len, ==, i + 1);
+	}
+	g_assert_cmpuint(stub_sent->len, >, RATE_BURST_DEFAULT);
+}
+
+/*
+ * Answers to suggestions sent as <iq/>s
+ */
+static void
+test_exchange_result(Fixture *f, gconstpointer data)
+{
+	PurpleBuddy *b = buddy_add(f, f->account, "bob@example.org", "Bob", "Friends");
+
+	buddy_set_resources(f, b, "laptop", "phone", NULL);
+	exchange_start(f, b);
+
+	/* One result is enough */
+	g_assert_true(answer_iq(f, "bob@example.org/laptop", NULL));
+	g_assert_null(pending_exchanges);
+	g_assert_cmpuint(stub_sent->len, ==, 0);
+}
+
+static void
+test_exchange_error_keeps_waiting(Fixture *f, gconstpointer data)
+{
+	PurpleBuddy *b = buddy_add(f, f->account, "bob@example.org", "Bob", "Friends");
+	PendingExchange *exchange;
+
+	buddy_set_resources(f, b, "laptop", "phone", NULL);
+	exchange = exchange_start(f, b);
+
+	/* The other resource may still accept it */
+	g_assert_true(answer_iq(f, "bob@example.org/laptop", "cancel"));
+	g_assert_cmpuint(g_list_length(exchange->iqs), ==, 1);
+	g_assert_nonnull(pending_iq_lookup("bob@example.org/phone"));
+
+	/* Refused everywhere, nothing is sent again */
+	g_assert_true(answer_iq(f, "bob@example.org/phone", "auth"));
+	g_assert_null(pending_exchanges);
+	g_assert_cmpuint(stub_sent->len, ==, 0);
+	g_assert_cmpuint(stub_timeouts_pending(), ==, 0);
+}
+
+static void
+test_exchange_wait_retries(Fixture *f, gconstpointer data)
+{
+	PurpleBuddy *b = buddy_add(f, f->account, "bob@example.org", "Bob", "Friends");
+	PendingExchange *exchange;
+	PendingIq *piq;
+	char *old_id;
+
+	buddy_set_resources(f, b, "laptop", NULL);
+	exchange = exchange_start(f, b);
+	piq = pending_iq_lookup("bob@example.org/laptop");
+	old_id = g_strdup(piq->id);
+
+	g_assert_true(answer_iq(f, "bob@example.org/laptop", "wait"));
+	g_assert_null(piq->id);
+	g_assert_cmpuint(stub_sent->len, ==, 0);
+	g_assert_cmpuint(stub_timeout_last_interval(), ==, IQ_RETRY_SECONDS * 1000);
+
+	/* The same <x/> goes out again with a new id, and gets a new timeout */
+	stub_timeouts_run();
+	g_assert_cmpuint(stub_sent->len, ==, 1);
+	g_assert_nonnull(piq->id);
+	g_assert_cmpstr(piq->id, !=, old_id);
+	g_assert_nonnull(strstr(g_ptr_array_index(stub_sent, 0), piq->id));
+	g_assert_cmpuint(count_substrings(g_ptr_array_index(stub_sent, 0), "<item "), ==, 3);
+	g_assert_cmpuint(exchange->timer, !=, 0);
+	g_assert_cmpuint(stub_timeout_last_interval(), ==, IQ_TIMEOUT_SECONDS * 1000);
+
+	g_assert_true(answer_iq(f, "bob@example.org/laptop", NULL));
+	g_assert_null(pending_exchanges);
+	g_free(old_id);
+}
+
+static void
+test_exchange_wait_falls_back(Fixture *f, gconstpointer data)
+{
+	PurpleBuddy *b = buddy_add(f, f->account, "bob@example.org", "Bob", "Friends");
+	PendingExchange *exchange;
+	guint i;
+
+	buddy_set_resources(f, b, "laptop", NULL);
+	exchange = exchange_start(f, b);
+
+	for (i = 0; i < IQ_MAX_RETRIES; i++) {
+		g_assert_true(answer_iq(f, "bob@example.org/laptop", "wait"));
+		stub_timeouts_run();
+		purple_timeout_remove(exchange->timer);
+		exchange->timer = 0;
+	}
+	g_assert_cmpuint(stub_sent->len, ==, IQ_MAX_RETRIES);
+
+	/* Still busy after the last retry, the suggestion goes out as <message/> */
+	g_assert_true(answer_iq(f, "bob@example.org/laptop", "wait"));
+	g_assert_null(pending_exchanges);
+	g_assert_cmpuint(stub_sent->len, ==, IQ_MAX_RETRIES + 1);
+	g_assert_true(g_str_has_prefix(g_ptr_array_index(stub_sent, IQ_MAX_RETRIES), "<message "));
+	g_assert_cmpuint(count_substrings(g_ptr_array_index(stub_sent, IQ_MAX_RETRIES), "<item "), ==, 3);
+}
+
+
+/*
+ * History of exchanges
+ */
+/* Shows a suggestion of carol and dave from bob, returns its table */
+static StubWindow *
+suggestion_receive(Fixture *f)
+{
+	xmlnode *xnode = xnode_new_rosterx();
+
+	buddy_add(f, f->account, "bob@example.org", "Bob", "Friends");
+	xitem_add(xnode, NULL, "carol@example.org", "Carol", "Friends", NULL);
+	xitem_add(xnode, NULL, "dave@example.org", "Dave", NULL);
+	g_assert_true(receive_iq(f, "bob@example.org/laptop", "a1", xnode));
+	stub_timeouts_run();
+	xmlnode_free(xnode);
+
+	g_assert_nonnull(stub_searchresults_last());
+	return stub_searchresults_last();
+}
+
+/* Presses the button labeled label of a table on its row for jid */
+static void
+searchresults_press(StubWindow *window, const char *label, const char *jid)
+{
+	PurpleNotifySearchButton *button = NULL;
+	GList *l, *row = NULL;
+
+	for (l = window->results->buttons; l; l = g_list_next(l))
+		if (!g_strcmp0(((PurpleNotifySearchButton *) l->data)->label, label))
+			button = l->data;
+	for (l = window->results->rows; l; l = g_list_next(l))
+		if (!g_strcmp0(g_list_nth_data(l->data, COLUMN_JID), jid))
+			row = l->data;
+	g_assert_nonnull(button);
+	g_assert_nonnull(row);
+	button->callback(window->handle, row, window->user_data);
+}
+
+static void
+test_history_declined(Fixture *f, gconstpointer data)
+{
+	StubWindow *window;
+
+	purple_prefs_set_bool(PREF_HISTORY, TRUE);
+	window = suggestion_receive(f);
+	searchresults_press(window, "Decline", "dave@example.org");
+	g_assert_false(history_has("bob@example.org", "carol@example.org", HISTORY_DECLINED));
+	g_assert_true(history_has("bob@example.org", "dave@example.org", HISTORY_DECLINED));
+
+	/* Not suggested again */
+	purple_notify_close(PURPLE_NOTIFY_SEARCHRESULTS, window);
+	window = suggestion_receive(f);
+	g_assert_cmpuint(g_list_length(window->results->rows), ==, 1);
+}
+
+/* Closing the table is not a decision of the user */
+static void
+test_history_closed(Fixture *f, gconstpointer data)
+{
+	purple_prefs_set_bool(PREF_HISTORY, TRUE);
+	purple_notify_close(PURPLE_NOTIFY_SEARCHRESULTS, suggestion_receive(f));
+	g_assert_null(searchresults_open);
+	g_assert_false(history_has("bob@example.org", "dave@example.org", HISTORY_DECLINED));
+}
+
+/* Without the preference there is nothing to decline */
+static void
+test_history_off(Fixture *f, gconstpointer data)
+{
+	StubWindow *window = suggestion_receive(f);
+	GList *l;
+
+	for (l = window->results->buttons; l; l = g_list_next(l))
+		g_assert_cmpstr(((PurpleNotifySearchButton *) l->data)->label, !=, "Decline");
+}
+
+static void
+test_history_closed_with_plugin(Fixture *f, gconstpointer data)
+{
+	purple_prefs_set_bool(PREF_HISTORY, TRUE);
+	suggestion_receive(f);
+
+	plugin_reload(f);
+	g_assert_cmpuint(stub_windows_open(), ==, 0);
+	g_assert_null(searchresults_open);
+	g_assert_false(history_has("bob@example.org", "dave@example.org", HISTORY_DECLINED));
+}
+
+static void
+test_history_sent_after_result(Fixture *f, gconstpointer data)
+{
+	PurpleBuddy *b = buddy_add(f, f->account, "bob@example.org", "Bob", "Friends");
+
+	buddy_set_resources(f, b, "laptop", NULL);
+	exchange_start(f, b);
+	g_assert_false(history_has("bob@example.org", "contact0@example.org", HISTORY_SENT));
+
+	g_assert_true(answer_iq(f, "bob@example.org/laptop", NULL));
+	g_assert_true(history_has("bob@example.org", "contact0@example.org", HISTORY_SENT));
+	g_assert_true(history_has("bob@example.org", "contact2@example.org", HISTORY_SENT));
+}
+
+static void
+test_history_sent_after_error(Fixture *f, gconstpointer data)
+{
+	PurpleBuddy *b = buddy_add(f, f->account, "bob@example.org", "Bob", "Friends");
+
+	buddy_set_resources(f, b, "laptop", NULL);
+	exchange_start(f, b);
+
+	g_assert_true(answer_iq(f, "bob@example.org/laptop", "cancel"));
+	g_assert_false(history_has("bob@example.org", "contact0@example.org", HISTORY_SENT));
+}
+
+/* Keys up to the longest jids are kept, longer ones are not */
+static void
+test_history_long_jids(Fixture *f, gconstpointer data)
+{
+	char *peer = g_strnfill(JID_BUFFER_SIZE - 1, 'p');
+	char *jid = g_strnfill(JID_BUFFER_SIZE - 1, 'j');
+	char *too_long = g_strnfill(JID_BUFFER_SIZE + 1, 'j');
+
+	history_add(peer, jid, HISTORY_SENT);
+	history_add(peer, too_long, HISTORY_SENT);
+	g_assert_true(history_has(peer, jid, HISTORY_SENT));
+	g_assert_false(history_has(peer, too_long, HISTORY_SENT));
+
+	plugin_reload(f);
+	g_assert_true(history_has(peer, jid, HISTORY_SENT));
+	g_assert_cmpuint(g_hash_table_size(history), ==, 1);
+
+	g_free(too_long);
+	g_free(jid);
+	g_free(peer);
+}
+
+/* A record that was written only partly does not hide the ones after it */
+static void
+test_history_partial_record(Fixture *f, gconstpointer data)
+{
+	static const guint8 fragment[] = { 'R', 'X', HISTORY_SENT, 0, 15, 0, 17, 0, 'b', 'o', 'b' };
+
+	history_add("bob@example.org", "carol@example.org", HISTORY_SENT);
+	g_assert_cmpuint(fwrite(fragment, 1, sizeof(fragment), history_file), ==, sizeof(fragment));
+	history_add("bob@example.org", "dave@example.org", HISTORY_DECLINED);
+
+	plugin_reload(f);
+	g_assert_true(history_has("bob@example.org", "carol@example.org", HISTORY_SENT));
+	g_assert_true(history_has("bob@example.org", "dave@example.org", HISTORY_DECLINED));
+	g_assert_cmpuint(g_hash_table_size(history), ==, 2);
+}
+
+/* Length of the history file on disk */
+static gsize
+history_file_length()
+{
+	char *filename = g_build_filename(purple_user_dir(), HISTORY_FILENAME, NULL);
+	char *contents = NULL;
+	gsize length = 0;
+
+	history_flush();
+	g_assert_true(g_file_get_contents(filename, &contents, &length, NULL));
+	g_free(contents);
+	g_free(filename);
+	return length;
+}
+
+/* Fragments are dropped and the kinds of an entry merged into one record at load */
+static void
+test_history_compacted(Fixture *f, gconstpointer data)
+{
+	static const guint8 fragment[] = { 'R', 'X', HISTORY_SENT, 0, 15, 0 };
+	gsize record_len = HISTORY_RECORD_HEADER + strlen("bob@example.org") +
+			strlen("carol@example.org") + HISTORY_RECORD_TRAILER;
+
+	history_add("bob@example.org", "carol@example.org", HISTORY_SENT);
+	g_assert_cmpuint(fwrite(fragment, 1, sizeof(fragment), history_file), ==, sizeof(fragment));
+	history_add("bob@example.org", "carol@example.org", HISTORY_DECLINED);
+	g_assert_cmpuint(history_file_length(), ==, 2 * record_len + sizeof(fragment));
+
+	plugin_reload(f);
+	g_assert_cmpuint(history_file_length(), ==, record_len);
+	g_assert_true(history_has("bob@example.org", "carol@example.org", HISTORY_SENT));
+	g_assert_true(history_has("bob@example.org", "carol@example.org", HISTORY_DECLINED));
+
+	/* Still readable, and appended to */
+	history_add("bob@example.org", "craig@example.org", HISTORY_SENT);
+	plugin_reload(f);
+	g_assert_cmpuint(history_file_length(), ==, 2 * record_len);
+	g_assert_true(history_has("bob@example.org", "carol@example.org", HISTORY_DECLINED));
+	g_assert_true(history_has("bob@example.org", "craig@example.org", HISTORY_SENT));
+}
+
+static void
+test_history_clear(Fixture *f, gconstpointer data)
+{
+	PurplePluginAction action = { NULL, clear_history_action_cb, &f->plugin, NULL, NULL };
+
+	history_add("bob@example.org", "carol@example.org", HISTORY_SENT);
+	history_flush();
+
+	action.callback(&action);
+	g_assert_false(history_has("bob@example.org", "carol@example.org", HISTORY_SENT));
+	g_assert_true(g_str_has_prefix(stub_notify_last_text(), "The exchange history was cleared."));
+
+	/* Also gone after a restart, and new entries are kept */
+	history_add("bob@example.org", "dave@example.org", HISTORY_SENT);
+	plugin_reload(f);
+	g_assert_false(history_has("bob@example.org", "carol@example.org", HISTORY_SENT));
+	g_assert_true(history_has("bob@example.org", "dave@example.org", HISTORY_SENT));
+}
+
+
+/*
+ * Delta mode
+ */
+static guint
+delta_length(Fixture *f, PurpleConnection *pc, const char *to, ItemList *itemlist)
+{
+	GHashTable *state;
+	ItemList *delta = suggestion_delta(pc, to, itemlist, &state);
+	guint n = g_queue_get_length(&delta->items);
+
+	g_hash_table_destroy(state);
+	itemlist_destroy(delta);
+	return n;
+}
+
+/* A suggestion only becomes the last one once it was delivered */
+static void
+test_delta_after_result(Fixture *f, gconstpointer data)
+{
+	PurpleBuddy *b = buddy_add(f, f->account, "bob@example.org", "Bob", "Friends");
+
+	purple_prefs_set_bool(PREF_DELTA, TRUE);
+	buddy_set_resources(f, b, "laptop", NULL);
+	exchange_start(f, b);
+	g_assert_cmpuint(delta_length(f, f->pc, "bob@example.org", itemlist_new_numbered(3)), ==, 3);
+
+	g_assert_true(answer_iq(f, "bob@example.org/laptop", NULL));
+	g_assert_cmpuint(delta_length(f, f->pc, "bob@example.org", itemlist_new_numbered(3)), ==, 0);
+
+	outgoing_suggestion_start(f->pc, "bob@example.org", itemlist_new_numbered(3));
+	g_assert_cmpuint(stub_sent->len, ==, 0);
+	g_assert_null(pending_exchanges);
+}
+
+static void
+test_delta_after_error(Fixture *f, gconstpointer data)
+{
+	PurpleBuddy *b = buddy_add(f, f->account, "bob@example.org", "Bob", "Friends");
+
+	purple_prefs_set_bool(PREF_DELTA, TRUE);
+	buddy_set_resources(f, b, "laptop", NULL);
+	exchange_start(f, b);
+
+	/* Refused, the next suggestion has all items again */
+	g_assert_true(answer_iq(f, "bob@example.org/laptop", "cancel"));
+	g_assert_null(outgoing_suggestions);
+	g_assert_cmpuint(delta_length(f, f->pc, "bob@example.org", itemlist_new_numbered(3)), ==, 3);
+}
+
+/* Buddies of f's account as items, NULL-terminated jids */
+static ItemList *
+itemlist_new_buddies(Fixture *f, ...)
+{
+	ItemList *itemlist = itemlist_new();
+	const char *jid;
+	va_list args;
+
+	va_start(args, f);
+	while ((jid = va_arg(args, const char *))) {
+		if (!purple_find_buddy(f->account, jid))
+			buddy_add(f, f->account, jid, NULL, "Friends");
+		itemlist_add(itemlist, ITEM_ACTION_ADD, jid, NULL, "Friends", NULL);
+	}
+	va_end(args);
+	return itemlist;
+}
+
+/* Leaving contacts out of a selection is not a removal */
+static void
+test_delta_unselected_kept(Fixture *f, gconstpointer data)
+{
+	purple_prefs_set_bool(PREF_DELTA, TRUE);
+	buddy_add(f, f->account, "bob@example.org", "Bob", "Friends");
+
+	outgoing_suggestion_start(f->pc, "bob@example.org",
+			itemlist_new_buddies(f, "a@example.org", "b@example.org", NULL));
+	outgoing_suggestion_start(f->pc, "bob@example.org", itemlist_new_buddies(f, "c@example.org", NULL));
+
+	g_assert_cmpuint(stub_sent->len, ==, 2);
+	g_assert_null(strstr(g_ptr_array_index(stub_sent, 1), "action='delete'"));
+	g_assert_cmpuint(count_substrings(g_ptr_array_index(stub_sent, 1), "<item "), ==, 1);
+	g_assert_cmpuint(stub_windows_open(), ==, 0);
+
+	/* A and B are still suggested */
+	g_assert_cmpuint(delta_length(f, f->pc, "bob@example.org",
+				itemlist_new_buddies(f, "a@example.org", "b@example.org", "c@example.org", NULL)), ==, 0);
+}
+
+/* Contacts that left the buddy list are removed once the user agrees */
+static void
+test_delta_removed_confirmed(Fixture *f, gconstpointer data)
+{
+	StubWindow *window;
+
+	purple_prefs_set_bool(PREF_DELTA, TRUE);
+	buddy_add(f, f->account, "bob@example.org", "Bob", "Friends");
+
+	outgoing_suggestion_start(f->pc, "bob@example.org",
+			itemlist_new_buddies(f, "a@example.org", "b@example.org", NULL));
+	purple_blist_remove_buddy(purple_find_buddy(f->account, "a@example.org"));
+	outgoing_suggestion_start(f->pc, "bob@example.org", itemlist_new_buddies(f, "b@example.org", NULL));
+
+	window = stub_request_last();
+	g_assert_nonnull(window);
+	g_assert_nonnull(strstr(window->secondary, "\na@example.org"));
+	g_assert_cmpuint(stub_sent->len, ==, 1);
+
+	stub_request_action(window, 0);
+	g_assert_cmpuint(stub_sent->len, ==, 2);
+	g_assert_nonnull(strstr(g_ptr_array_index(stub_sent, 1), "action='delete' jid='a@example.org'"));
+	g_assert_null(outgoing_suggestions);
+}
+
+static void
+test_delta_removed_kept(Fixture *f, gconstpointer data)
+{
+	purple_prefs_set_bool(PREF_DELTA, TRUE);
+	buddy_add(f, f->account, "bob@example.org", "Bob", "Friends");
+
+	outgoing_suggestion_start(f->pc, "bob@example.org",
+			itemlist_new_buddies(f, "a@example.org", "b@example.org", NULL));
+	purple_blist_remove_buddy(purple_find_buddy(f->account, "a@example.org"));
+	outgoing_suggestion_start(f->pc, "bob@example.org", itemlist_new_buddies(f, "b@example.org", NULL));
+
+	/* Nothing else changed, nothing is sent, and A is not asked about again */
+	stub_request_action(stub_request_last(), 1);
+	g_assert_cmpuint(stub_sent->len, ==, 1);
+	g_assert_null(outgoing_suggestions);
+	outgoing_suggestion_start(f->pc, "bob@example.org", itemlist_new_buddies(f, "b@example.org", NULL));
+	g_assert_cmpuint(stub_windows_open(), ==, 0);
+}
+
+static void
+test_delta_per_account(Fixture *f, gconstpointer data)
+{
+	PurpleAccount *other = stub_account_new("alice@example.net", "prpl-jabber");
+
+	purple_prefs_set_bool(PREF_DELTA, TRUE);
+	buddy_add(f, f->account, "bob@example.org", "Bob", "Friends");
+
+	/* Offline, the <message/> counts as delivered */
+	outgoing_suggestion_start(f->pc, "bob@example.org", itemlist_new_numbered(3));
+	g_assert_cmpuint(stub_sent->len, ==, 1);
+	g_assert_null(outgoing_suggestions);
+
+	g_assert_cmpuint(delta_length(f, f->pc, "Bob@example.org/laptop", itemlist_new_numbered(4)), ==, 1);
+	g_assert_cmpuint(delta_length(f, purple_account_get_connection(other), "bob@example.org",
+				itemlist_new_numbered(4)), ==, 4);
+}
+
+static void
+test_delta_persisted(Fixture *f, gconstpointer data)
+{
+	ItemList *itemlist = itemlist_new_numbered(2);
+	ItemList *changed = itemlist_new_numbered(2);
+
+	purple_prefs_set_bool(PREF_DELTA, TRUE);
+	buddy_add(f, f->account, "bob@example.org", "Bob", "Friends");
+	itemlist_add(itemlist, ITEM_ACTION_ADD, "tab\there@example.org", "Line\nbreak", "A", "B", NULL);
+	outgoing_suggestion_start(f->pc, "bob@example.org", itemlist);
+
+	plugin_reload(f);
+
+	itemlist = itemlist_new_numbered(2);
+	itemlist_add(itemlist, ITEM_ACTION_ADD, "tab\there@example.org", "Line\nbreak", "B", "A", NULL);
+	g_assert_cmpuint(delta_length(f, f->pc, "bob@example.org", itemlist), ==, 0);
+
+	/* contact1 is gone, the other one now has a group */
+	itemlist_add(changed, ITEM_ACTION_ADD, "tab\there@example.org", "Line\nbreak", "A", NULL);
+	g_assert_cmpuint(delta_length(f, f->pc, "bob@example.org", changed), ==, 1);
+}
+
+
+/*
+ * Applying suggestions
+ */
+static void
+test_apply_batches(Fixture *f, gconstpointer data)
+{
+	bulk_add_start(f->pc, itemlist_new_numbered(2 * ADD_BATCH_SIZE + 10));
+	g_assert_cmpuint(stub_server_adds->len, ==, ADD_BATCH_SIZE);
+	g_assert_null(purple_find_buddy(f->account, "contact30@example.org"));
+	g_assert_cmpuint(stub_timeout_last_interval(), ==, ADD_BATCH_INTERVAL_MSEC);
+
+	stub_timeouts_run();
+	g_assert_cmpuint(stub_server_adds->len, ==, 2 * ADD_BATCH_SIZE);
+	stub_timeouts_run();
+	g_assert_cmpuint(stub_server_adds->len, ==, 2 * ADD_BATCH_SIZE + 10);
+	g_assert_nonnull(purple_find_buddy(f->account, "contact59@example.org"));
+
+	g_assert_null(bulk_adds);
+	g_assert_cmpuint(stub_timeouts_pending(), ==, 0);
+}
+
+static void
+test_apply_signed_off(Fixture *f, gconstpointer data)
+{
+	bulk_add_start(f->pc, itemlist_new_numbered(2 * ADD_BATCH_SIZE));
+	g_assert_cmpuint(stub_server_adds->len, ==, ADD_BATCH_SIZE);
+
+	/* The rest is dropped with the connection */
+	stub_connection_sign_off(f->pc);
+	stub_timeouts_run();
+	g_assert_cmpuint(stub_server_adds->len, ==, ADD_BATCH_SIZE);
+	g_assert_null(bulk_adds);
+	g_assert_cmpuint(stub_timeouts_pending(), ==, 0);
+}
+
+
+/* Modified buddies change groups on the server without a new subscription request */
+static void
+test_apply_modify_moves(Fixture *f, gconstpointer data)
+{
+	ItemList *itemlist = itemlist_new();
+
+	buddy_add(f, f->account, "carol@example.org", "Carol", "Friends");
+	itemlist_add(itemlist, ITEM_ACTION_MODIFY, "carol@example.org", "Carol", "Work", NULL);
+	bulk_add_start(f->pc, itemlist);
+
+	g_assert_cmpuint(stub_server_adds->len, ==, 0);
+	g_assert_cmpuint(stub_server_moves->len, ==, 1);
+	g_assert_cmpstr(g_ptr_array_index(stub_server_moves, 0), ==, "carol@example.org");
+	g_assert_nonnull(purple_find_buddy_in_group(f->account, "carol@example.org", purple_find_group("Work")));
+	g_assert_null(purple_find_buddy_in_group(f->account, "carol@example.org", purple_find_group("Friends")));
+}
+
+/* Erin is new, Carol moves to another group and Dave is removed */
+static ItemList *
+itemlist_new_mixed(Fixture *f)
+{
+	ItemList *itemlist = itemlist_new();
+
+	buddy_add(f, f->account, "carol@example.org", "Carol", "Friends");
+	buddy_add(f, f->account, "dave@example.org", "Dave", "Friends");
+	itemlist_add(itemlist, ITEM_ACTION_ADD, "erin@example.org", "Erin", "Friends", NULL);
+	itemlist_add(itemlist, ITEM_ACTION_MODIFY, "carol@example.org", "Carol", "Work", NULL);
+	itemlist_add(itemlist, ITEM_ACTION_DELETE, "dave@example.org", NULL, NULL);
+	return itemlist;
+}
+
+/* "All" with changes to known buddies asks first, stating how many of each there are */
+static void
+test_apply_all_confirmed(Fixture *f, gconstpointer data)
+{
+	StubWindow *window;
+
+	bulk_add_start_confirmed(f->pc, itemlist_new_mixed(f), "bob@example.org");
+	window = stub_request_last();
+	g_assert_nonnull(window);
+	g_assert_nonnull(strstr(window->secondary, "add 1 contacts"));
+	g_assert_nonnull(strstr(window->secondary, "alias of 1 "));
+	g_assert_nonnull(strstr(window->secondary, "remove 1 "));
+	g_assert_nonnull(bulk_adds);
+	g_assert_null(purple_find_buddy(f->account, "erin@example.org"));
+
+	stub_request_action(window, 0);
+	g_assert_nonnull(purple_find_buddy(f->account, "erin@example.org"));
+	g_assert_nonnull(purple_find_buddy_in_group(f->account, "carol@example.org", purple_find_group("Work")));
+	g_assert_null(purple_find_buddy(f->account, "dave@example.org"));
+	g_assert_null(bulk_adds);
+}
+
+static void
+test_apply_all_only_new(Fixture *f, gconstpointer data)
+{
+	bulk_add_start_confirmed(f->pc, itemlist_new_mixed(f), "bob@example.org");
+	stub_request_action(stub_request_last(), 1);
+
+	g_assert_nonnull(purple_find_buddy(f->account, "erin@example.org"));
+	g_assert_nonnull(purple_find_buddy_in_group(f->account, "carol@example.org", purple_find_group("Friends")));
+	g_assert_nonnull(purple_find_buddy(f->account, "dave@example.org"));
+	g_assert_cmpuint(stub_server_moves->len, ==, 0);
+	g_assert_null(bulk_adds);
+}
+
+static void
+test_apply_all_cancelled(Fixture *f, gconstpointer data)
+{
+	bulk_add_start_confirmed(f->pc, itemlist_new_mixed(f), "bob@example.org");
+	stub_request_action(stub_request_last(), 2);
+
+	g_assert_null(purple_find_buddy(f->account, "erin@example.org"));
+	g_assert_nonnull(purple_find_buddy(f->account, "dave@example.org"));
+	g_assert_null(bulk_adds);
+
+	/* Open when the plugin goes away, it is closed */
+	bulk_add_start_confirmed(f->pc, itemlist_new_mixed(f), "bob@example.org");
+	g_assert_cmpuint(stub_windows_open(), ==, 1);
+	bulk_add_destroy_all();
+	g_assert_cmpuint(stub_windows_open(), ==, 0);
+}
+
+
+/*
+ * Plugin actions
+ */
+static void
+test_action_show_metrics(Fixture *f, gconstpointer data)
+{
+	PurplePluginAction action = { NULL, show_metrics_action_cb, &f->plugin, NULL, NULL };
+	const char *text;
+
+	metrics_record(STAGE_IQ_ROUNDTRIP, g_get_monotonic_time(), 1);
+	show_metrics_action_cb(&action);
+	g_assert_true(g_str_has_prefix(stub_notify_last_text(), "Exchange pipeline statistics\n"));
+	text = stub_notify_last_text() + strlen("Exchange pipeline statistics\n");
+
+	/* Stage names are text, not markup */
+	g_assert_nonnull(strstr(text, "&lt;iq/&gt; round trip: "));
+	g_assert_nonnull(strstr(text, "snapshot -&gt; itemlist: "));
+	g_assert_null(strstr(text, "<iq/>"));
+	g_assert_cmpuint(count_substrings(text, "<br/>"), ==, count_substrings(text, ": "));
+	g_assert_null(strchr(text, '\n'));
+}
+
+
+/*
+ * Plaintext body of the fallback message
+ */
+static void
+test_message_body(Fixture *f, gconstpointer data)
+{
+	ItemList *itemlist = itemlist_new();
+	char *text;
+
+	itemlist_add(itemlist, ITEM_ACTION_ADD, "bob@example.org", "Bob", "Friends", NULL);
+	itemlist_add(itemlist, ITEM_ACTION_MODIFY, "carol@example.org", NULL, NULL);
+	itemlist_add(itemlist, ITEM_ACTION_DELETE, "dave@example.org", "Dave", NULL);
+
+	text = create_message_from_itemlist(itemlist_get_items(itemlist), NULL, "Alice");
+	g_assert_cmpstr(text, ==,
+			"Alice has sent you a RosterX contact suggestion:\n"
+			"+ Bob\nxmpp:bob@example.org\n"
+			"~ carol@example.org\nxmpp:carol@example.org\n"
+			"- Dave\nxmpp:dave@example.org\n");
+	g_free(text);
+
+	/* Only up to the end of the chunk */
+	text = create_message_from_itemlist(itemlist_get_items(itemlist),
+			g_list_next(itemlist_get_items(itemlist)), "Alice");
+	g_assert_cmpstr(text, ==,
+			"Alice has sent you a RosterX contact suggestion:\n"
+			"+ Bob\nxmpp:bob@example.org\n");
+	g_free(text);
+
+	itemlist_destroy(itemlist);
+}
+
+static void
+test_message_body_budget(Fixture *f, gconstpointer data)
+{
+	ItemList *itemlist = itemlist_new();
+	gsize budget = 256;
+	char jid[64], *text;
+	guint i;
+
+	for (i = 0; i < 100; i++) {
+		g_snprintf(jid, sizeof(jid), "contact%u@example.org", i);
+		itemlist_add(itemlist, ITEM_ACTION_ADD, jid, "Contact", NULL);
+	}
+	purple_prefs_set_int(PREF_MAX_BODY_BYTES, budget);
+
+	text = create_message_from_itemlist(itemlist_get_items(itemlist), NULL, "Alice");
+	g_assert_cmpuint(strlen(text), <=, budget + 64);
+	g_assert_true(g_str_has_prefix(text, "Alice has sent you a RosterX contact suggestion:\n"
+				"+ Contact\nxmpp:contact0@example.org\n"));
+
+	/* The items left out are counted */
+	i = count_substrings(text, "xmpp:");
+	g_assert_cmpuint(i, >, 0);
+	g_snprintf(jid, sizeof(jid), "…and %u more\n", 100 - i);
+	g_assert_true(g_str_has_suffix(text, jid));
+
+	g_free(text);
+	itemlist_destroy(itemlist);
+}
+
+static void
+test_message_body_count(Fixture *f, gconstpointer data)
+{
+	ItemList *itemlist = itemlist_new_numbered(1300);
+	GString *count = g_string_new(NULL);
+	char *text;
+	guint nlisted;
+
+	append_grouped_count(count, 0);
+	g_string_append_c(count, ' ');
+	append_grouped_count(count, 999);
+	g_string_append_c(count, ' ');
+	append_grouped_count(count, 1000);
+	g_string_append_c(count, ' ');
+	append_grouped_count(count, 4294967295u);
+	g_assert_cmpstr(count->str, ==, "0 999 1,000 4,294,967,295");
+	g_string_free(count, TRUE);
+
+	purple_prefs_set_int(PREF_MAX_BODY_BYTES, 256);
+	text = create_message_from_itemlist(itemlist_get_items(itemlist), NULL, "Alice");
+	nlisted = count_substrings(text, "xmpp:");
+	g_assert_cmpuint(nlisted, <, 300);
+	count = g_string_new("\u2026and ");
+	append_grouped_count(count, 1300 - nlisted);
+	g_string_append(count, " more\n");
+	g_assert_true(g_str_has_suffix(text, count->str));
+	g_assert_nonnull(strstr(text, "and 1,"));
+
+	g_string_free(count, TRUE);
+	g_free(text);
+	itemlist_destroy(itemlist);
+}
+
+
+int
+main(int argc, char *argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add("/xnode/roundtrip", Fixture, NULL, fixture_setup, test_xnode_roundtrip, fixture_teardown);
+	g_test_add("/xnode/chunks", Fixture, NULL, fixture_setup, test_xnode_chunks, fixture_teardown);
+	g_test_add("/parser/max-items", Fixture, NULL, fixture_setup, test_parser_max_items, fixture_teardown);
+	g_test_add("/parser/ignored-items-count", Fixture, NULL, fixture_setup,
+			test_parser_ignored_items_count, fixture_teardown);
+	g_test_add("/parser/max-groups", Fixture, NULL, fixture_setup, test_parser_max_groups, fixture_teardown);
+	g_test_add("/parser/empty", Fixture, NULL, fixture_setup, test_parser_empty, fixture_teardown);
+	g_test_add("/filter/applicable", Fixture, NULL, fixture_setup, test_filter_applicable, fixture_teardown);
+	g_test_add("/filter/follows-blist", Fixture, NULL, fixture_setup, test_filter_follows_blist,
+			fixture_teardown);
+	g_test_add("/receive/coalesce", Fixture, NULL, fixture_setup, test_coalesce, fixture_teardown);
+	g_test_add("/receive/coalesce-per-sender", Fixture, NULL, fixture_setup, test_coalesce_per_sender,
+			fixture_teardown);
+	g_test_add("/receive/coalesce-bounded", Fixture, NULL, fixture_setup, test_coalesce_bounded,
+			fixture_teardown);
+	g_test_add("/receive/unknown-sender", Fixture, NULL, fixture_setup, test_receive_unknown_sender,
+			fixture_teardown);
+	g_test_add("/rate-limit/burst", Fixture, NULL, fixture_setup, test_rate_limit_burst, fixture_teardown);
+	g_test_add("/rate-limit/off", Fixture, NULL, fixture_setup, test_rate_limit_off, fixture_teardown);
+	g_test_add("/rate-limit/received", Fixture, NULL, fixture_setup, test_rate_limit_received,
+			fixture_teardown);
+	g_test_add("/caps/choose-best", Fixture, NULL, fixture_setup, test_choose_resource_best,
+			fixture_teardown);
+	g_test_add("/caps/choose-recent", Fixture, NULL, fixture_setup, test_choose_resource_recent,
+			fixture_teardown);
+	g_test_add("/caps/presence", Fixture, NULL, fixture_setup, test_caps_cache_presence, fixture_teardown);
+	g_test_add("/send/chunks", Fixture, NULL, fixture_setup, test_send_chunks, fixture_teardown);
+	g_test_add("/send/iqs-batched", Fixture, NULL, fixture_setup, test_send_iqs_batched, fixture_teardown);
+	g_test_add("/send/dialog-selection", Fixture, NULL, fixture_setup, test_send_dialog_selection,
+			fixture_teardown);
+	g_test_add("/send/dialog-alias", Fixture, NULL, fixture_setup, test_send_dialog_alias, fixture_teardown);
+	g_test_add("/send/group-dialog", Fixture, NULL, fixture_setup, test_send_group_dialog, fixture_teardown);
+	g_test_add("/send/group-dialog-all", Fixture, NULL, fixture_setup, test_send_group_dialog_all,
+			fixture_teardown);
+	g_test_add("/send/paced", Fixture, NULL, fixture_setup, test_send_paced, fixture_teardown);
+	g_test_add("/send/paced-prefs", Fixture, NULL, fixture_setup, test_send_paced_prefs, fixture_teardown);
+	g_test_add("/send/unpaced", Fixture, NULL, fixture_setup, test_send_unpaced, fixture_teardown);
+	g_test_add("/exchange/result", Fixture, NULL, fixture_setup, test_exchange_result, fixture_teardown);
+	g_test_add("/exchange/error-keeps-waiting", Fixture, NULL, fixture_setup,
+			test_exchange_error_keeps_waiting, fixture_teardown);
+	g_test_add("/exchange/wait-retries", Fixture, NULL, fixture_setup, test_exchange_wait_retries,
+			fixture_teardown);
+	g_test_add("/exchange/wait-falls-back", Fixture, NULL, fixture_setup, test_exchange_wait_falls_back,
+			fixture_teardown);
+	g_test_add("/history/declined", Fixture, NULL, fixture_setup, test_history_declined, fixture_teardown);
+	g_test_add("/history/closed", Fixture, NULL, fixture_setup, test_history_closed, fixture_teardown);
+	g_test_add("/history/off", Fixture, NULL, fixture_setup, test_history_off, fixture_teardown);
+	g_test_add("/history/closed-with-plugin", Fixture, NULL, fixture_setup,
+			test_history_closed_with_plugin, fixture_teardown);
+	g_test_add("/history/sent-after-result", Fixture, NULL, fixture_setup,
+			test_history_sent_after_result, fixture_teardown);
+	g_test_add("/history/sent-after-error", Fixture, NULL, fixture_setup,
+			test_history_sent_after_error, fixture_teardown);
+	g_test_add("/history/long-jids", Fixture, NULL, fixture_setup, test_history_long_jids,
+			fixture_teardown);
+	g_test_add("/history/partial-record", Fixture, NULL, fixture_setup, test_history_partial_record,
+			fixture_teardown);
+	g_test_add("/history/compacted", Fixture, NULL, fixture_setup, test_history_compacted,
+			fixture_teardown);
+	g_test_add("/history/clear", Fixture, NULL, fixture_setup, test_history_clear, fixture_teardown);
+	g_test_add("/delta/after-result", Fixture, NULL, fixture_setup, test_delta_after_result,
+			fixture_teardown);
+	g_test_add("/delta/after-error", Fixture, NULL, fixture_setup, test_delta_after_error, fixture_teardown);
+	g_test_add("/delta/unselected-kept", Fixture, NULL, fixture_setup, test_delta_unselected_kept,
+			fixture_teardown);
+	g_test_add("/delta/removed-confirmed", Fixture, NULL, fixture_setup, test_delta_removed_confirmed,
+			fixture_teardown);
+	g_test_add("/delta/removed-kept", Fixture, NULL, fixture_setup, test_delta_removed_kept,
+			fixture_teardown);
+	g_test_add("/delta/per-account", Fixture, NULL, fixture_setup, test_delta_per_account, fixture_teardown);
+	g_test_add("/delta/persisted", Fixture, NULL, fixture_setup, test_delta_persisted, fixture_teardown);
+	g_test_add("/apply/batches", Fixture, NULL, fixture_setup, test_apply_batches, fixture_teardown);
+	g_test_add("/apply/signed-off", Fixture, NULL, fixture_setup, test_apply_signed_off, fixture_teardown);
+	g_test_add("/apply/modify-moves", Fixture, NULL, fixture_setup, test_apply_modify_moves, fixture_teardown);
+	g_test_add("/apply/all-confirmed", Fixture, NULL, fixture_setup, test_apply_all_confirmed,
+			fixture_teardown);
+	g_test_add("/apply/all-only-new", Fixture, NULL, fixture_setup, test_apply_all_only_new,
+			fixture_teardown);
+	g_test_add("/apply/all-cancelled", Fixture, NULL, fixture_setup, test_apply_all_cancelled,
+			fixture_teardown);
+	g_test_add("/action/show-metrics", Fixture, NULL, fixture_setup, test_action_show_metrics,
+			fixture_teardown);
+	g_test_add("/message/body", Fixture, NULL, fixture_setup, test_message_body, fixture_teardown);
+	g_test_add("/message/body-budget", Fixture, NULL, fixture_setup, test_message_body_budget,
+			fixture_teardown);
+	g_test_add("/message/body-count", Fixture, NULL, fixture_setup, test_message_body_count,
+			fixture_teardown);
+
+	return g_test_run();
+}
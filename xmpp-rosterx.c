@@ -20,12 +20,27 @@
  */
 
 #include <glib.h>
+#include <glib/gstdio.h>
 
+#ifdef ROSTERX_STANDALONE
+/* Built outside the Pidgin source tree (see Makefile), where internal.h is not installed */
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define _(String)   ((const char *) (String))
+#define N_(String)  (String)
+#else
 #include "internal.h"
+#endif
 #include "debug.h"
+#include "eventloop.h"
 #include "notify.h"
 #include "request.h"
 #include "plugin.h"
+#include "prpl.h"
+#include "server.h"
+#include "util.h"
 #include "version.h"
 
 #include "xmpp-rosterx.h"
@@ -45,6 +60,11 @@
 //#define GROUPNAME_DEFAULT _("Buddies")
 #define GROUPNAME_DEFAULT "RosterX Suggestions"
 
+#define METRICS_FILENAME  "rosterx-statistics.txt"  /* in purple_user_dir() */
+#define TRACE_FILENAME    "rosterx-trace.txt"       /* in purple_user_dir() */
+#define HISTORY_FILENAME  "rosterx-history.dat"     /* in purple_user_dir() */
+#define DELTA_FILENAME    "rosterx-delta.txt"       /* in purple_user_dir() */
+
 /*
  * Preferences
  */
@@ -57,102 +77,436 @@ typedef enum {
 #define PREF_COMPATIBLE   PREFS_BASE "/compatible"
 #define STRICT_XEP        (purple_prefs_get_int(PREF_COMPATIBLE) == COMPATIBLE_XEP)
 
+/* Which RosterX-capable resources get an <iq/> in XEP mode */
+typedef enum {
+	TARGET_BEST_RESOURCE,
+	TARGET_ALL_RESOURCES,
+	TARGET_RECENT_RESOURCE
+} TargetSetting;
+
+#define PREF_TARGET       PREFS_BASE "/target"
+
+/* Limits for received suggestions; larger stanzas are rejected unparsed */
+#define PREF_MAX_ITEMS    PREFS_BASE "/max_items"
+#define PREF_MAX_GROUPS   PREFS_BASE "/max_groups"
+#define MAX_ITEMS_DEFAULT   10000
+#define MAX_GROUPS_DEFAULT  64
+
+/* Rate limit for received suggestions per sender, 0 disables it */
+#define PREF_RATE_PER_MINUTE  PREFS_BASE "/rate_per_minute"
+#define PREF_RATE_BURST       PREFS_BASE "/rate_burst"
+#define RATE_PER_MINUTE_DEFAULT  6
+#define RATE_BURST_DEFAULT       5
+
+/* Suggestions from one sender within this window are shown together, 0 disables it */
+#define PREF_COALESCE_MSEC    PREFS_BASE "/coalesce_msec"
+#define COALESCE_MSEC_DEFAULT    1500
+
+/* Outgoing suggestions are split into stanzas of at most this many bytes */
+#define PREF_MAX_STANZA_BYTES PREFS_BASE "/max_stanza_bytes"
+#define MAX_STANZA_BYTES_DEFAULT 32768
+#define STANZA_OVERHEAD_BYTES    512  /* envelope, <x/> and message header text */
+#define SEND_INTERVAL_MSEC       250  /* shortest pause between two stanzas of a suggestion */
+#define IQ_TIMEOUT_SECONDS       30   /* unanswered <iq/>s are re-sent as <message/> */
+#define IQ_RETRY_SECONDS         10   /* after a 'wait' error */
+#define IQ_MAX_RETRIES           3
+
+/* The plaintext body of the fallback message lists items up to this size */
+#define PREF_MAX_BODY_BYTES   PREFS_BASE "/max_body_bytes"
+#define MAX_BODY_BYTES_DEFAULT   4096
+
+/* Contacts already sent to a buddy, or declined when received from it, are left out */
+#define PREF_HISTORY          PREFS_BASE "/history"
+
+/* Later suggestions to a contact only carry what changed since the last one */
+#define PREF_DELTA            PREFS_BASE "/delta"
+
+/* Above this many contacts, the send dialog first offers whole groups, 0 never does */
+#define PREF_GROUP_DIALOG_THRESHOLD  PREFS_BASE "/group_dialog_threshold"
+#define GROUP_DIALOG_THRESHOLD_DEFAULT  500
+
 
 PurplePlugin  *rosterx_plugin = NULL;
 
 
-typedef struct _Item Item;
-struct _Item {
-	char *jid;
-	char *alias;
-	GList *entries; /* entries are char* */
+/*
+ * Arena: bump allocator for the objects of one exchange,
+ * which are all released at once
+ */
+#define ARENA_BLOCK_SIZE  8192
+#define ARENA_ALIGN(N)    (((N) + 2 * sizeof(gpointer) - 1) & ~(2 * sizeof(gpointer) - 1))
+
+typedef struct _Arena Arena;
+struct _Arena {
+	GSList *blocks;  /* entries are memory blocks, the head is in use */
+	gsize used;      /* bytes used in the head block */
+	gsize size;      /* size of the head block */
+	guint nblocks;
 };
 
-typedef struct _AuxData AuxData;
-struct _AuxData {
-	PurpleConnection *pc;
-	char *target_jid;
-};
+#define arena_new0(ARENA, TYPE)  ((TYPE *) arena_alloc0(ARENA, sizeof(TYPE)))
 
-typedef gboolean (*BuddyConditionFunc)(PurpleBuddy *);
-typedef gboolean (*ItemConditionFunc)(Item *, PurpleAccount *);
+static gpointer
+arena_alloc0(Arena *arena, gsize n)
+{
+	char *mem;
 
-static int global_entry_count = 0;
-static int global_auxdata_count = 0;
+	n = ARENA_ALIGN(n);
+	if (!arena->blocks || arena->used + n > arena->size) {
+		gsize size = MAX(n, ARENA_BLOCK_SIZE);
 
-static AuxData*
-auxdata_new(PurpleConnection *pc)
+		arena->blocks = g_slist_prepend(arena->blocks, g_malloc(size));
+		arena->size = size;
+		arena->used = 0;
+		arena->nblocks++;
+	}
+	mem = (char *) arena->blocks->data + arena->used;
+	arena->used += n;
+
+	memset(mem, 0, n);
+	return mem;
+}
+
+static char *
+arena_strndup(Arena *arena, const char *string, gsize len)
 {
-	AuxData *aux = g_new0(AuxData, 1);
-	aux->pc = pc;
+	char *copy = arena_alloc0(arena, len + 1);
 
-	purple_debug_misc(PLUGIN_ID, "auxdata_new(): now %d auxdata\n", ++global_auxdata_count);
-	return aux;
+	memcpy(copy, string, len);
+	return copy;
 }
 
 static void
-auxdata_destroy(AuxData *aux)
+arena_clear(Arena *arena)
 {
-	g_free(aux->target_jid);
-	g_free(aux);
+	g_slist_free_full(arena->blocks, g_free);
+	memset(arena, 0, sizeof(Arena));
+}
+
+
+/*
+ * Metrics: call counts, item counts and durations of each stage
+ * of the data conversion path (see below), and of <iq/> round trips
+ */
+typedef enum {
+	STAGE_SNAPSHOT_TO_ITEMLIST,
+	STAGE_ITEMLIST_TO_REQUEST,
+	STAGE_REQUEST_TO_ITEMLIST,
+	STAGE_ITEMLIST_TO_XNODE,
+	STAGE_XNODE_TO_ITEMLIST,
+	STAGE_FILTER,
+	STAGE_SEARCHRESULTS,
+	STAGE_IQ_ROUNDTRIP,
+	NUM_STAGES
+} Stage;
+
+static const char * const stage_names[NUM_STAGES] = {
+	"snapshot -> itemlist",
+	"itemlist -> request",
+	"request -> itemlist",
+	"itemlist -> xnode",
+	"xnode -> itemlist",
+	"filter",
+	"itemlist -> searchresults",
+	"<iq/> round trip"
+};
+
+#define STAGE_SAMPLES      256  /* latest durations kept per stage for the percentiles */
+#define HISTOGRAM_BUCKETS  18   /* item counts 0, 1, 2-3, 4-7, ..., 65536 and more */
+
+typedef struct _StageMetrics StageMetrics;
+struct _StageMetrics {
+	guint64 calls;
+	guint64 items;
+	gint64 total_usec;
+	gint64 max_usec;
+	gint64 samples[STAGE_SAMPLES];  /* ring buffer, the latest at (calls - 1) % STAGE_SAMPLES */
+	guint64 histogram[HISTOGRAM_BUCKETS];
+};
+
+static StageMetrics stage_metrics[NUM_STAGES];
 
-	purple_debug_misc(PLUGIN_ID, "auxdata_destroy(): now %d auxdata\n", --global_auxdata_count);
+static void
+metrics_record(Stage stage, gint64 start_usec, guint nitems)
+{
+	StageMetrics *m = &stage_metrics[stage];
+	gint64 usec = g_get_monotonic_time() - start_usec;
+	guint bucket = 0;
+
+	while (nitems >> bucket && bucket < HISTOGRAM_BUCKETS - 1)
+		bucket++;
+
+	m->samples[m->calls % STAGE_SAMPLES] = usec;
+	m->calls++;
+	m->items += nitems;
+	m->total_usec += usec;
+	m->max_usec = MAX(m->max_usec, usec);
+	m->histogram[bucket]++;
 }
 
-static Item*
-item_new(const char *key, const char *value)
+
+/*
+ * Trace: fixed-size ring of compact event records, formatted only
+ * when it is written out by the plugin action
+ */
+typedef enum {
+	TRACE_AUXDATA_NEW,      /* a: auxdata alive */
+	TRACE_AUXDATA_DESTROY,  /* a: auxdata alive */
+	TRACE_ITEMLIST_DESTROY, /* a: items, b: arena blocks */
+	TRACE_REQUEST_GROUP,    /* a: group position, b: items */
+	NUM_TRACE_EVENTS
+} TraceEvent;
+
+static const char * const trace_formats[NUM_TRACE_EVENTS] = {
+	"auxdata_new(): now %u auxdata",
+	"auxdata_destroy(): now %u auxdata",
+	"itemlist_destroy(): released %u items in %u blocks",
+	"itemlist -> request: group %u added with %u items"
+};
+
+#define TRACE_RING_SIZE  4096  /* power of two */
+
+typedef struct _TraceRecord TraceRecord;
+struct _TraceRecord {
+	gint64 time;   /* monotonic time in microseconds */
+	guint32 event; /* TraceEvent */
+	guint32 a, b;
+};
+
+static TraceRecord trace_ring[TRACE_RING_SIZE];
+static guint64 trace_next = 0;  /* records ever written */
+
+static inline void
+trace(TraceEvent event, guint32 a, guint32 b)
 {
-	Item *item = g_new0(Item, 1);
-	item->jid = g_strdup(key);
-	item->alias = g_strdup(value);
+	TraceRecord *r = &trace_ring[trace_next++ & (TRACE_RING_SIZE - 1)];
 
-	purple_debug_misc(PLUGIN_ID, "item_new(): now %d entries\n", ++global_entry_count);
-	return item;
+	r->time = g_get_monotonic_time();
+	r->event = event;
+	r->a = a;
+	r->b = b;
+}
+
+/* Returns the retained records formatted oldest first, one per line */
+static char *
+trace_format(void)
+{
+	GString *out = g_string_new(NULL);
+	guint64 i = trace_next > TRACE_RING_SIZE ? trace_next - TRACE_RING_SIZE : 0;
+
+	for (; i < trace_next; i++) {
+		TraceRecord *r = &trace_ring[i & (TRACE_RING_SIZE - 1)];
+
+		g_string_append_printf(out, "%" G_GINT64_FORMAT " ", r->time);
+		g_string_append_printf(out, trace_formats[r->event], r->a, r->b);
+		g_string_append_c(out, '\n');
+	}
+	return g_string_free(out, FALSE);
+}
+
+
+/*
+ * Normalized bare jids: the resource is cut off and ASCII letters are
+ * lowercased, which is what differently cased jids in practice differ in.
+ * The membership index counts the XMPP buddies of all accounts by their
+ * normalized bare jid, it is maintained along with the roster snapshot.
+ */
+#define JID_BUFFER_SIZE  3072  /* RFC 6122: at most 1023 bytes in each of the three parts */
+
+/* Writes the normalized bare jid of jid to buffer, returns FALSE if it does not fit */
+static gboolean
+normalize_bare_jid(const char *jid, char *buffer, gsize size)
+{
+	gsize i;
+
+	for (i = 0; jid[i] && jid[i] != '/'; i++) {
+		if (i + 1 >= size)
+			return FALSE;
+		buffer[i] = g_ascii_tolower(jid[i]);
+	}
+	buffer[i] = '\0';
+	return TRUE;
+}
+
+static GHashTable *roster_members = NULL;  /* normalized bare jid -> guint* count of buddies */
+
+static gboolean
+roster_members_contains(const char *key)
+{
+	return key && g_hash_table_lookup(roster_members, key) != NULL;
+}
+
+static void
+roster_members_add(const char *jid)
+{
+	char key[JID_BUFFER_SIZE];
+	guint *count;
+
+	if (!normalize_bare_jid(jid, key, sizeof(key)))
+		return;
+	count = g_hash_table_lookup(roster_members, key);
+	if (!count) {
+		count = g_new0(guint, 1);
+		g_hash_table_insert(roster_members, g_strdup(key), count);
+	}
+	(*count)++;
 }
 
 static void
-item_destroy(gpointer _item)
+roster_members_remove(const char *jid)
 {
-	Item *item = (Item *) _item;
-	if (!item)
+	char key[JID_BUFFER_SIZE];
+	guint *count;
+
+	if (!normalize_bare_jid(jid, key, sizeof(key)))
 		return;
+	count = g_hash_table_lookup(roster_members, key);
+	if (count && --(*count) == 0)
+		g_hash_table_remove(roster_members, key);
+}
+
+
+/* XEP-0144 actions, the zero value is the default */
+typedef enum {
+	ITEM_ACTION_ADD,
+	ITEM_ACTION_MODIFY,
+	ITEM_ACTION_DELETE,
+	NUM_ITEM_ACTIONS
+} ItemAction;
+
+static const char * const item_action_names[NUM_ITEM_ACTIONS] = { "add", "modify", "delete" };
 
-	g_free(item->jid);
-	g_free(item->alias);
-	g_list_free_full(item->entries, g_free);
-	g_free(item);
+typedef struct _Item Item;
+struct _Item {
+	const char *jid;      /* interned in the ItemList's string pool */
+	const char *alias;    /* interned in the ItemList's string pool */
+	GList *entries; /* entries are interned char*, so they compare by pointer */
+	guint ngroups;        /* length of entries */
+	ItemAction action;
+	const char *key;      /* normalized bare jid of received items, interned, or NULL */
+};
+
+/* Returns -1 for unknown actions; no action means 'add' */
+static int
+item_action_from_string(const char *action)
+{
+	int a;
+
+	if (!action)
+		return ITEM_ACTION_ADD;
+	for (a = 0; a < NUM_ITEM_ACTIONS; a++) {
+		if (equals(action, item_action_names[a]))
+			return a;
+	}
+	return -1;
+}
+
+/* Items in insertion order, indexed by jid.
+ * Items and list nodes are allocated from the arena. */
+typedef struct _ItemList ItemList;
+struct _ItemList {
+	GQueue items;          /* entries are Item* */
+	GHashTable *index;     /* jid -> Item*, does not own its keys or values */
+	GStringChunk *strings; /* string pool for jids, aliases and group names */
+	Arena arena;           /* owns items and list nodes */
+};
+
+/* Items of an itemlist that are in one group, see itemlist_group_buckets() */
+typedef struct _GroupBucket GroupBucket;
+struct _GroupBucket {
+	const char *groupname;  /* interned in the itemlist's string pool */
+	GPtrArray *items;       /* entries are Item*, in itemlist order */
+};
+
+typedef struct _AuxData AuxData;
+struct _AuxData {
+	PurpleConnection *pc;
+	char *target_jid;
+	ItemList *itemlist;  /* contacts offered by an open send dialog */
+	GHashTable *fields;  /* its PurpleRequestField* -> Item* in itemlist */
+	GPtrArray *buckets;  /* itemlist by group, while the group dialog is open */
+	ItemList *selected;  /* whole groups selected in the group dialog */
+};
+
+typedef gboolean (*ItemConditionFunc)(Item *, AuxData *);
+
+/* Returns the pooled copy of string, which lives as long as the itemlist */
+static const char *
+itemlist_intern(ItemList *itemlist, const char *string)
+{
+	if (!string)
+		return NULL;
+
+	return g_string_chunk_insert_const(itemlist->strings, string);
+}
 
-	purple_debug_misc(PLUGIN_ID, "item_destroy(): now %d entries\n", --global_entry_count);
+/* NOTE: The item lives in the itemlist's arena, there is no item_destroy() */
+static Item*
+item_new(ItemList *itemlist, const char *key, const char *value)
+{
+	Item *item = arena_new0(&itemlist->arena, Item);
+	item->jid = itemlist_intern(itemlist, key);
+	item->alias = itemlist_intern(itemlist, value);
+
+	return item;
 }
 
 static void
-item_add_group(Item *item, const char *groupname)
+item_add_group(ItemList *itemlist, Item *item, const char *groupname)
 {
-	if (!g_list_find_custom(item->entries, groupname, (GCompareFunc) g_strcmp0)) {
-		item->entries = g_list_append(item->entries, g_strdup(groupname));
-		// purple_debug_misc(PLUGIN_ID, "item_add_group(): adding group %s to %s\n", groupname, item->jid);
+	GList *last = NULL, *g, *link;
+
+	groupname = itemlist_intern(itemlist, groupname);
+
+	for (g = item->entries; g; last = g, g = g_list_next(g)) {
+		if (g->data == groupname)
+			return;
 	}
+	link = arena_new0(&itemlist->arena, GList);
+	link->data = (gpointer) groupname;
+	link->prev = last;
+	if (last)
+		last->next = link;
+	else
+		item->entries = link;
+	item->ngroups++;
+	// purple_debug_misc(PLUGIN_ID, "item_add_group(): adding group %s to %s\n", groupname, item->jid);
 }
 
+/* Returns NULL if xitem has no jid or more than max_groups groups */
 static Item*
-item_new_from_xitem(xmlnode *xitem)
+item_new_from_xitem(ItemList *itemlist, xmlnode *xitem, int max_groups)
 {
 	Item *item;
 	xmlnode *xgroup;
+	int ngroups = 0;
 	const char *jid = xmlnode_get_attrib(xitem, "jid");
 	const char *alias = xmlnode_get_attrib(xitem, "name");
+	char key[JID_BUFFER_SIZE];
 
 	if (!jid) {
 		purple_debug_warning(PLUGIN_ID, "XEP-0144 MUST: Requested exchange action has no jid, ignoring!\n");
 		return NULL;
 	}
-	item = item_new(jid, alias);
+	/* Count the raw <group/> twins first, so that a flood of duplicates
+	 * is rejected before any of them is parsed */
+	for (xgroup = xmlnode_get_child(xitem, "group"); xgroup; xgroup = xmlnode_get_next_twin(xgroup)) {
+		if (++ngroups > max_groups) {
+			purple_debug_warning(PLUGIN_ID, "Item %s has more than %d groups, rejecting!\n",
+					jid, max_groups);
+			return NULL;
+		}
+	}
+	item = item_new(itemlist, jid, alias);
+	if (normalize_bare_jid(jid, key, sizeof(key)))
+		item->key = itemlist_intern(itemlist, key);
 
 	for (xgroup = xmlnode_get_child(xitem, "group"); xgroup; xgroup = xmlnode_get_next_twin(xgroup)) {
-		const char *groupname = xmlnode_get_data(xgroup);
+		char *groupname = xmlnode_get_data(xgroup);
 
 		if (groupname)
-			item_add_group(item, groupname);
+			item_add_group(itemlist, item, groupname);
+		g_free(groupname);
 	}
 	return item;
 }
@@ -160,237 +514,512 @@ item_new_from_xitem(xmlnode *xitem)
 /*
  * Itemlist methods
  */
-static Item *
-itemlist_find_by_jid(GList *itemlist, const char *jid)
+static ItemList *
+itemlist_new()
 {
-	GList *l;
+	ItemList *itemlist = g_new0(ItemList, 1);
 
-	for (l = g_list_first(itemlist); l; l = g_list_next(l)) {
-		Item *data = (Item *) l->data;
-
-		if (equals(jid, data->jid))
-			return data;
-	}
-	return NULL;
+	g_queue_init(&itemlist->items);
+	itemlist->index = g_hash_table_new(g_str_hash, g_str_equal);
+	itemlist->strings = g_string_chunk_new(4096);
+	return itemlist;
 }
 
 static void
-itemlist_destroy(GList *list)
+itemlist_destroy(ItemList *itemlist)
 {
-	g_list_free_full(list, item_destroy);
-}
+	if (!itemlist)
+		return;
 
-static gboolean
-_item_is_not_in_roster(Item *item, PurpleAccount *account)
-{
-	g_return_val_if_fail(item, TRUE);
+	trace(TRACE_ITEMLIST_DESTROY, g_queue_get_length(&itemlist->items), itemlist->arena.nblocks);
 
-	return (purple_find_buddy(account, item->jid) == NULL);
+	g_hash_table_destroy(itemlist->index);
+	g_string_chunk_free(itemlist->strings);
+	arena_clear(&itemlist->arena);
+	g_free(itemlist);
 }
 
-/* NOTE: Steals entries and deletes original grouplist */
 static GList *
-itemlist_filter(GList *list, ItemConditionFunc _item_condition, AuxData *aux)
+itemlist_get_items(ItemList *itemlist)
 {
-	GList *result = NULL, *ignored = NULL;
-	PurpleAccount *account = purple_connection_get_account(aux->pc);
-	GList *l = g_list_first(list);
-
-	do {
-		Item *item = (Item *) l->data;
-
-		if (_item_condition(item, account)) {
-			// purple_debug_misc(PLUGIN_ID, "grouplist_filter(): Item %s to filtered list\n", item->jid);
-			result = g_list_prepend(result, item);
-		} else {
-			// purple_debug_misc(PLUGIN_ID, "grouplist_filter(): Item %s will be ignored\n", item->jid);
-			ignored = g_list_prepend(ignored, item);
-		}
-		l = g_list_remove(l, item);
-	} while (l);
+	return itemlist ? itemlist->items.head : NULL;
+}
 
-	itemlist_destroy(ignored);
-	return g_list_reverse(result);
+static gboolean
+itemlist_is_empty(ItemList *itemlist)
+{
+	return (itemlist_get_items(itemlist) == NULL);
 }
 
-static char*
-create_name_from_label(const char *label)
+static Item *
+itemlist_find_by_jid(ItemList *itemlist, const char *jid)
 {
-	char *delimiter = g_strrstr(label, " <");
-	g_return_val_if_fail(delimiter, NULL);
+	g_return_val_if_fail(jid, NULL);
 
-	return g_strndup(label, delimiter - label);
+	return g_hash_table_lookup(itemlist->index, jid);
 }
 
+/* NOTE: item must come from item_new() on the same itemlist;
+ * jid must not be in the list yet */
+static void
+itemlist_append(ItemList *itemlist, Item *item)
+{
+	GList *link = arena_new0(&itemlist->arena, GList);
 
-/*
- * Data conversion path:
- *
- *   blist  ...> request ---> request  ...> xnode
- *     v            ^            v            ^
- *     v  itemlist  ^            v  itemlist  ^
- *
- *
- *   xnode  ...> searchresults ---> libpurple
- *     v            ^
- *     v  itemlist  ^
- *
- */
+	link->data = item;
+	g_queue_push_tail_link(&itemlist->items, link);
+	g_hash_table_insert(itemlist->index, (gpointer) item->jid, item);
+}
 
 static gboolean
-_buddy_is_xmpp(PurpleBuddy *b)
+_item_is_applicable(Item *item, AuxData *aux)
 {
-	const char *protocol_id = purple_account_get_protocol_id(
-			purple_buddy_get_account(b));
+	char key[JID_BUFFER_SIZE];
 
-	return (equals("prpl-jabber", protocol_id) );
-}
+	g_return_val_if_fail(item, TRUE);
 
-static GList *
-itemlist_new_from_blist(BuddyConditionFunc _buddy_condition)
-{
-	PurpleBlistNode *node;
-	const char *groupname = NULL;
-	GList *itemlist = NULL;
+	/* Known contacts can be modified or deleted on the receiving account */
+	if (item->action != ITEM_ACTION_ADD)
+		return purple_find_buddy(purple_connection_get_account(aux->pc), item->jid) != NULL;
 
-	for (node = purple_blist_get_root(); node; node = purple_blist_node_next(node, TRUE) ) {
+	/* New contacts can be added, unless they are known on any XMPP account */
+	if (item->key)
+		return !roster_members_contains(item->key);
+	return !(normalize_bare_jid(item->jid, key, sizeof(key)) && roster_members_contains(key));
+}
 
-		if (PURPLE_BLIST_NODE_IS_GROUP(node)) {
-			PurpleGroup *g = (PurpleGroup *) node;
+/*
+ * Adds the items of src to dst, merging the groups of items that are in
+ * both. Like the parser, dst is bounded by max_items items and max_groups
+ * groups per item, which also bounds the duplicate check of
+ * item_add_group(). Returns the number of items and groups left out.
+ */
+static guint
+itemlist_merge(ItemList *dst, ItemList *src, int max_items, int max_groups)
+{
+	guint nitems = g_queue_get_length(&dst->items), ndropped = 0;
+	GList *i, *g;
 
-			groupname = purple_group_get_name(g);
-			g_warn_if_fail(groupname);
+	for (i = itemlist_get_items(src); i; i = g_list_next(i)) {
+		Item *src_item = (Item *) i->data;
+		Item *item = itemlist_find_by_jid(dst, src_item->jid);
 
-			// purple_debug_misc(PLUGIN_ID, "blist -> itemlist: group %s\n", groupname);
-		}
-		else if (PURPLE_BLIST_NODE_IS_BUDDY(node)) {
-			PurpleBuddy *b = (PurpleBuddy *) node;
-
-			if (_buddy_condition(b)) {
-				const char *jid = purple_buddy_get_name(b);
-				const char *alias = purple_buddy_get_alias(b);
-				Item *item = itemlist_find_by_jid(itemlist, jid);
-
-				if (!item) {
-					item = item_new(jid, alias);
-					itemlist = g_list_append(itemlist, item);
-					// purple_debug_misc(PLUGIN_ID, "blist -> itemlist: new buddy %s\n", jid);
-				}
-				item_add_group(item, groupname);
+		if (!item) {
+			if (nitems >= (guint) MAX(max_items, 0)) {
+				ndropped++;
+				continue;
 			}
+			item = item_new(dst, src_item->jid, src_item->alias);
+			item->key = itemlist_intern(dst, src_item->key);
+			itemlist_append(dst, item);
+			nitems++;
+		}
+		item->action = src_item->action;  /* the later one counts */
+		for (g = src_item->entries; g; g = g_list_next(g)) {
+			if (item->ngroups < (guint) MAX(max_groups, 0))
+				item_add_group(dst, item, g->data);
+			else if (!g_list_find_custom(item->entries, g->data, (GCompareFunc) g_strcmp0))
+				ndropped++;
 		}
 	}
-	return itemlist;
+	return ndropped;
 }
 
-
-static PurpleRequestFieldGroup*
-find_request_group_by_title(PurpleRequestFields *request, const char *title)
+/* Adds src_item to itemlist if necessary, as a member of groupname */
+static void
+itemlist_add_to_group(ItemList *itemlist, Item *src_item, const char *groupname)
 {
-	PurpleRequestFieldGroup *rgroup;
-	GList *g;
-	GList *rgroups = purple_request_fields_get_groups(request);
-
-	for (g = g_list_first(rgroups); g; g = g_list_next(g)) {
-		rgroup = (PurpleRequestFieldGroup *) g->data;
+	Item *item = itemlist_find_by_jid(itemlist, src_item->jid);
 
-		if (equals(title, purple_request_field_group_get_title(rgroup)))
-			return rgroup;
+	if (!item) {
+		item = item_new(itemlist, src_item->jid, src_item->alias);
+		itemlist_append(itemlist, item);
 	}
-	return NULL;
+	item_add_group(itemlist, item, groupname);
 }
 
-static PurpleRequestFields *
-request_new_from_itemlist(GList *itemlist)
+static void
+group_bucket_free(GroupBucket *bucket)
 {
-	PurpleRequestFields *request = purple_request_fields_new();
-	PurpleRequestFieldGroup *rgroup;
-	PurpleRequestField *field;
+	g_ptr_array_free(bucket->items, TRUE);
+	g_free(bucket);
+}
+
+/*
+ * Returns the items of itemlist by group, as an array of GroupBucket*
+ * in order of the groups' first appearance. Items without any group
+ * are put into GROUPNAME_DEFAULT.
+ */
+static GPtrArray *
+itemlist_group_buckets(ItemList *itemlist)
+{
+	GPtrArray *buckets = g_ptr_array_new_with_free_func((GDestroyNotify) group_bucket_free);
+	GHashTable *index = g_hash_table_new(NULL, NULL);  /* interned groupname -> GroupBucket* */
 	GList *i, *g;
 
-	for (i = g_list_first(itemlist); i; i = g_list_next(i)) {
+	for (i = itemlist_get_items(itemlist); i; i = g_list_next(i)) {
 		Item *item = (Item *) i->data;
-		const char *jid = item->jid;
-		const char *alias = item->alias;
-		char *label = g_strdup_printf("%s <%s>", alias, jid);
-
-		// purple_debug_misc(PLUGIN_ID, "itemlist -> request: jid %s added, label %s\n", jid, label);
 
-		if (!item->entries) /* Item has no groups, so use our default group */
-			item->entries = g_list_append(item->entries, GROUPNAME_DEFAULT);
+		if (!item->entries)
+			item_add_group(itemlist, item, GROUPNAME_DEFAULT);
 
-		for (g = g_list_first(item->entries); g; g = g_list_next(g)) {
-			const char *groupname = g->data;
+		for (g = item->entries; g; g = g_list_next(g)) {
+			GroupBucket *bucket = g_hash_table_lookup(index, g->data);
 
-			rgroup = find_request_group_by_title(request, groupname);
-			if (!rgroup) {
-				rgroup = purple_request_field_group_new(groupname);
-				purple_request_fields_add_group(request, rgroup);
+			if (!bucket) {
+				bucket = g_new0(GroupBucket, 1);
+				bucket->groupname = g->data;
+				bucket->items = g_ptr_array_new();
+				g_ptr_array_add(buckets, bucket);
+				g_hash_table_insert(index, g->data, bucket);
 			}
-
-			field = purple_request_field_bool_new(jid, label, FALSE);
-			purple_request_field_group_add_field(rgroup, field);
-
-			purple_debug_misc(PLUGIN_ID, "itemlist -> request: jid %s added group %s\n", jid, groupname);
+			g_ptr_array_add(bucket->items, item);
 		}
-		g_free(label);
 	}
-	return request;
+	g_hash_table_destroy(index);
+	return buckets;
 }
 
-static GList *
-itemlist_new_from_request(PurpleRequestFields *request)
+static guint global_auxdata_count = 0;
+
+static AuxData*
+auxdata_new(PurpleConnection *pc)
 {
-	GList *f, *g;
-	GList *itemlist = NULL;
-	GList *request_groups = purple_request_fields_get_groups(request);
-	Item *item;
+	AuxData *aux = g_new0(AuxData, 1);
+	aux->pc = pc;
 
-	for (g = g_list_first(request_groups); g; g = g_list_next(g)) {
-		PurpleRequestFieldGroup *request_group = (PurpleRequestFieldGroup *) g->data;
-		const char *groupname = purple_request_field_group_get_title(request_group);
+	trace(TRACE_AUXDATA_NEW, ++global_auxdata_count, 0);
+	return aux;
+}
 
-		// purple_debug_misc(PLUGIN_ID, "request -> itemlist: entering group field %s\n", groupname);
+static void
+auxdata_destroy(AuxData *aux)
+{
+	if (aux->buckets)
+		g_ptr_array_free(aux->buckets, TRUE);
+	if (aux->fields)
+		g_hash_table_destroy(aux->fields);
+	itemlist_destroy(aux->itemlist);
+	itemlist_destroy(aux->selected);
+	g_free(aux->target_jid);
+	g_free(aux);
 
-		for (f = purple_request_field_group_get_fields(request_group); f; f = g_list_next(f)) {
-			PurpleRequestField *field = (PurpleRequestField *) f->data;
+	trace(TRACE_AUXDATA_DESTROY, --global_auxdata_count, 0);
+}
 
-			if (purple_request_field_bool_get_value(field) == TRUE) {
-				const char *jid = purple_request_field_get_id(field);
-				char *alias = create_name_from_label(purple_request_field_get_label(field));
+/* NOTE: Removes items in place, their memory is released with the itemlist */
+static ItemList *
+itemlist_filter(ItemList *itemlist, ItemConditionFunc _item_condition, AuxData *aux)
+{
+	GList *l = itemlist_get_items(itemlist);
 
-				item = itemlist_find_by_jid(itemlist, jid);
-				if (!item) {
-					// purple_debug_misc(PLUGIN_ID, "request -> itemlist: item %s added to itemlist, username %s\n", jid, alias);
-					item = item_new(jid, alias);
-					itemlist = g_list_prepend(itemlist, item);
-				}
+	while (l) {
+		GList *next = g_list_next(l);
+		Item *item = (Item *) l->data;
 
-				item_add_group(item, groupname);
-				g_free(alias);
-			}
+		if (!_item_condition(item, aux)) {
+			// purple_debug_misc(PLUGIN_ID, "grouplist_filter(): Item %s will be ignored\n", item->jid);
+			g_hash_table_remove(itemlist->index, (gpointer) item->jid);
+			g_queue_unlink(&itemlist->items, l);
 		}
+		l = next;
 	}
-	return g_list_reverse(itemlist);
+	return itemlist;
 }
 
-static xmlnode*
-xnode_new_from_itemlist(GList *itemlist)
+/*
+ * Data conversion path:
+ *
+ *   blist  ---> snapshot ...> request ---> request  ...> xnode
+ *                   v            ^            v            ^
+ *                   v  itemlist  ^            v  itemlist  ^
+ *
+ *
+ *   xnode  ...> searchresults ---> libpurple
+ *     v            ^
+ *     v  itemlist  ^
+ *
+ */
+
+static gboolean
+_buddy_is_xmpp(PurpleBuddy *b)
 {
-	xmlnode *xnode;
-	GList *i, *g;
+	const char *protocol_id = purple_account_get_protocol_id(
+			purple_buddy_get_account(b));
 
-	xnode = xmlnode_new("x");
-	xmlnode_set_namespace(xnode, NS_ROSTERX);
+	return (equals("prpl-jabber", protocol_id) );
+}
 
-	for (i = g_list_first(itemlist); i; i = g_list_next(i)) {
-		xmlnode *xitem;
-		Item *item = (Item *) i->data;
+/*
+ * Roster snapshot: the XMPP buddies of the blist, in blist order.
+ *
+ * Built once on plugin load and maintained from the blist signals,
+ * so that the send dialog does not have to traverse the whole blist.
+ * The membership index of normalized bare jids is kept along with it.
+ * Only the buddy nodes are kept; names, aliases and groups are read
+ * from the buddies when the snapshot is copied, so renamed groups and
+ * changed aliases need no extra bookkeeping.
+ */
+static GQueue roster_snapshot = G_QUEUE_INIT;  /* entries are PurpleBuddy* */
+static GHashTable *roster_snapshot_index = NULL;  /* PurpleBuddy* -> GList* link in roster_snapshot */
+
+static void
+snapshot_add_buddy(PurpleBuddy *b)
+{
+	if (!_buddy_is_xmpp(b) || g_hash_table_lookup(roster_snapshot_index, b))
+		return;
+
+	g_queue_push_tail(&roster_snapshot, b);
+	g_hash_table_insert(roster_snapshot_index, b, g_queue_peek_tail_link(&roster_snapshot));
+	roster_members_add(purple_buddy_get_name(b));
+}
+
+static void
+snapshot_remove_buddy(PurpleBuddy *b)
+{
+	GList *link = g_hash_table_lookup(roster_snapshot_index, b);
+
+	if (link) {
+		g_hash_table_remove(roster_snapshot_index, b);
+		g_queue_delete_link(&roster_snapshot, link);
+		roster_members_remove(purple_buddy_get_name(b));
+	}
+}
+
+static void
+snapshot_init()
+{
+	PurpleBlistNode *node;
+
+	roster_snapshot_index = g_hash_table_new(g_direct_hash, g_direct_equal);
+	roster_members = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+
+	for (node = purple_blist_get_root(); node; node = purple_blist_node_next(node, TRUE) ) {
+		if (PURPLE_BLIST_NODE_IS_BUDDY(node))
+			snapshot_add_buddy((PurpleBuddy *) node);
+	}
+	purple_debug_info(PLUGIN_ID, "snapshot_init(): %u XMPP buddies, %u distinct jids\n",
+			g_queue_get_length(&roster_snapshot), g_hash_table_size(roster_members));
+}
+
+static void
+snapshot_destroy()
+{
+	g_queue_clear(&roster_snapshot);
+	if (roster_snapshot_index)
+		g_hash_table_destroy(roster_snapshot_index);
+	roster_snapshot_index = NULL;
+	if (roster_members)
+		g_hash_table_destroy(roster_members);
+	roster_members = NULL;
+}
+
+static void
+buddy_added_cb(PurpleBuddy *b, gpointer data)
+{
+	snapshot_add_buddy(b);
+}
+
+static void
+buddy_removed_cb(PurpleBuddy *b, gpointer data)
+{
+	snapshot_remove_buddy(b);
+}
+
+static ItemList *
+itemlist_new_from_snapshot()
+{
+	ItemList *itemlist = itemlist_new();
+	GList *l;
+
+	for (l = roster_snapshot.head; l; l = g_list_next(l)) {
+		PurpleBuddy *b = (PurpleBuddy *) l->data;
+		const char *jid = purple_buddy_get_name(b);
+		const char *groupname = purple_group_get_name(purple_buddy_get_group(b));
+		Item *item = itemlist_find_by_jid(itemlist, jid);
+
+		if (!item) {
+			item = item_new(itemlist, jid, purple_buddy_get_alias(b));
+			itemlist_append(itemlist, item);
+			// purple_debug_misc(PLUGIN_ID, "snapshot -> itemlist: new buddy %s\n", jid);
+		}
+		item_add_group(itemlist, item, groupname);
+	}
+	return itemlist;
+}
+
+/* libpurple appends each field to the end of its group's list, so large
+ * roster groups are split into request groups of the same title */
+#define REQUEST_GROUP_MAX_FIELDS  256
+
+/* One request group per roster group, each created and filled in one go.
+ * Every field is entered into fields, mapped to its item. */
+static PurpleRequestFields *
+request_new_from_itemlist(ItemList *itemlist, GHashTable *fields)
+{
+	PurpleRequestFields *request = purple_request_fields_new();
+	GPtrArray *buckets = itemlist_group_buckets(itemlist);
+	GString *label = g_string_new(NULL);
+	guint b, i;
+
+	for (b = 0; b < buckets->len; b++) {
+		GroupBucket *bucket = g_ptr_array_index(buckets, b);
+		PurpleRequestFieldGroup *rgroup = NULL;
+
+		for (i = 0; i < bucket->items->len; i++) {
+			Item *item = g_ptr_array_index(bucket->items, i);
+			PurpleRequestField *field;
+
+			if (i % REQUEST_GROUP_MAX_FIELDS == 0) {
+				rgroup = purple_request_field_group_new(bucket->groupname);
+				purple_request_fields_add_group(request, rgroup);
+			}
+
+			g_string_printf(label, "%s <%s>", item->alias, item->jid);
+			field = purple_request_field_bool_new(item->jid, label->str, FALSE);
+			purple_request_field_group_add_field(rgroup, field);
+			g_hash_table_insert(fields, field, item);
+		}
+		trace(TRACE_REQUEST_GROUP, b, bucket->items->len);
+	}
+	g_string_free(label, TRUE);
+	g_ptr_array_free(buckets, TRUE);
+	return request;
+}
+
+/* Moves the group link of item for the interned groupname to position item->ngroups */
+static void
+item_select_group(Item *item, const char *groupname)
+{
+	GList *before = g_list_nth(item->entries, item->ngroups);
+	GList *link;
+
+	for (link = before; link && link->data != groupname; link = g_list_next(link))
+		;
+	if (!link)
+		return;
+
+	if (link != before) {
+		link->prev->next = link->next;
+		if (link->next)
+			link->next->prev = link->prev;
+		link->next = before;
+		link->prev = before->prev;
+		if (before->prev)
+			before->prev->next = link;
+		else
+			item->entries = link;
+		before->prev = link;
+	}
+	item->ngroups++;
+}
+
+/*
+ * Reduces itemlist, which request was made from, to the items and
+ * groups of the selected fields, see request_new_from_itemlist(). The
+ * items and their group links are kept in place, nothing is allocated.
+ */
+static void
+itemlist_select_from_request(ItemList *itemlist, PurpleRequestFields *request, GHashTable *fields)
+{
+	GList *f, *g, *i, *next;
+
+	/* The first ngroups links of an item are its selected groups */
+	for (i = itemlist_get_items(itemlist); i; i = g_list_next(i))
+		((Item *) i->data)->ngroups = 0;
+
+	for (g = purple_request_fields_get_groups(request); g; g = g_list_next(g)) {
+		PurpleRequestFieldGroup *request_group = (PurpleRequestFieldGroup *) g->data;
+		const char *groupname = itemlist_intern(itemlist,
+				purple_request_field_group_get_title(request_group));
+
+		for (f = purple_request_field_group_get_fields(request_group); f; f = g_list_next(f)) {
+			PurpleRequestField *field = (PurpleRequestField *) f->data;
+			Item *item;
+
+			if (!purple_request_field_bool_get_value(field))
+				continue;
+
+			item = g_hash_table_lookup(fields, field);
+			if (item)
+				item_select_group(item, groupname);
+		}
+	}
+
+	for (i = itemlist_get_items(itemlist); i; i = next) {
+		Item *item = (Item *) i->data;
+
+		next = g_list_next(i);
+		if (!item->ngroups) {
+			g_queue_unlink(&itemlist->items, i);
+			g_hash_table_remove(itemlist->index, item->jid);
+		} else {
+			g = g_list_nth(item->entries, item->ngroups - 1);
+			g->next = NULL;
+		}
+	}
+}
+
+/* Upper bound of the length of string after XML escaping */
+static gsize
+estimate_escaped_len(const char *string)
+{
+	gsize len = 0;
+
+	for (; string && *string; string++) {
+		switch (*string) {
+			case '&': case '<': case '>': case '\'': case '"':
+				len += 6;  /* &quot; */
+				break;
+			default:
+				len++;
+		}
+	}
+	return len;
+}
+
+/* Estimated bytes that item adds to the <x/> of a stanza; the plaintext
+ * body of the fallback message is bounded on its own */
+static gsize
+estimate_item_size(Item *item)
+{
+	gsize size = sizeof("<item action='modify' jid='' name=''></item>") +
+		estimate_escaped_len(item->jid) + estimate_escaped_len(item->alias);
+	GList *g;
+
+	for (g = item->entries; g; g = g_list_next(g))
+		size += sizeof("<group></group>") + estimate_escaped_len(g->data);
+	return size;
+}
+
+/*
+ * Creates an <x/> with the items from start on, as long as their
+ * estimated size fits into budget; at least one item is always added.
+ * *next is set to the first item that did not fit, or NULL.
+ */
+static xmlnode*
+xnode_new_from_itemlist(GList *start, gsize budget, GList **next)
+{
+	xmlnode *xnode;
+	GList *i, *g;
+	gsize size = STANZA_OVERHEAD_BYTES;
+
+	xnode = xmlnode_new("x");
+	xmlnode_set_namespace(xnode, NS_ROSTERX);
+
+	for (i = start; i; i = g_list_next(i)) {
+		xmlnode *xitem;
+		Item *item = (Item *) i->data;
+
+		size += estimate_item_size(item);
+		if (size > budget && i != start)
+			break;
 
 		xitem = xmlnode_new_child(xnode, "item");
-		xmlnode_set_attrib(xitem, "action", "add"); /* Only available action for now */
+		xmlnode_set_attrib(xitem, "action", item_action_names[item->action]);
 		xmlnode_set_attrib(xitem, "jid", item->jid);
-		xmlnode_set_attrib(xitem, "name", item->alias);
+		if (item->alias) /* deleted items have none */
+			xmlnode_set_attrib(xitem, "name", item->alias);
 
 		// purple_debug_misc(PLUGIN_ID, "itemlist -> xnode: jid %s added, alias %s\n", item->jid, item->alias);
 
@@ -402,375 +1031,2287 @@ xnode_new_from_itemlist(GList *itemlist)
 			// purple_debug_misc(PLUGIN_ID, "itemlist -> xnode: jid %s adding group %s\n", item->jid, groupname);
 		}
 	}
-	return xnode;
+	*next = i;
+	return xnode;
+}
+
+
+/*
+ * Parsing is bounded by max_items and max_groups: every <item/> and
+ * <group/> element counts towards the limits, including duplicates and
+ * unknown actions, so the work done for one stanza is bounded no matter
+ * what a peer sends.
+ *
+ * Returns NULL and sets *too_large if the limits are exceeded.
+ */
+static ItemList*
+itemlist_new_from_xnode_bounded(xmlnode *xnode, int max_items, int max_groups, gboolean *too_large)
+{
+	xmlnode *xitem;
+	ItemList *itemlist = itemlist_new();
+	int nitems = 0, nunknown = 0;
+	const char *unknown = NULL;
+	gint64 start = g_get_monotonic_time();
+
+	*too_large = FALSE;
+
+	for (xitem = xmlnode_get_child(xnode, "item"); xitem; xitem = xmlnode_get_next_twin(xitem)) {
+		Item *item = NULL;
+		const char *action = xmlnode_get_attrib(xitem, "action");
+		const char *jid = xmlnode_get_attrib(xitem, "jid");
+
+		if (++nitems > max_items) {
+			purple_debug_warning(PLUGIN_ID, "Received more than %d items, rejecting!\n", max_items);
+			*too_large = TRUE;
+			break;
+		}
+
+		if (item_action_from_string(action) < 0) {
+			unknown = action;
+			nunknown++;
+			continue;
+		}
+		if (jid && !itemlist_find_by_jid(itemlist, jid)) {
+			item = item_new_from_xitem(itemlist, xitem, max_groups);
+			if (!item) {
+				*too_large = TRUE;
+				break;
+			}
+			item->action = item_action_from_string(action);
+			itemlist_append(itemlist, item);
+		}
+	}
+
+	/* Once per stanza, a peer can send thousands of them */
+	if (nunknown)
+		purple_debug_warning(PLUGIN_ID,
+				"Received %d items with unknown Roster exchange actions like '%s'!\n", nunknown, unknown);
+
+	metrics_record(STAGE_XNODE_TO_ITEMLIST, start, nitems);
+
+	if (*too_large) {
+		itemlist_destroy(itemlist);
+		return NULL;
+	}
+
+	if (itemlist_is_empty(itemlist))
+		purple_debug_warning(PLUGIN_ID, "XEP-0144 MUST: Parsed xnode does not contain any items!\n");
+	return itemlist;
+}
+
+/* Parses a received <x/>, bounded by the max_items and max_groups preferences */
+static ItemList*
+itemlist_new_from_xnode(xmlnode *xnode, gboolean *too_large)
+{
+	return itemlist_new_from_xnode_bounded(xnode, purple_prefs_get_int(PREF_MAX_ITEMS),
+			purple_prefs_get_int(PREF_MAX_GROUPS), too_large);
+}
+
+/*
+ * History of exchanges, indexed by (peer, jid): contacts sent to a peer
+ * once the stanza with them was delivered, and contacts received from a
+ * peer that the user declined with the "Decline" button. It is kept in
+ * an append-only file of records
+ *   magic (2 bytes), kinds (1 byte), reserved (1 byte), peer length,
+ *   jid length (2 bytes each, little endian), peer, jid, checksum
+ *   (2 bytes, Fletcher-16 of kinds to jid)
+ * which is read at plugin_load. A record that was only partly written
+ * is skipped up to the next magic, and the file is then rewritten with
+ * one record per entry. The "Clear exchange history" action empties it.
+ */
+typedef enum {
+	HISTORY_SENT     = 1 << 0,
+	HISTORY_DECLINED = 1 << 1
+} HistoryKind;
+
+#define HISTORY_MAGIC_0        'R'
+#define HISTORY_MAGIC_1        'X'
+#define HISTORY_RECORD_HEADER  8
+#define HISTORY_RECORD_TRAILER 2
+#define HISTORY_KEY_SIZE       (2 * JID_BUFFER_SIZE)
+
+static GHashTable *history = NULL;  /* "peer\njid" -> GUINT_TO_POINTER(HistoryKind bits) */
+static FILE *history_file = NULL;
+
+/* Returns FALSE if the key does not fit into key, such entries are not kept */
+static gboolean
+history_key(const char *peer, const char *jid, char key[HISTORY_KEY_SIZE])
+{
+	return g_snprintf(key, HISTORY_KEY_SIZE, "%s\n%s", peer, jid) < HISTORY_KEY_SIZE;
+}
+
+static gboolean
+history_has(const char *peer, const char *jid, HistoryKind kind)
+{
+	char key[HISTORY_KEY_SIZE];
+
+	if (!history_key(peer, jid, key))
+		return FALSE;
+	return (GPOINTER_TO_UINT(g_hash_table_lookup(history, key)) & kind) != 0;
+}
+
+/* Returns FALSE if the entry existed already, or cannot be kept */
+static gboolean
+history_index(const char *peer, const char *jid, HistoryKind kind)
+{
+	char key[HISTORY_KEY_SIZE];
+	guint kinds;
+
+	if (!history_key(peer, jid, key))
+		return FALSE;
+	kinds = GPOINTER_TO_UINT(g_hash_table_lookup(history, key));
+	if ((kinds & kind) == kind)
+		return FALSE;
+	g_hash_table_replace(history, g_strdup(key), GUINT_TO_POINTER(kinds | kind));
+	return TRUE;
+}
+
+static guint16
+history_checksum(const guint8 *data, gsize length)
+{
+	guint sum1 = 0, sum2 = 0;
+	gsize i;
+
+	for (i = 0; i < length; i++) {
+		sum1 = (sum1 + data[i]) % 255;
+		sum2 = (sum2 + sum1) % 255;
+	}
+	return (sum2 << 8) | sum1;
+}
+
+/* Appends the record of (peer, jid, kinds) to out */
+static void
+history_record_append(GString *out, const char *peer, const char *jid, guint kinds)
+{
+	gsize peer_len = strlen(peer), jid_len = strlen(jid);
+	gsize start = out->len;
+	guint8 header[HISTORY_RECORD_HEADER], trailer[HISTORY_RECORD_TRAILER];
+	guint16 checksum;
+
+	header[0] = HISTORY_MAGIC_0;
+	header[1] = HISTORY_MAGIC_1;
+	header[2] = kinds;
+	header[3] = 0;
+	header[4] = peer_len & 0xff;
+	header[5] = peer_len >> 8;
+	header[6] = jid_len & 0xff;
+	header[7] = jid_len >> 8;
+	g_string_append_len(out, (const char *) header, HISTORY_RECORD_HEADER);
+	g_string_append_len(out, peer, peer_len);
+	g_string_append_len(out, jid, jid_len);
+
+	checksum = history_checksum((const guint8 *) out->str + start + 2, out->len - start - 2);
+	trailer[0] = checksum & 0xff;
+	trailer[1] = checksum >> 8;
+	g_string_append_len(out, (const char *) trailer, HISTORY_RECORD_TRAILER);
+}
+
+static void
+history_add(const char *peer, const char *jid, HistoryKind kind)
+{
+	GString *record;
+
+	if (!history_index(peer, jid, kind) || !history_file)
+		return;
+
+	/* The whole record in one write, a failed one leaves at most a fragment */
+	record = g_string_sized_new(HISTORY_RECORD_HEADER + HISTORY_KEY_SIZE + HISTORY_RECORD_TRAILER);
+	history_record_append(record, peer, jid, kind);
+	if (fwrite(record->str, 1, record->len, history_file) != record->len)
+		purple_debug_error(PLUGIN_ID, "Could not write to the exchange history\n");
+	g_string_free(record, TRUE);
+}
+
+static void
+history_flush()
+{
+	if (history_file)
+		fflush(history_file);
+}
+
+/* Returns the length of the valid record at pos, 0 if there is none */
+static gsize
+history_record_length(const guint8 *contents, gsize length, gsize pos)
+{
+	const guint8 *record = contents + pos;
+	gsize peer_len, jid_len, record_len;
+
+	if (pos + HISTORY_RECORD_HEADER + HISTORY_RECORD_TRAILER > length ||
+			record[0] != HISTORY_MAGIC_0 || record[1] != HISTORY_MAGIC_1)
+		return 0;
+
+	peer_len = record[4] | (record[5] << 8);
+	jid_len = record[6] | (record[7] << 8);
+	record_len = HISTORY_RECORD_HEADER + peer_len + jid_len + HISTORY_RECORD_TRAILER;
+	if (pos + record_len > length)
+		return 0;
+	if (history_checksum(record + 2, record_len - HISTORY_RECORD_TRAILER - 2) !=
+			(record[record_len - 2] | (record[record_len - 1] << 8)))
+		return 0;
+	return record_len;
+}
+
+/* Rewrites the file with one record per entry, without fragments */
+static void
+history_compact()
+{
+	GString *contents = g_string_new(NULL);
+	GHashTableIter iter;
+	gpointer key, kinds;
+
+	g_hash_table_iter_init(&iter, history);
+	while (g_hash_table_iter_next(&iter, &key, &kinds)) {
+		char *peer = g_strdup(key);
+		char *jid = strchr(peer, '\n');
+
+		*jid++ = '\0';
+		history_record_append(contents, peer, jid, GPOINTER_TO_UINT(kinds));
+		g_free(peer);
+	}
+
+	if (!purple_util_write_data_to_file(HISTORY_FILENAME, contents->str, contents->len))
+		purple_debug_error(PLUGIN_ID, "Could not compact the exchange history in %s\n", HISTORY_FILENAME);
+	g_string_free(contents, TRUE);
+}
+
+static void
+history_init()
+{
+	char *filename = g_build_filename(purple_user_dir(), HISTORY_FILENAME, NULL);
+	char *contents = NULL;
+	gsize length = 0, pos = 0, record_len;
+	guint nrecords = 0, nskipped = 0;
+
+	history = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	if (g_file_get_contents(filename, &contents, &length, NULL)) {
+		while (pos < length) {
+			const guint8 *record = (const guint8 *) contents + pos;
+			gsize peer_len;
+			char *peer, *jid;
+
+			record_len = history_record_length((const guint8 *) contents, length, pos);
+			if (!record_len) {
+				/* Part of a record that was not written completely */
+				pos++;
+				nskipped++;
+				continue;
+			}
+
+			peer_len = record[4] | (record[5] << 8);
+			peer = g_strndup(contents + pos + HISTORY_RECORD_HEADER, peer_len);
+			jid = g_strndup(contents + pos + HISTORY_RECORD_HEADER + peer_len,
+					record_len - HISTORY_RECORD_HEADER - HISTORY_RECORD_TRAILER - peer_len);
+			history_index(peer, jid, record[2]);
+			g_free(jid);
+			g_free(peer);
+
+			pos += record_len;
+			nrecords++;
+		}
+		g_free(contents);
+	}
+	purple_debug_info(PLUGIN_ID, "Read %u exchange history records, skipped %u bytes\n",
+			nrecords, nskipped);
+	if (nskipped || nrecords > g_hash_table_size(history))
+		history_compact();
+
+	history_file = g_fopen(filename, "ab");
+	if (!history_file)
+		purple_debug_error(PLUGIN_ID, "Could not open %s, the exchange history is not saved\n", filename);
+	g_free(filename);
+}
+
+/* Forgets all exchanges, in memory and in the file */
+static gboolean
+history_clear()
+{
+	char *filename = g_build_filename(purple_user_dir(), HISTORY_FILENAME, NULL);
+
+	g_hash_table_remove_all(history);
+
+	if (history_file)
+		fclose(history_file);
+	history_file = g_fopen(filename, "wb");
+	if (!history_file)
+		purple_debug_error(PLUGIN_ID, "Could not open %s, the exchange history is not saved\n", filename);
+	g_free(filename);
+	return (history_file != NULL);
+}
+
+static void
+history_destroy()
+{
+	if (history_file)
+		fclose(history_file);
+	history_file = NULL;
+	g_hash_table_destroy(history);
+	history = NULL;
+}
+
+/* Condition for itemlist_filter() on the send side */
+static gboolean
+_item_was_not_sent(Item *item, AuxData *aux)
+{
+	return !history_has(aux->target_jid, item->jid, HISTORY_SENT);
+}
+
+/* Condition for itemlist_filter() on the receive side */
+static gboolean
+_item_was_not_declined(Item *item, AuxData *aux)
+{
+	return item->action != ITEM_ACTION_ADD ||
+		!history_has(aux->target_jid, item->jid, HISTORY_DECLINED);
+}
+
+
+/*
+ * Adding all suggested contacts: the table's rows are collapsed back
+ * into one item per jid. Each buddy is put into all of its groups
+ * directly, and added to the account once, so that its roster push and
+ * subscription request go out once. Modified and deleted items are
+ * applied the same way, once the user confirmed them. This happens in
+ * batches with a short pause in between.
+ */
+#define ADD_BATCH_SIZE           25
+#define ADD_BATCH_INTERVAL_MSEC  500
+
+typedef struct _BulkAdd BulkAdd;
+struct _BulkAdd {
+	PurpleConnection *pc;
+	ItemList *itemlist;
+	GList *next;    /* first item not added yet */
+	guint nadded;   /* buddies added to the account so far */
+	guint timer;
+	void *ui_handle;  /* confirmation request, while it is open */
+};
+
+static GList *bulk_adds = NULL;  /* entries are BulkAdd* */
+
+static void
+bulk_add_destroy(BulkAdd *add)
+{
+	bulk_adds = g_list_remove(bulk_adds, add);
+
+	if (add->timer)
+		purple_timeout_remove(add->timer);
+	if (add->ui_handle)
+		purple_request_close(PURPLE_REQUEST_ACTION, add->ui_handle);
+	itemlist_destroy(add->itemlist);
+	g_free(add);
+}
+
+/* Returns the new buddy if it was not yet in the group, NULL otherwise */
+static PurpleBuddy *
+bulk_add_to_group(PurpleAccount *account, Item *item, const char *groupname)
+{
+	PurpleGroup *group = NULL;
+	PurpleBuddy *buddy;
+
+	if (groupname) {
+		group = purple_find_group(groupname);
+		if (!group) {
+			group = purple_group_new(groupname);
+			purple_blist_add_group(group, NULL);
+		}
+	}
+	if (group ? purple_find_buddy_in_group(account, item->jid, group)
+			: purple_find_buddy(account, item->jid))
+		return NULL;
+
+	buddy = purple_buddy_new(account, item->jid, item->alias);
+	purple_blist_add_buddy(buddy, NULL, group, NULL);
+	return buddy;
+}
+
+/*
+ * Removes the buddy from the groups of item, or from all groups if item
+ * has none. With keep set, removes it from all groups except these.
+ */
+static void
+bulk_remove_from_groups(PurpleAccount *account, Item *item, gboolean keep)
+{
+	GSList *buddies = purple_find_buddies(account, item->jid), *b;
+
+	for (b = buddies; b; b = g_slist_next(b)) {
+		PurpleBuddy *buddy = (PurpleBuddy *) b->data;
+		PurpleGroup *group = purple_buddy_get_group(buddy);
+		const char *groupname = purple_group_get_name(group);
+		gboolean listed = FALSE;
+		GList *g;
+
+		for (g = item->entries; g && !listed; g = g_list_next(g))
+			listed = equals(groupname, g->data);
+
+		if (keep ? !listed : (listed || !item->entries)) {
+			purple_account_remove_buddy(account, buddy, group);
+			purple_blist_remove_buddy(buddy);
+		}
+	}
+	g_slist_free(buddies);
+}
+
+/* Applies one suggested item, returns TRUE if a buddy was added */
+static gboolean
+bulk_apply_item(PurpleAccount *account, Item *item)
+{
+	PurpleBuddy *buddy = NULL, *added, *existing = NULL;
+	GSList *buddies, *b;
+	GList *g;
+
+	if (item->action == ITEM_ACTION_DELETE) {
+		bulk_remove_from_groups(account, item, FALSE);
+		return FALSE;
+	}
+	if (item->action == ITEM_ACTION_MODIFY)
+		existing = purple_find_buddy(account, item->jid);
+
+	if (!item->entries)
+		buddy = bulk_add_to_group(account, item, NULL);
+	for (g = item->entries; g; g = g_list_next(g)) {
+		added = bulk_add_to_group(account, item, g->data);
+		if (!buddy)
+			buddy = added;
+	}
+
+	/* The server roster gets all of the buddy's groups at once. A buddy
+	 * already in the roster only changes groups, adding it again would
+	 * ask for a subscription the user did not agree to */
+	if (buddy && existing)
+		serv_move_buddy(buddy, purple_buddy_get_group(existing), purple_buddy_get_group(buddy));
+	else if (buddy)
+		purple_account_add_buddy(account, buddy);
+
+	if (item->action == ITEM_ACTION_MODIFY) {
+		/* The listed groups replace the old ones */
+		if (item->entries)
+			bulk_remove_from_groups(account, item, TRUE);
+
+		buddies = purple_find_buddies(account, item->jid);
+		for (b = buddies; b && item->alias; b = g_slist_next(b)) {
+			if (!equals(item->alias, purple_buddy_get_local_buddy_alias(b->data))) {
+				purple_blist_alias_buddy(b->data, item->alias);
+				serv_alias_buddy(b->data);
+			}
+		}
+		g_slist_free(buddies);
+	}
+	return (buddy != NULL && !existing);
+}
+
+/* Applies the next batch, returns FALSE when all items have been applied */
+static gboolean
+bulk_add_next(BulkAdd *add)
+{
+	PurpleAccount *account = purple_connection_get_account(add->pc);
+	guint n;
+
+	for (n = 0; add->next && n < ADD_BATCH_SIZE; add->next = g_list_next(add->next), n++) {
+		if (bulk_apply_item(account, add->next->data))
+			add->nadded++;
+	}
+	return (add->next != NULL);
+}
+
+static gboolean
+bulk_add_timeout_cb(gpointer _add)
+{
+	BulkAdd *add = (BulkAdd *) _add;
+
+	if (PURPLE_CONNECTION_IS_VALID(add->pc) && bulk_add_next(add))
+		return TRUE;
+
+	purple_debug_info(PLUGIN_ID, "Added %u suggested buddies\n", add->nadded);
+	add->timer = 0;
+	bulk_add_destroy(add);
+	return FALSE;
+}
+
+/* NOTE: Takes ownership of itemlist */
+static BulkAdd *
+bulk_add_new(PurpleConnection *pc, ItemList *itemlist)
+{
+	BulkAdd *add = g_new0(BulkAdd, 1);
+
+	add->pc = pc;
+	add->itemlist = itemlist;
+	add->next = itemlist_get_items(itemlist);
+
+	bulk_adds = g_list_prepend(bulk_adds, add);
+	return add;
+}
+
+/* Applies the first batch right away, and schedules the others */
+static void
+bulk_add_run(BulkAdd *add)
+{
+	if (!bulk_add_next(add)) {
+		purple_debug_info(PLUGIN_ID, "Added %u suggested buddies\n", add->nadded);
+		bulk_add_destroy(add);
+		return;
+	}
+	add->timer = purple_timeout_add(ADD_BATCH_INTERVAL_MSEC, bulk_add_timeout_cb, add);
+}
+
+/* NOTE: Takes ownership of itemlist */
+static void
+bulk_add_start(PurpleConnection *pc, ItemList *itemlist)
+{
+	bulk_add_run(bulk_add_new(pc, itemlist));
+}
+
+static void
+bulk_add_confirm_all_cb(gpointer _add, int action)
+{
+	BulkAdd *add = (BulkAdd *) _add;
+
+	add->ui_handle = NULL;
+	bulk_add_run(add);
+}
+
+static gboolean
+_item_is_new(Item *item, AuxData *aux)
+{
+	return item->action == ITEM_ACTION_ADD;
+}
+
+static void
+bulk_add_confirm_new_cb(gpointer _add, int action)
+{
+	BulkAdd *add = (BulkAdd *) _add;
+
+	add->ui_handle = NULL;
+	itemlist_filter(add->itemlist, _item_is_new, NULL);
+	add->next = itemlist_get_items(add->itemlist);
+	bulk_add_run(add);
+}
+
+static void
+bulk_add_confirm_cancel_cb(gpointer _add, int action)
+{
+	BulkAdd *add = (BulkAdd *) _add;
+
+	add->ui_handle = NULL;
+	purple_debug_info(PLUGIN_ID, "Adding all suggested buddies was cancelled\n");
+	bulk_add_destroy(add);
+}
+
+/*
+ * Applies all items, after asking the user if any of them modifies or
+ * deletes a buddy.
+ * NOTE: Takes ownership of itemlist
+ */
+static void
+bulk_add_start_confirmed(PurpleConnection *pc, ItemList *itemlist, const char *peer)
+{
+	guint counts[NUM_ITEM_ACTIONS] = { 0 };
+	BulkAdd *add;
+	char *secondary;
+	GList *i;
+
+	for (i = itemlist_get_items(itemlist); i; i = g_list_next(i))
+		counts[((Item *) i->data)->action]++;
+
+	if (counts[ITEM_ACTION_MODIFY] == 0 && counts[ITEM_ACTION_DELETE] == 0) {
+		bulk_add_start(pc, itemlist);
+		return;
+	}
+
+	add = bulk_add_new(pc, itemlist);
+	secondary = g_strdup_printf(
+			_("%s suggests to add %u contacts, to change the groups or alias of %u "
+			"and to remove %u from your buddy list."),
+			peer, counts[ITEM_ACTION_ADD], counts[ITEM_ACTION_MODIFY], counts[ITEM_ACTION_DELETE]);
+
+	add->ui_handle = purple_request_action(rosterx_plugin, _("Roster Item Exchange"),
+			_("Apply all suggested changes?"), secondary, 2,
+			purple_connection_get_account(pc), peer, NULL, add, 3,
+			_("Apply all changes"), G_CALLBACK(bulk_add_confirm_all_cb),
+			_("Only add new contacts"), G_CALLBACK(bulk_add_confirm_new_cb),
+			_("Cancel"), G_CALLBACK(bulk_add_confirm_cancel_cb));
+	g_free(secondary);
+}
+
+static void
+bulk_add_signing_off_cb(PurpleConnection *pc, gpointer data)
+{
+	GList *l = bulk_adds;
+
+	while (l) {
+		BulkAdd *add = (BulkAdd *) l->data;
+
+		l = g_list_next(l);
+		if (add->pc == pc)
+			bulk_add_destroy(add);
+	}
+}
+
+static void
+bulk_add_destroy_all()
+{
+	while (bulk_adds)
+		bulk_add_destroy(bulk_adds->data);
+}
+
+
+/*
+ * Searchresult table
+ */
+/*
+ * Userdata of the table, for its buttons and its close callback. The UI
+ * frees the rows before the close callback runs, so the items are kept
+ * in a copy of their own.
+ */
+typedef struct _SearchResultsData SearchResultsData;
+struct _SearchResultsData {
+	ItemList *itemlist;
+	PurpleConnection *pc;
+	char *peer;  /* bare jid of the sender */
+	void *ui_handle;
+};
+
+static GList *searchresults_open = NULL;  /* entries are SearchResultsData* */
+
+/* Row columns */
+enum {
+	COLUMN_ALIAS,
+	COLUMN_JID,
+	COLUMN_GROUP,
+	COLUMN_ACTION
+};
+
+static ItemAction
+row_get_action(GList *row)
+{
+	int action = item_action_from_string(g_list_nth_data(row, COLUMN_ACTION));
+
+	return action < 0 ? ITEM_ACTION_ADD : action;
+}
+
+static void
+add_rosteritem_cb(PurpleConnection *c, GList *row, gpointer userdata)
+{
+	if (row_get_action(row) == ITEM_ACTION_DELETE) {
+		purple_debug_info(PLUGIN_ID, "Not adding %s, it was suggested for removal\n",
+				(char *) g_list_nth_data(row, COLUMN_JID));
+		return;
+	}
+	purple_blist_request_add_buddy(
+			purple_connection_get_account(c),
+			g_list_nth_data(row, COLUMN_JID),
+			g_list_nth_data(row, COLUMN_GROUP),
+			g_list_nth_data(row, COLUMN_ALIAS)
+			);
+}
+
+static void
+remove_rosteritem_cb(PurpleConnection *c, GList *row, gpointer userdata)
+{
+	ItemList *itemlist;
+	Item *item;
+
+	g_return_if_fail(PURPLE_CONNECTION_IS_VALID(c));
+
+	if (row_get_action(row) != ITEM_ACTION_DELETE) {
+		purple_debug_info(PLUGIN_ID, "Not removing %s, it was not suggested for removal\n",
+				(char *) g_list_nth_data(row, COLUMN_JID));
+		return;
+	}
+	itemlist = itemlist_new();
+	item = item_new(itemlist, g_list_nth_data(row, COLUMN_JID), NULL);
+	if (g_list_nth_data(row, COLUMN_GROUP))
+		item_add_group(itemlist, item, g_list_nth_data(row, COLUMN_GROUP));
+	bulk_remove_from_groups(purple_connection_get_account(c), item, FALSE);
+	itemlist_destroy(itemlist);
+}
+
+/* Only an explicit decline goes into the history, closing the table does not */
+static void
+decline_rosteritem_cb(PurpleConnection *c, GList *row, gpointer userdata)
+{
+	SearchResultsData *data = (SearchResultsData *) userdata;
+	const char *jid;
+
+	g_return_if_fail(row);
+
+	jid = g_list_nth_data(row, COLUMN_JID);
+	if (row_get_action(row) != ITEM_ACTION_ADD) {
+		purple_debug_info(PLUGIN_ID, "Not declining %s, it was not suggested for adding\n", jid);
+		return;
+	}
+	history_add(data->peer, jid, HISTORY_DECLINED);
+	history_flush();
+}
+
+static void
+add_all_rosteritems_cb(PurpleConnection *c, GList *row, gpointer userdata) 
+{
+	SearchResultsData *data = (SearchResultsData *) userdata;
+	ItemList *itemlist;
+	g_return_if_fail(PURPLE_CONNECTION_IS_VALID(c));
+
+	itemlist = itemlist_new();
+	itemlist_merge(itemlist, data->itemlist, G_MAXINT, G_MAXINT);
+	bulk_add_start_confirmed(c, itemlist, data->peer);
+}
+
+static void
+add_row(PurpleNotifySearchResults *rec_items,
+		const char *jid, const char *alias, const char *groupname, ItemAction action)
+{
+	GList *item_row = NULL;
+
+	/* Name attribute is optional in rosteritem, so we have to check if
+	 * it exists in each rosteritem
+	 */
+	item_row = g_list_append(item_row, g_strdup(alias ? alias : jid));
+	item_row = g_list_append(item_row, g_strdup(jid));
+	item_row = g_list_append(item_row, g_strdup(groupname));
+	item_row = g_list_append(item_row, g_strdup(item_action_names[action]));
+
+	purple_notify_searchresults_row_add(rec_items, item_row);
+}
+
+static void
+searchresults_close_cb(gpointer userdata)
+{
+	SearchResultsData *data = (SearchResultsData *) userdata;
+
+	searchresults_open = g_list_remove(searchresults_open, data);
+
+	itemlist_destroy(data->itemlist);
+	g_free(data->peer);
+	g_free(data);
+}
+
+static void
+searchresults_close_all()
+{
+	while (searchresults_open) {
+		SearchResultsData *data = (SearchResultsData *) searchresults_open->data;
+
+		purple_notify_close(PURPLE_NOTIFY_SEARCHRESULTS, data->ui_handle);
+		/* In case the UI did not run the close callback */
+		if (searchresults_open && searchresults_open->data == data)
+			searchresults_close_cb(data);
+	}
+}
+
+static void
+searchresults_new_from_itemlist(ItemList *itemlist, AuxData *aux)
+{
+	GList *i, *g;
+	PurpleNotifySearchResults *rec_items;
+	SearchResultsData *data;
+	char *rosteritems_title;
+	guint ndelete = 0;
+
+	if (itemlist_is_empty(itemlist)) {
+		purple_debug_info(PLUGIN_ID, "itemlist -> searchresults: resulting itemlist is empty, no action\n");
+		return;
+	}
+
+	rec_items = purple_notify_searchresults_new();
+
+	purple_notify_searchresults_column_add(rec_items, 
+			purple_notify_searchresults_column_new(_("Name")));
+	purple_notify_searchresults_column_add(rec_items,
+			purple_notify_searchresults_column_new(_("JID")));
+	purple_notify_searchresults_column_add(rec_items,
+			purple_notify_searchresults_column_new(_("Group")));
+	purple_notify_searchresults_column_add(rec_items,
+			purple_notify_searchresults_column_new(_("Action")));
+
+	for (i = itemlist_get_items(itemlist); i; i = g_list_next(i)) {
+		Item *item = (Item *) i->data;
+		const char *jid  = item->jid;
+		const char *alias = item->alias;
+
+		if (item->entries) { /* extra verbosity: one row for each group of the item */
+			for (g = g_list_first(item->entries); g; g = g_list_next(g)) {
+				const char *groupname = g->data;
+				add_row(rec_items, jid, alias, groupname, item->action);
+			}
+		} else {
+			add_row(rec_items, jid, alias, NULL, item->action);
+		}
+		if (item->action == ITEM_ACTION_DELETE)
+			ndelete++;
+	} /* End of processing one roster item */
+
+	purple_notify_searchresults_button_add(rec_items,
+			PURPLE_NOTIFY_BUTTON_ADD, add_rosteritem_cb);
+	if (ndelete)
+		purple_notify_searchresults_button_add_labeled(rec_items,
+				_("Remove"), remove_rosteritem_cb);
+	if (purple_prefs_get_bool(PREF_HISTORY))
+		purple_notify_searchresults_button_add_labeled(rec_items,
+				_("Decline"), decline_rosteritem_cb);
+
+   	/* NOTE: This button is not visible in Pidgin < 3.0.0dev
+	 * because of a bug in gtknotify.c */
+	purple_notify_searchresults_button_add_labeled(rec_items,
+			_("All"), add_all_rosteritems_cb);
+
+	data = g_new0(SearchResultsData, 1);
+	data->itemlist = itemlist_new();
+	itemlist_merge(data->itemlist, itemlist, G_MAXINT, G_MAXINT);
+	data->pc = aux->pc;
+	data->peer = g_strdup(aux->target_jid);
+
+	rosteritems_title = g_strdup_printf("User %s has sent you a contact suggestion:",
+			aux->target_jid);
+	data->ui_handle = purple_notify_searchresults(
+			aux->pc,
+			purple_account_get_username(purple_connection_get_account(aux->pc)),
+			rosteritems_title,
+			NULL,
+			rec_items,
+			searchresults_close_cb,
+			data
+			);
+
+	if (data->ui_handle)
+		searchresults_open = g_list_prepend(searchresults_open, data);
+	else /* no table, so no close callback either */
+		searchresults_close_cb(data);
+	g_free(rosteritems_title);
+}
+
+
+/*
+ * Jabber helper functions
+ */
+static char*
+generate_next_id()
+{
+	static guint32 index = 0;
+
+	if (index == 0) {
+		do {
+			index = g_random_int();
+		} while (index == 0);
+	}
+	return g_strdup_printf("rosterx%x", index++);
+}
+
+static char*
+create_full_jid(const char *bare_jid, const char *resource)
+{
+	return g_strdup_printf("%s/%s", bare_jid, resource);
+}
+
+static char*
+create_bare_jid(const char *jid)
+{
+	gchar **parts = g_strsplit(jid, "/", 2);
+	gchar *bare_jid = g_strdup(parts[0]);
+
+	g_strfreev(parts);
+	return bare_jid;
+}
+
+static gboolean
+jid_is_subscribed(PurpleConnection *pc, const char *jid)
+{
+	DummyJabberStream *js;
+	DummyJabberBuddy *jb;
+	char bare_jid[JID_BUFFER_SIZE];
+
+	/* Offline and non-XMPP accounts have no JabberStream */
+	if (!pc || !jid || !equals("prpl-jabber", purple_account_get_protocol_id(purple_connection_get_account(pc))))
+		return FALSE;
+	js = purple_connection_get_protocol_data(pc);
+	if (!js || !normalize_bare_jid(jid, bare_jid, sizeof(bare_jid)))
+		return FALSE;
+
+	jb = g_hash_table_lookup(js->buddies, bare_jid);
+	return jb && !(jb->subscription & JABBER_SUB_PENDING) && (jb->subscription & JABBER_SUB_BOTH);
+}
+
+static gboolean
+_resource_has_feature(PurpleAccount *account, const char *full_jid, const char *namespace)
+{
+	void *jabber_handle = purple_plugins_find_with_id("prpl-jabber");
+	gboolean ipc_success;
+	int result;
+
+	result = GPOINTER_TO_INT(purple_plugin_ipc_call(jabber_handle,
+				"contact_has_feature", &ipc_success,
+				account,
+				full_jid,
+				namespace));
+
+	// purple_debug_misc(PLUGIN_ID, "_resource_has_feature(): ns=%s, full=%s, ipc_success=%s, result=%x\n",
+	//		namespace, full_jid, ipc_success ? "yes":"no", result);
+
+	return (ipc_success && result);
+}
+
+
+/*
+ * RosterX capability cache
+ *
+ * Whether a resource supports RosterX is cached per XEP-0115 caps ver,
+ * which identifies the feature set of a client, or per full jid for
+ * resources with legacy caps. On top of that, each buddy's
+ * list of RosterX-capable resources is kept until the next presence of
+ * that buddy, so that the blist menu and the sending code do not need
+ * any IPC calls.
+ */
+typedef struct _RosterxResource RosterxResource;
+struct _RosterxResource {
+	char *full_jid;
+	int priority;
+	gboolean available;  /* online, not unavailable or in error state */
+	time_t idle;         /* idle since, 0 if active */
+};
+
+typedef struct _BuddyCaps BuddyCaps;
+struct _BuddyCaps {
+	gboolean rosterx_capable;  /* at least one resource supports RosterX */
+	gboolean complete;         /* FALSE if some resource's caps were still unknown */
+	gint64 retry_after;        /* if incomplete: monotonic time of next lookup */
+	GList *resources;          /* RosterX-capable resources, "most available" first,
+	                            * entries are RosterxResource* */
+};
+
+#define BUDDYCAPS_RETRY_USEC  (5 * G_USEC_PER_SEC)
+
+static GHashTable *feature_cache = NULL;    /* caps ver or full jid -> has RosterX feature */
+static GHashTable *buddycaps_cache = NULL;  /* PurpleBuddy* -> BuddyCaps* */
+
+static void
+rosterx_resource_destroy(gpointer _res)
+{
+	RosterxResource *res = (RosterxResource *) _res;
+
+	g_free(res->full_jid);
+	g_free(res);
+}
+
+static void
+buddycaps_destroy(gpointer _bc)
+{
+	BuddyCaps *bc = (BuddyCaps *) _bc;
+
+	g_list_free_full(bc->resources, rosterx_resource_destroy);
+	g_free(bc);
+}
+
+static gboolean
+_resource_has_rosterx(PurpleAccount *account, DummyJabberBuddyResource *jbr,
+		const char *full_jid, gboolean *known)
+{
+	DummyJabberCapsClientInfo *info = jbr->caps.info;
+	const char *key = full_jid;
+	gpointer value;
+	gboolean has_feature;
+
+	/* Legacy caps (without hash) may depend on extensions, so only
+	 * hashed caps are safe to share between resources */
+	if (info && info->tuple.hash && info->tuple.ver)
+		key = info->tuple.ver;
+
+	if (g_hash_table_lookup_extended(feature_cache, key, NULL, &value))
+		return GPOINTER_TO_INT(value);
+
+	has_feature = _resource_has_feature(account, full_jid, NS_ROSTERX);
+
+	if (info) {
+		g_hash_table_insert(feature_cache, g_strdup(key), GINT_TO_POINTER(has_feature));
+	} else {
+		/* Caps are still being discovered, so don't trust a negative result */
+		*known = has_feature;
+	}
+	return has_feature;
+}
+
+static BuddyCaps *
+buddycaps_new(PurpleBuddy *b)
+{
+	PurpleAccount *account = purple_buddy_get_account(b);
+	PurpleConnection *pc = purple_account_get_connection(account);
+	BuddyCaps *bc = g_new0(BuddyCaps, 1);
+	DummyJabberStream *js;
+	DummyJabberBuddy *jb;
+	GList *r;
+
+	bc->complete = TRUE;
+	if (!pc || !(js = purple_connection_get_protocol_data(pc)))
+		return bc;
+
+	jb = g_hash_table_lookup(js->buddies, purple_buddy_get_name(b));
+	for (r = jb ? jb->resources : NULL; r; r = g_list_next(r)) {
+		DummyJabberBuddyResource *jbr = r->data;
+		char *full_jid;
+		gboolean known = TRUE;
+
+		if (!jbr->name)
+			continue;
+
+		full_jid = create_full_jid(purple_buddy_get_name(b), jbr->name);
+		if (_resource_has_rosterx(account, jbr, full_jid, &known)) {
+			RosterxResource *res = g_new0(RosterxResource, 1);
+
+			/* priority, state and idle only change with presence,
+			 * which invalidates this entry */
+			res->full_jid = full_jid;
+			res->priority = jbr->priority;
+			res->available = (jbr->state > JABBER_BUDDY_STATE_UNAVAILABLE);
+			res->idle = jbr->idle;
+			bc->resources = g_list_prepend(bc->resources, res);
+		} else {
+			g_free(full_jid);
+		}
+		bc->complete = bc->complete && known;
+	}
+	bc->resources = g_list_reverse(bc->resources);
+	bc->rosterx_capable = (bc->resources != NULL);
+	if (!bc->complete)
+		bc->retry_after = g_get_monotonic_time() + BUDDYCAPS_RETRY_USEC;
+	return bc;
+}
+
+static BuddyCaps *
+buddycaps_lookup(PurpleBuddy *b)
+{
+	BuddyCaps *bc = g_hash_table_lookup(buddycaps_cache, b);
+
+	if (!bc || (!bc->complete && g_get_monotonic_time() >= bc->retry_after)) {
+		bc = buddycaps_new(b);
+		g_hash_table_replace(buddycaps_cache, b, bc);
+	}
+	return bc;
+}
+
+static void
+buddycaps_invalidate(PurpleAccount *account, const char *jid)
+{
+	char *bare_jid = create_bare_jid(jid);
+	GSList *buddies = purple_find_buddies(account, bare_jid);
+	GSList *l;
+
+	for (l = buddies; l; l = g_slist_next(l))
+		g_hash_table_remove(buddycaps_cache, l->data);
+
+	g_slist_free(buddies);
+	g_free(bare_jid);
+}
+
+static void
+caps_cache_init()
+{
+	feature_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	buddycaps_cache = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, buddycaps_destroy);
+}
+
+static void
+caps_cache_destroy()
+{
+	if (buddycaps_cache)
+		g_hash_table_destroy(buddycaps_cache);
+	if (feature_cache)
+		g_hash_table_destroy(feature_cache);
+	buddycaps_cache = feature_cache = NULL;
+}
+
+static gboolean
+presence_received_cb(PurpleConnection *pc, const char *type, const char *from,
+		xmlnode *presence)
+{
+	if (from) {
+		g_hash_table_remove(feature_cache, from);
+		buddycaps_invalidate(purple_connection_get_account(pc), from);
+	}
+	return FALSE; /* let the jabber prpl process the presence */
+}
+
+static void
+buddycaps_buddy_removed_cb(PurpleBuddy *b, gpointer data)
+{
+	g_hash_table_remove(buddycaps_cache, b);
+}
+
+static void
+buddy_caps_changed_cb(PurpleBuddy *b, int newcaps, int oldcaps, gpointer data)
+{
+	buddycaps_invalidate(purple_buddy_get_account(b), purple_buddy_get_name(b));
+}
+
+static void
+signing_off_cb(PurpleConnection *pc, gpointer data)
+{
+	/* Resources disappear without presence updates when we go offline */
+	g_hash_table_remove_all(buddycaps_cache);
+}
+
+
+/*
+ * Generic sending of an iq or message
+ */
+static void
+send_iq(PurpleConnection *pc, const char *full_to, const char *id, xmlnode *xnode)
+{
+	xmlnode *iq;
+	const char *from = purple_account_get_username(
+			purple_connection_get_account(pc));
+
+	iq = xmlnode_new("iq");
+	xmlnode_set_attrib(iq, "type", "set");
+	xmlnode_set_attrib(iq, "id", id);
+	xmlnode_set_attrib(iq, "to", full_to);
+	xmlnode_set_attrib(iq, "from", from);
+	xmlnode_insert_child(iq, xnode);
+
+	// purple_debug_info(PLUGIN_ID, "Sending request iq from '%s' to '%s'...\n", from, full_to);
+	purple_signal_emit(purple_connection_get_prpl(pc), "jabber-sending-xmlnode", pc, &iq);
+
+	xmlnode_free(iq);
+}
+
+/*
+ * Sends the same <x/> in one <iq/> per recipient. The payload is
+ * serialized only once and spliced into the per-recipient envelopes,
+ * and all of them are written to the stream at once.
+ * ids holds the <iq/> id for each entry of full_jids.
+ *
+ * The envelopes carry the stream's default namespace themselves: on
+ * BOSH, stanzas are wrapped in a <body/> of another namespace, and the
+ * prpl only adds it to the stanzas that it serializes. send_raw still
+ * emits "jabber-sending-text", so other plugins see the stanzas.
+ *
+ * NOTE: Takes ownership of xnode
+ */
+static void
+send_iqs_batched(PurpleConnection *pc, GList *full_jids, GList *ids, xmlnode *xnode)
+{
+	PurplePluginProtocolInfo *prpl_info = PURPLE_PLUGIN_PROTOCOL_INFO(purple_connection_get_prpl(pc));
+	char *from = g_markup_escape_text(purple_account_get_username(
+				purple_connection_get_account(pc)), -1);
+	char *payload;
+	int payload_len;
+	GString *batch;
+	GList *l, *i;
+
+	if (!PURPLE_PROTOCOL_PLUGIN_HAS_FUNC(prpl_info, send_raw)) {
+		/* No raw access to the stream, send one xmlnode at a time */
+		for (l = full_jids, i = ids; l && i; l = g_list_next(l), i = g_list_next(i))
+			send_iq(pc, l->data, i->data, xmlnode_copy(xnode));
+		xmlnode_free(xnode);
+		g_free(from);
+		return;
+	}
+
+	payload = xmlnode_to_str(xnode, &payload_len);
+	batch = g_string_sized_new((payload_len + 256) * g_list_length(full_jids));
+
+	for (l = full_jids, i = ids; l && i; l = g_list_next(l), i = g_list_next(i)) {
+		char *id = g_markup_escape_text(i->data, -1);
+		char *to = g_markup_escape_text(l->data, -1);
+
+		g_string_append_printf(batch, "<iq xmlns='jabber:client' type='set' id='%s' to='%s' from='%s'>",
+				id, to, from);
+		g_string_append_len(batch, payload, payload_len);
+		g_string_append(batch, "</iq>");
+
+		g_free(to);
+		g_free(id);
+	}
+
+	purple_debug_info(PLUGIN_ID, "send_iqs_batched(): %u <iq/>s in %" G_GSIZE_FORMAT " bytes\n",
+			g_list_length(full_jids), batch->len);
+	prpl_info->send_raw(pc, batch->str, batch->len);
+
+	g_string_free(batch, TRUE);
+	g_free(payload);
+	g_free(from);
+	xmlnode_free(xnode);
+}
+
+static void
+send_message(PurpleConnection *pc, const char *to, xmlnode *xnode, const char *text)
+{
+	xmlnode *message, *node;
+	const char *from = purple_account_get_username(
+			purple_connection_get_account(pc));
+	char *id = generate_next_id();
+
+	message = xmlnode_new("message");
+	xmlnode_set_attrib(message, "id", id);
+	xmlnode_set_attrib(message, "to", to);
+	xmlnode_set_attrib(message, "from", from);
+	xmlnode_insert_child(message, xnode);
+
+	/* We don't want the message echoed back to our other devices */
+	node = xmlnode_new_child(message, "private");
+	xmlnode_set_namespace(node, NS_CARBONS);
+	if (text) {
+		node = xmlnode_new_child(message, "body");
+		xmlnode_insert_data(node, text, -1);
+	}
+
+	// purple_debug_info(PLUGIN_ID, "Sending request message to '%s'...\n", to);
+	purple_signal_emit(purple_connection_get_prpl(pc), "jabber-sending-xmlnode", pc, &message);
+
+	xmlnode_free(message);
+	g_free(id);
+}
+
+/*
+ * Tracking of sent <iq/>s
+ *
+ * Every suggestion stanza sent as <iq/>s to one contact is a
+ * PendingExchange; its <iq/>s are registered per connection by id.
+ * A result from any of the resources completes the exchange. If none
+ * of them answers within IQ_TIMEOUT_SECONDS, the suggestion is sent
+ * again as <message/> to the bare jid.
+ *
+ * An error of type 'wait', like the resource-constraint of a receiver's
+ * rate limit, makes that <iq/> go out again after IQ_RETRY_SECONDS, up
+ * to IQ_MAX_RETRIES times. Other errors are final for their resource,
+ * the other resources may still answer. Once all of them failed, the
+ * suggestion is sent as <message/> if any of them only asked to wait.
+ *
+ * The done callback learns whether the suggestion was delivered, by a
+ * result or as <message/>. It is not called if the exchange ends with
+ * the connection or the plugin.
+ */
+typedef void (*ExchangeDoneFunc)(gpointer data, gboolean delivered);
+
+typedef struct _PendingExchange PendingExchange;
+struct _PendingExchange {
+	PurpleConnection *pc;
+	char *to;          /* bare jid */
+	xmlnode *xnode;    /* payload for the <message/> fallback and retries */
+	char *text;
+	GList *iqs;        /* unanswered <iq/>s, entries are PendingIq* */
+	gboolean waited;   /* a resource ran out of retries after 'wait' errors */
+	guint timer;
+	ExchangeDoneFunc done;
+	gpointer done_data;
+};
+
+typedef struct _PendingIq PendingIq;
+struct _PendingIq {
+	char *id;          /* NULL while waiting to be sent again */
+	char *full_jid;
+	gint64 sent;       /* monotonic time in microseconds */
+	guint retries;     /* times sent again after a 'wait' error */
+	guint timer;       /* until it is sent again */
+	PendingExchange *exchange;
+};
+
+static GHashTable *pending_iqs = NULL;     /* PurpleConnection* -> GHashTable* (id -> PendingIq*) */
+static GList *pending_exchanges = NULL;    /* entries are PendingExchange* */
+
+/* Takes piq out of the id table until it is sent again */
+static void
+pending_iq_unregister(PendingIq *piq)
+{
+	GHashTable *iqs = g_hash_table_lookup(pending_iqs, piq->exchange->pc);
+
+	if (iqs && piq->id)
+		g_hash_table_remove(iqs, piq->id);
+	g_free(piq->id);
+	piq->id = NULL;
+}
+
+/* Gives piq a new id for its next <iq/> */
+static void
+pending_iq_register(PendingIq *piq)
+{
+	GHashTable *iqs = g_hash_table_lookup(pending_iqs, piq->exchange->pc);
+
+	if (!iqs) {
+		iqs = g_hash_table_new(g_str_hash, g_str_equal);
+		g_hash_table_insert(pending_iqs, piq->exchange->pc, iqs);
+	}
+
+	piq->id = generate_next_id();
+	piq->sent = g_get_monotonic_time();
+	g_hash_table_insert(iqs, piq->id, piq);
+}
+
+static void
+pending_iq_destroy(PendingIq *piq)
+{
+	pending_iq_unregister(piq);
+	piq->exchange->iqs = g_list_remove(piq->exchange->iqs, piq);
+
+	if (piq->timer)
+		purple_timeout_remove(piq->timer);
+	g_free(piq->full_jid);
+	g_free(piq);
+}
+
+static void
+pending_exchange_destroy(PendingExchange *exchange)
+{
+	pending_exchanges = g_list_remove(pending_exchanges, exchange);
+
+	while (exchange->iqs)
+		pending_iq_destroy(exchange->iqs->data);
+
+	if (exchange->timer)
+		purple_timeout_remove(exchange->timer);
+	if (exchange->xnode)
+		xmlnode_free(exchange->xnode);
+	g_free(exchange->text);
+	g_free(exchange->to);
+	g_free(exchange);
+}
+
+static void
+pending_exchange_done(PendingExchange *exchange, gboolean delivered)
+{
+	if (exchange->done)
+		exchange->done(exchange->done_data, delivered);
+	pending_exchange_destroy(exchange);
+}
+
+/* Sends the suggestion as <message/> instead, and ends the exchange */
+static void
+pending_exchange_fall_back(PendingExchange *exchange)
+{
+	send_message(exchange->pc, exchange->to, exchange->xnode, exchange->text);
+	exchange->xnode = NULL;
+
+	pending_exchange_done(exchange, TRUE);
+}
+
+/* Detaches the done callbacks with done_data, which goes away */
+static void
+pending_exchanges_forget(gpointer done_data)
+{
+	GList *l;
+
+	for (l = pending_exchanges; l; l = g_list_next(l)) {
+		PendingExchange *exchange = (PendingExchange *) l->data;
+
+		if (exchange->done_data == done_data)
+			exchange->done = NULL;
+	}
+}
+
+static gboolean
+pending_exchange_timeout_cb(gpointer _exchange)
+{
+	PendingExchange *exchange = (PendingExchange *) _exchange;
+
+	exchange->timer = 0;
+	purple_debug_warning(PLUGIN_ID, "No answer from %s within %d s, sending <message/> instead\n",
+			exchange->to, IQ_TIMEOUT_SECONDS);
+
+	pending_exchange_fall_back(exchange);
+	return FALSE;
+}
+
+/* Keeps a copy of xnode and text for the fallback */
+static PendingExchange *
+pending_exchange_new(PurpleConnection *pc, const char *to, xmlnode *xnode, const char *text,
+		ExchangeDoneFunc done, gpointer done_data)
+{
+	PendingExchange *exchange = g_new0(PendingExchange, 1);
+
+	exchange->pc = pc;
+	exchange->to = g_strdup(to);
+	exchange->xnode = xmlnode_copy(xnode);
+	exchange->text = g_strdup(text);
+	exchange->done = done;
+	exchange->done_data = done_data;
+	exchange->timer = purple_timeout_add_seconds(IQ_TIMEOUT_SECONDS,
+			pending_exchange_timeout_cb, exchange);
+
+	pending_exchanges = g_list_prepend(pending_exchanges, exchange);
+	return exchange;
+}
+
+/* Returns the id to send the <iq/> with, owned by the exchange */
+static const char *
+pending_exchange_add_iq(PendingExchange *exchange, const char *full_jid)
+{
+	PendingIq *piq = g_new0(PendingIq, 1);
+
+	piq->full_jid = g_strdup(full_jid);
+	piq->exchange = exchange;
+	pending_iq_register(piq);
+
+	exchange->iqs = g_list_prepend(exchange->iqs, piq);
+	return piq->id;
+}
+
+static gboolean
+pending_iq_retry_cb(gpointer _piq)
+{
+	PendingIq *piq = (PendingIq *) _piq;
+	PendingExchange *exchange = piq->exchange;
+
+	piq->timer = 0;
+	pending_iq_register(piq);
+	purple_debug_info(PLUGIN_ID, "Sending the suggestion to %s again (retry %u)\n",
+			piq->full_jid, piq->retries);
+	send_iq(exchange->pc, piq->full_jid, piq->id, xmlnode_copy(exchange->xnode));
+
+	/* The new <iq/> gets the whole timeout for its answer */
+	if (exchange->timer)
+		purple_timeout_remove(exchange->timer);
+	exchange->timer = purple_timeout_add_seconds(IQ_TIMEOUT_SECONDS,
+			pending_exchange_timeout_cb, exchange);
+	return FALSE;
+}
+
+/* Returns FALSE if the <iq/> does not answer one of ours */
+static gboolean
+pending_iq_answered(PurpleConnection *pc, const char *type, const char *id, const char *from,
+		xmlnode *iq)
+{
+	GHashTable *iqs = g_hash_table_lookup(pending_iqs, pc);
+	PendingIq *piq = (iqs && id) ? g_hash_table_lookup(iqs, id) : NULL;
+	PendingExchange *exchange;
+	gsize from_len = from ? strlen(from) : 0;
+	xmlnode *error;
+	const char *error_type;
+
+	/* The answer must come from the resource or its bare jid */
+	if (!piq || !from || strncmp(piq->full_jid, from, from_len) != 0 ||
+			(piq->full_jid[from_len] != '\0' && piq->full_jid[from_len] != '/'))
+		return FALSE;
+
+	exchange = piq->exchange;
+	metrics_record(STAGE_IQ_ROUNDTRIP, piq->sent, 1);
+
+	if (equals("result", type)) {
+		purple_debug_info(PLUGIN_ID, "Suggestion acknowledged by %s after %" G_GINT64_FORMAT " ms\n",
+				piq->full_jid, (g_get_monotonic_time() - piq->sent) / 1000);
+
+		/* One result is enough, the other resources may stay silent */
+		pending_exchange_done(exchange, TRUE);
+		return TRUE;
+	}
+
+	error = xmlnode_get_child(iq, "error");
+	error_type = error ? xmlnode_get_attrib(error, "type") : NULL;
+	pending_iq_unregister(piq);
+
+	if (equals("wait", error_type) && piq->retries < IQ_MAX_RETRIES) {
+		piq->retries++;
+		purple_debug_info(PLUGIN_ID, "Suggestion deferred by %s, sending it again in %d s\n",
+				piq->full_jid, IQ_RETRY_SECONDS);
+		piq->timer = purple_timeout_add_seconds(IQ_RETRY_SECONDS, pending_iq_retry_cb, piq);
+		return TRUE;
+	}
+
+	purple_debug_warning(PLUGIN_ID, "Suggestion rejected by %s after %" G_GINT64_FORMAT " ms (%s)\n",
+			piq->full_jid, (g_get_monotonic_time() - piq->sent) / 1000,
+			error_type ? error_type : "unknown error");
+	exchange->waited = exchange->waited || equals("wait", error_type);
+	pending_iq_destroy(piq);
+
+	if (!exchange->iqs) {
+		if (exchange->waited)
+			pending_exchange_fall_back(exchange);
+		else
+			pending_exchange_done(exchange, FALSE);
+	}
+	return TRUE;
+}
+
+static void
+pending_iqs_signing_off_cb(PurpleConnection *pc, gpointer data)
+{
+	GList *l = pending_exchanges;
+
+	while (l) {
+		PendingExchange *exchange = (PendingExchange *) l->data;
+
+		l = g_list_next(l);
+		if (exchange->pc == pc)
+			pending_exchange_destroy(exchange);
+	}
+	g_hash_table_remove(pending_iqs, pc);
+}
+
+static void
+pending_iqs_init()
+{
+	pending_iqs = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+			NULL, (GDestroyNotify) g_hash_table_destroy);
+}
+
+static void
+pending_iqs_destroy()
+{
+	while (pending_exchanges)
+		pending_exchange_destroy(pending_exchanges->data);
+
+	if (pending_iqs)
+		g_hash_table_destroy(pending_iqs);
+	pending_iqs = NULL;
+}
+
+/*
+ * Picks the RosterX-capable resource that should receive the <iq/>,
+ * as recommended by XEP-0144 (5. Recommended Stanza Types):
+ *
+ * - TARGET_BEST_RESOURCE: the first available resource with a
+ *   non-negative priority, in the "most available" order that
+ *   the jabber prpl keeps the resources in;
+ * - TARGET_RECENT_RESOURCE: an available resource that is not idle,
+ *   or else the one that became idle last.
+ *
+ * Falls back to the first RosterX-capable resource.
+ */
+static RosterxResource *
+choose_resource(BuddyCaps *bc, TargetSetting target)
+{
+	RosterxResource *chosen = NULL;
+	GList *r;
+
+	for (r = bc->resources; r; r = g_list_next(r)) {
+		RosterxResource *res = r->data;
+
+		if (!res->available)
+			continue;
+
+		if (target == TARGET_RECENT_RESOURCE) {
+			if (res->idle == 0)
+				return res;
+			if (!chosen || res->idle > chosen->idle)
+				chosen = res;
+
+		} else if (res->priority >= 0) {
+			return res;
+		}
+	}
+	return chosen ? chosen : bc->resources->data;
+}
+
+/* 
+ * If entity is online, this implementation sends an <iq/> request to
+ * the RosterX-capable resource picked by choose_resource(), or to
+ * _all_ of them if the target preference says so.
+ *
+ * If the entity is offline, send a message to the bare jid instead.
+ *
+ * done is called once the suggestion is delivered, at once for a
+ * message, or once it failed. Returns the number of stanzas sent.
+ */
+static guint
+send_iqs_or_message(PurpleConnection *pc, const char *to, xmlnode *xnode, const char *text,
+		ExchangeDoneFunc done, gpointer done_data)
+{
+	PurpleBuddy *b = purple_find_buddy(
+			purple_connection_get_account(pc), to);
+	BuddyCaps *bc;
+	guint nstanzas = 1;
+	g_return_val_if_fail(b, 0);
+
+	bc = buddycaps_lookup(b);
+
+	if (STRICT_XEP && PURPLE_BUDDY_IS_ONLINE(b) && bc->rosterx_capable) {
+		TargetSetting target = purple_prefs_get_int(PREF_TARGET);
+		PendingExchange *exchange = pending_exchange_new(pc, to, xnode, text, done, done_data);
+
+		if (target == TARGET_ALL_RESOURCES && bc->resources->next) {
+			GList *full_jids = NULL, *ids = NULL, *r;
+
+			for (r = bc->resources; r; r = g_list_next(r)) {
+				const char *full_jid = ((RosterxResource *) r->data)->full_jid;
+
+				purple_debug_info(PLUGIN_ID, "send_iqs_or_message(): <iq/> to=%s\n", full_jid);
+				full_jids = g_list_prepend(full_jids, (gpointer) full_jid);
+				ids = g_list_prepend(ids, (gpointer) pending_exchange_add_iq(exchange, full_jid));
+			}
+			full_jids = g_list_reverse(full_jids);
+			ids = g_list_reverse(ids);
+			nstanzas = g_list_length(full_jids);
+
+			send_iqs_batched(pc, full_jids, ids, xnode);
+			g_list_free(full_jids);
+			g_list_free(ids);
+
+		} else {
+			const char *full_jid = choose_resource(bc, target)->full_jid;
+
+			purple_debug_info(PLUGIN_ID, "send_iqs_or_message(): <iq/> to=%s\n", full_jid);
+
+			send_iq(pc, full_jid, pending_exchange_add_iq(exchange, full_jid), xnode);
+		}
+
+	} else { /* fallback if buddy is offline or has no RosterX resource */
+		send_message(pc, to, xnode, text);
+		if (done)
+			done(done_data, TRUE);
+	}
+	return nstanzas;
 }
 
 
-static GList*
-itemlist_new_from_xnode(xmlnode *xnode)
+/*
+ * Generate a RosterX suggestion
+ */
+/* Appends n with commas between groups of three digits, like "1,234" */
+static void
+append_grouped_count(GString *text, guint n)
 {
-	xmlnode *xitem;
-	GList *itemlist = NULL;
+	char digits[16];
+	int len = g_snprintf(digits, sizeof(digits), "%u", n), i;
 
-	for (xitem = xmlnode_get_child(xnode, "item"); xitem; xitem = xmlnode_get_next_twin(xitem)) {
-		Item *item = NULL;
-		const char *action = xmlnode_get_attrib(xitem, "action");
-		const char *jid = xmlnode_get_attrib(xitem, "jid");
+	for (i = 0; i < len; i++) {
+		if (i > 0 && (len - i) % 3 == 0)
+			g_string_append_c(text, ',');
+		g_string_append_c(text, digits[i]);
+	}
+}
 
-		if (!action || equals("add", action)) { /* default action is 'add' */
-			if (!itemlist_find_by_jid(itemlist, jid)) {
-				item = item_new_from_xitem(xitem);
-				itemlist = g_list_prepend(itemlist, item);
-			}
-		}
-		else { /* 'modify' and 'delete' are not implemented */
-			purple_debug_warning(PLUGIN_ID,
-					"Received unknown Roster exchange action '%s'!\n", action);
+/*
+ * Creates the body text for the items from start up to (excluding) end.
+ * Once the text reaches the max_body_bytes preference, the remaining
+ * items are only counted.
+ */
+static char *
+create_message_from_itemlist(GList *start, GList *end, const char *sender)
+{
+	gsize budget = MAX(purple_prefs_get_int(PREF_MAX_BODY_BYTES), 0);
+	guint remaining = 0;
+	GString *text;
+	GList *l;
+
+	/* The budget can be up to 1 MiB, most bodies are much shorter */
+	text = g_string_sized_new(256);
+	g_string_printf(text, "%s has sent you a RosterX contact suggestion:\n", sender);
+
+	for (l = start; l != end; l = g_list_next(l)) {
+		Item *item = (Item *) l->data;
+		const char *alias = item->alias ? item->alias : item->jid;
+		gsize len = strlen(alias) + strlen(item->jid) + sizeof("+ \nxmpp:\n");
+
+		if (remaining || text->len + len > budget) {
+			remaining++;
+			continue;
 		}
+		g_string_append(text, item->action == ITEM_ACTION_DELETE ? "- " :
+				item->action == ITEM_ACTION_MODIFY ? "~ " : "+ ");
+		g_string_append(text, alias);
+		g_string_append(text, "\nxmpp:");
+		g_string_append(text, item->jid);
+		g_string_append_c(text, '\n');
 	}
 
-	if (!itemlist)
-		purple_debug_warning(PLUGIN_ID, "XEP-0144 MUST: Parsed xnode does not contain any items!\n");
-	return g_list_reverse(itemlist);
+	if (remaining) {
+		g_string_append(text, "\u2026and ");
+		append_grouped_count(text, remaining);
+		g_string_append(text, " more\n");
+	}
+
+	return g_string_free(text, FALSE);
 }
 
+
 /*
- * Searchresult table
+ * Delta mode: what was last suggested to each contact is kept, so that
+ * later suggestions to the same contact only carry new items as 'add'
+ * and changed ones as 'modify'. Leaving a contact out of a selection
+ * does not remove it: it stays suggested until it leaves the sender's
+ * buddy list, then it is sent as 'delete' once the user confirmed it.
+ *
+ * A suggestion becomes the last one only once all of its stanzas were
+ * delivered, see delta_commit(). The state is per account and contact,
+ * and saved to DELTA_FILENAME after each change, one line
+ *   key, jid, signature
+ * per item, tab separated and escaped with g_strescape().
  */
-static void
-add_rosteritem_cb(PurpleConnection *c, GList *row, gpointer userdata)
+static GHashTable *suggested = NULL;  /* "account\nbare jid" -> GHashTable (jid -> signature) */
+
+static int
+_compare_strings(gconstpointer a, gconstpointer b)
 {
-	purple_blist_request_add_buddy(
-			purple_connection_get_account(c),
-			g_list_nth_data(row, 1), /* JID   */
-			g_list_nth_data(row, 2), /* Group */
-			g_list_nth_data(row, 0)  /* Alias */
-			);
+	return g_strcmp0(*(const char * const *) a, *(const char * const *) b);
 }
 
-static void
-add_all_rosteritems_cb(PurpleConnection *c, GList *row, gpointer userdata) 
+/* Alias and sorted groups of item, equal for unchanged items */
+static char *
+item_signature(Item *item)
 {
-	PurpleNotifySearchResults *results = (PurpleNotifySearchResults *) userdata;
-	GList *r;
-	g_return_if_fail(results);
+	GPtrArray *groups = g_ptr_array_new();
+	GString *signature = g_string_new(item->alias);
+	GList *g;
+	guint i;
 
-	for (r = g_list_first(results->rows); r; r = g_list_next(r)) {
-		GList *row = (GList *) r->data;
+	for (g = item->entries; g; g = g_list_next(g))
+		g_ptr_array_add(groups, g->data);
+	g_ptr_array_sort(groups, _compare_strings);
 
-		add_rosteritem_cb(c, row, userdata);
+	for (i = 0; i < groups->len; i++) {
+		g_string_append_c(signature, '\n');
+		g_string_append(signature, g_ptr_array_index(groups, i));
 	}
+	g_ptr_array_free(groups, TRUE);
+	return g_string_free(signature, FALSE);
 }
 
-static void
-add_row(PurpleNotifySearchResults *rec_items,
-		const char *jid, const char *alias, const char *groupname)
+static char *
+delta_key(PurpleConnection *pc, const char *to)
 {
-	GList *item_row = NULL;
+	char bare_jid[JID_BUFFER_SIZE];
 
-	/* Name attribute is optional in rosteritem, so we have to check if
-	 * it exists in each rosteritem
-	 */
-	item_row = g_list_append(item_row, g_strdup(alias ? alias : jid));
-	item_row = g_list_append(item_row, g_strdup(jid));
-	item_row = g_list_append(item_row, g_strdup(groupname));
-	
-	purple_notify_searchresults_row_add(rec_items, item_row);
+	if (!normalize_bare_jid(to, bare_jid, sizeof(bare_jid)))
+		g_strlcpy(bare_jid, to, sizeof(bare_jid));
+	return g_strdup_printf("%s\n%s",
+			purple_account_get_username(purple_connection_get_account(pc)), bare_jid);
 }
 
-static void
-searchresults_new_from_itemlist(GList *itemlist, AuxData *aux)
+/* Returns the changes since the last suggestion to "to". The state
+ * after itemlist goes to *state, for delta_commit() once it was
+ * delivered. NOTE: Takes ownership of itemlist */
+static ItemList *
+suggestion_delta(PurpleConnection *pc, const char *to, ItemList *itemlist, GHashTable **state)
 {
+	PurpleAccount *account = purple_connection_get_account(pc);
+	char *key = delta_key(pc, to);
+	GHashTable *last = g_hash_table_lookup(suggested, key);
+	GHashTable *current = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+	ItemList *delta = itemlist_new();
+	GHashTableIter iter;
+	gpointer jid, signature;
 	GList *i, *g;
-	PurpleNotifySearchResults *rec_items;
-	char *rosteritems_title;
-
-	if (!itemlist) {
-		purple_debug_info(PLUGIN_ID, "itemlist -> searchresults: resulting itemlist is empty, no action\n");
-		return;
-	}
 
-	rec_items = purple_notify_searchresults_new();
+	for (i = itemlist_get_items(itemlist); i; i = g_list_next(i)) {
+		Item *item = (Item *) i->data;
+		char *signature = item_signature(item);
+		const char *previous = last ? g_hash_table_lookup(last, item->jid) : NULL;
 
-	purple_notify_searchresults_column_add(rec_items, 
-			purple_notify_searchresults_column_new(_("Name")));
-	purple_notify_searchresults_column_add(rec_items,
-			purple_notify_searchresults_column_new(_("JID")));
-	purple_notify_searchresults_column_add(rec_items,
-			purple_notify_searchresults_column_new(_("Group")));
+		if (!equals(previous, signature)) {
+			Item *changed = item_new(delta, item->jid, item->alias);
 
-	for (i = g_list_first(itemlist); i; i = g_list_next(i)) {
-		Item *item = (Item *) i->data;
-		const char *jid  = item->jid;
-		const char *alias = item->alias;
+			changed->action = previous ? ITEM_ACTION_MODIFY : ITEM_ACTION_ADD;
+			for (g = item->entries; g; g = g_list_next(g))
+				item_add_group(delta, changed, g->data);
+			itemlist_append(delta, changed);
+		}
+		g_hash_table_insert(current, g_strdup(item->jid), signature);
+	}
 
-		if (item->entries) { /* extra verbosity: one row for each group of the item */
-			for (g = g_list_first(item->entries); g; g = g_list_next(g)) {
-				const char *groupname = g->data;
-				add_row(rec_items, jid, alias, groupname);
+	if (last) {
+		g_hash_table_iter_init(&iter, last);
+		while (g_hash_table_iter_next(&iter, &jid, &signature)) {
+			Item *deleted;
+
+			if (g_hash_table_lookup(current, jid))
+				continue;
+			if (purple_find_buddy(account, jid)) {
+				/* Only not selected this time */
+				g_hash_table_insert(current, g_strdup(jid), g_strdup(signature));
+				continue;
 			}
-		} else {
-			add_row(rec_items, jid, alias, NULL);
+			deleted = item_new(delta, jid, NULL);
+			deleted->action = ITEM_ACTION_DELETE;
+			itemlist_append(delta, deleted);
 		}
-	} /* End of processing one roster item */
+	}
 
-	purple_notify_searchresults_button_add(rec_items,
-			PURPLE_NOTIFY_BUTTON_ADD, add_rosteritem_cb);
+	purple_debug_info(PLUGIN_ID, "Suggestion to %s: %u of %u items changed\n", to,
+			g_queue_get_length(&delta->items), g_queue_get_length(&itemlist->items));
 
-   	/* NOTE: This button is not visible in Pidgin < 3.0.0dev
-	 * because of a bug in gtknotify.c */
-	purple_notify_searchresults_button_add_labeled(rec_items,
-			_("All"), add_all_rosteritems_cb);
+	g_free(key);
+	*state = current;
+	itemlist_destroy(itemlist);
+	return delta;
+}
 
-	rosteritems_title = g_strdup_printf("User %s has sent you a contact suggestion:",
-			aux->target_jid);
-	purple_notify_searchresults(
-			aux->pc,
-			purple_account_get_username(purple_connection_get_account(aux->pc)),
-			rosteritems_title,
-			NULL,
-			rec_items,
-			NULL,       /* close callback */
-			rec_items   /* userdata */
-			);
+static void
+delta_save()
+{
+	GString *contents = g_string_new(NULL);
+	GHashTableIter peers, items;
+	gpointer key, state, jid, signature;
+
+	g_hash_table_iter_init(&peers, suggested);
+	while (g_hash_table_iter_next(&peers, &key, &state)) {
+		char *escaped_key = g_strescape(key, NULL);
+
+		g_hash_table_iter_init(&items, state);
+		while (g_hash_table_iter_next(&items, &jid, &signature)) {
+			char *escaped_jid = g_strescape(jid, NULL);
+			char *escaped_signature = g_strescape(signature, NULL);
+
+			g_string_append_printf(contents, "%s\t%s\t%s\n",
+					escaped_key, escaped_jid, escaped_signature);
+			g_free(escaped_signature);
+			g_free(escaped_jid);
+		}
+		g_free(escaped_key);
+	}
 
-	g_free(rosteritems_title);
+	if (!purple_util_write_data_to_file(DELTA_FILENAME, contents->str, contents->len))
+		purple_debug_error(PLUGIN_ID, "Could not save the suggested items to %s\n", DELTA_FILENAME);
+	g_string_free(contents, TRUE);
 }
 
+/* Makes state, from suggestion_delta(), the last suggestion to "to". NOTE: Takes ownership of state */
+static void
+delta_commit(PurpleConnection *pc, const char *to, GHashTable *state)
+{
+	g_hash_table_replace(suggested, delta_key(pc, to), state);
+	delta_save();
+}
 
-/*
- * Jabber helper functions
- */
-static char*
-generate_next_id()
+static void
+delta_init()
 {
-	static guint32 index = 0;
+	char *filename = g_build_filename(purple_user_dir(), DELTA_FILENAME, NULL);
+	char *contents = NULL;
+	char **lines, **line;
+	guint nitems = 0;
 
-	if (index == 0) {
-		do {
-			index = g_random_int();
-		} while (index == 0);
+	suggested = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+			(GDestroyNotify) g_hash_table_destroy);
+
+	if (!g_file_get_contents(filename, &contents, NULL, NULL)) {
+		g_free(filename);
+		return;
 	}
-	return g_strdup_printf("rosterx%x", index++);
+
+	lines = g_strsplit(contents, "\n", -1);
+	for (line = lines; *line; line++) {
+		char **fields = g_strsplit(*line, "\t", 3);
+
+		if (g_strv_length(fields) == 3) {
+			char *key = g_strcompress(fields[0]);
+			GHashTable *state = g_hash_table_lookup(suggested, key);
+
+			if (!state) {
+				state = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+				g_hash_table_insert(suggested, key, state);
+			} else {
+				g_free(key);
+			}
+			g_hash_table_replace(state, g_strcompress(fields[1]), g_strcompress(fields[2]));
+			nitems++;
+		}
+		g_strfreev(fields);
+	}
+	g_strfreev(lines);
+	g_free(contents);
+
+	purple_debug_info(PLUGIN_ID, "Read %u suggested items from %s\n", nitems, filename);
+	g_free(filename);
 }
 
-static char*
-create_full_jid(const char *bare_jid, const char *resource)
+static void
+delta_destroy()
 {
-	return g_strdup_printf("%s/%s", bare_jid, resource);
+	g_hash_table_destroy(suggested);
+	suggested = NULL;
 }
 
-static char*
-create_bare_jid(const char *jid)
+
+/*
+ * Pacing of sent stanzas: receivers like this plugin drop suggestions
+ * beyond a token bucket per sender, PREF_RATE_BURST stanzas at once and
+ * PREF_RATE_PER_MINUTE per minute after that. A copy of that bucket,
+ * sized by the same preferences, is kept per account and recipient, and
+ * a stanza is only sent when the recipient's bucket has a token for it.
+ * With a rate of 0 nothing is paced.
+ */
+typedef struct _PaceBucket PaceBucket;
+struct _PaceBucket {
+	gdouble tokens;
+	gint64 last_refill;  /* monotonic time in microseconds */
+};
+
+static GHashTable *pace_buckets = NULL;  /* account and recipient bare jid -> PaceBucket* */
+
+static PaceBucket *
+pace_bucket_lookup(PurpleConnection *pc, const char *to)
 {
-	gchar **parts = g_strsplit(jid, "/", 2);
-	gchar *bare_jid = g_strdup(parts[0]);
+	char bare_jid[JID_BUFFER_SIZE];
+	char *key;
+	PaceBucket *bucket;
+	int per_minute = MAX(purple_prefs_get_int(PREF_RATE_PER_MINUTE), 0);
+	int burst = MAX(purple_prefs_get_int(PREF_RATE_BURST), 1);
+	gint64 now = g_get_monotonic_time();
+
+	if (!normalize_bare_jid(to, bare_jid, sizeof(bare_jid)))
+		g_strlcpy(bare_jid, to, sizeof(bare_jid));
+	key = g_strdup_printf("%s\n%s",
+			purple_account_get_username(purple_connection_get_account(pc)), bare_jid);
+
+	bucket = g_hash_table_lookup(pace_buckets, key);
+	if (!bucket) {
+		bucket = g_new0(PaceBucket, 1);
+		bucket->tokens = burst;
+		bucket->last_refill = now;
+		g_hash_table_insert(pace_buckets, key, bucket);
+	} else {
+		g_free(key);
+	}
 
-	g_strfreev(parts);
-	return bare_jid;
+	if (per_minute == 0)
+		bucket->tokens = burst;
+	else
+		bucket->tokens = MIN(burst, bucket->tokens +
+				(gdouble) (now - bucket->last_refill) * per_minute / (60 * G_USEC_PER_SEC));
+	bucket->last_refill = now;
+	return bucket;
 }
 
-static gboolean
-jid_is_subscribed(PurpleConnection *pc, const char *jid)
+/* Milliseconds until the recipient takes another stanza */
+static guint
+pace_delay_msec(PurpleConnection *pc, const char *to)
 {
-	DummyJabberStream *js = purple_connection_get_protocol_data(pc);
-	char *bare_jid = create_bare_jid(jid);
-	DummyJabberBuddy *jb = g_hash_table_lookup(js->buddies, bare_jid);
+	PaceBucket *bucket = pace_bucket_lookup(pc, to);
+	int per_minute = purple_prefs_get_int(PREF_RATE_PER_MINUTE);
 
-	g_free(bare_jid);
-	return jb && !(jb->subscription & JABBER_SUB_PENDING) && (jb->subscription & JABBER_SUB_BOTH);
+	if (bucket->tokens >= 1.0 || per_minute <= 0)
+		return 0;
+	return (guint) ((1.0 - bucket->tokens) * 60 * 1000 / per_minute) + 1;
 }
 
-static GList *
-find_resources(PurpleConnection *pc, const char *jid)
+/* With all resources as the target, one suggestion stanza takes several tokens */
+static void
+pace_take(PurpleConnection *pc, const char *to, guint nstanzas)
 {
-	DummyJabberStream *js = purple_connection_get_protocol_data(pc);
-	DummyJabberBuddy *jb;
-	GList *list = NULL;
-	GList *resources;
-	char *bare_jid = create_bare_jid(jid);
+	pace_bucket_lookup(pc, to)->tokens -= nstanzas;
+}
 
-	jb = g_hash_table_lookup(js->buddies, bare_jid);
-	if (jb && jb->resources) {
-		for(resources = jb->resources; resources; resources = resources->next) {
-			DummyJabberBuddyResource *jbr = resources->data;
-			char *resource = jbr->name;
+static void
+pace_init()
+{
+	pace_buckets = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+}
 
-			purple_debug_misc(PLUGIN_ID, "jid=%s has resource %s\n", bare_jid, resource);
-			list = g_list_append(list, resource);
-		}
-	}
-	g_free(bare_jid);
-	return list;
+static void
+pace_destroy()
+{
+	if (pace_buckets)
+		g_hash_table_destroy(pace_buckets);
+	pace_buckets = NULL;
 }
 
-static gboolean
-_resource_has_feature(PurpleBuddy *b, const char *resource, const char *namespace)
+
+/*
+ * Sending a suggestion: the itemlist is split into stanzas that fit
+ * the max_stanza_bytes preference, each of them a complete <x/> with
+ * complete items. The first stanza is sent right away, the others
+ * follow one by one, paced to what the recipient accepts. The items of
+ * a stanza go into the history once it was delivered. In delta mode,
+ * removals are only sent once the user confirmed them, and the
+ * suggestion becomes the last one once all stanzas were delivered.
+ */
+typedef struct _OutgoingSuggestion OutgoingSuggestion;
+struct _OutgoingSuggestion {
+	PurpleConnection *pc;
+	char *to;
+	ItemList *itemlist;
+	GList *next;       /* first item not sent yet */
+	guint nchunks;     /* stanzas sent so far */
+	GList *chunks;     /* stanzas not answered yet, entries are OutgoingChunk* */
+	gboolean sent_all;
+	gboolean failed;   /* a stanza was not delivered */
+	GHashTable *delta_state;  /* for delta_commit(), or NULL */
+	guint timer;
+	void *ui_handle;   /* confirmation of the removals, while it is open */
+};
+
+/* One stanza of a suggestion, until it is answered */
+typedef struct {
+	OutgoingSuggestion *out;
+	GList *start, *end;  /* its items, up to (excluding) end */
+} OutgoingChunk;
+
+static GList *outgoing_suggestions = NULL;  /* entries are OutgoingSuggestion* */
+
+static void
+outgoing_suggestion_destroy(OutgoingSuggestion *out)
 {
-	void *jabber_handle = purple_plugins_find_with_id("prpl-jabber");
-	char *full_jid = create_full_jid(purple_buddy_get_name(b), resource);
-	gboolean ipc_success;
-	int result;
+	outgoing_suggestions = g_list_remove(outgoing_suggestions, out);
 
-	result = GPOINTER_TO_INT(purple_plugin_ipc_call(jabber_handle,
-				"contact_has_feature", &ipc_success,
-				purple_buddy_get_account(b),
-				full_jid,
-				namespace));
+	while (out->chunks) {
+		pending_exchanges_forget(out->chunks->data);
+		g_free(out->chunks->data);
+		out->chunks = g_list_delete_link(out->chunks, out->chunks);
+	}
+
+	if (out->timer)
+		purple_timeout_remove(out->timer);
+	if (out->ui_handle)
+		purple_request_close(PURPLE_REQUEST_ACTION, out->ui_handle);
+	if (out->delta_state)
+		g_hash_table_destroy(out->delta_state);
+	itemlist_destroy(out->itemlist);
+	g_free(out->to);
+	g_free(out);
+}
 
-	// purple_debug_misc(PLUGIN_ID, "_resource_has_feature(): ns=%s, jid=%s, full=%s, ipc_success=%s, result=%x\n",
-	//		namespace, purple_buddy_get_name(b), full_jid, ipc_success ? "yes":"no", result);
+static void
+outgoing_suggestion_finish(OutgoingSuggestion *out)
+{
+	purple_debug_info(PLUGIN_ID, "Suggestion to %s sent in %u stanzas%s\n", out->to, out->nchunks,
+			out->failed ? ", not all of them delivered" : "");
 
-	g_free(full_jid);
-	return (ipc_success && result);
+	if (!out->failed && out->delta_state) {
+		delta_commit(out->pc, out->to, out->delta_state);
+		out->delta_state = NULL;
+	}
+	outgoing_suggestion_destroy(out);
 }
 
-static GList *
-find_resources_with_feature(PurpleBuddy *b, const char *namespace)
+static void
+outgoing_suggestion_chunk_done(gpointer _chunk, gboolean delivered)
 {
-	GList *featured = NULL;
-	GList *r;
+	OutgoingChunk *chunk = (OutgoingChunk *) _chunk;
+	OutgoingSuggestion *out = chunk->out;
+	GList *i;
 
-	r = find_resources(purple_account_get_connection(purple_buddy_get_account(b)),
-			purple_buddy_get_name(b));
-	for (r = g_list_first(r); r; r = g_list_next(r)) {
-		const char *resource = r->data;
+	if (delivered && history) {
+		for (i = chunk->start; i != chunk->end; i = g_list_next(i)) {
+			Item *item = (Item *) i->data;
 
-		if (_resource_has_feature(b, resource, namespace))
-			featured = g_list_prepend(featured, g_strdup(resource));
+			if (item->action == ITEM_ACTION_ADD)
+				history_add(out->to, item->jid, HISTORY_SENT);
+		}
+		history_flush();
 	}
-	return g_list_reverse(featured);
+	if (!delivered)
+		out->failed = TRUE;
+
+	out->chunks = g_list_remove(out->chunks, chunk);
+	g_free(chunk);
+	if (out->sent_all && !out->chunks)
+		outgoing_suggestion_finish(out);
 }
 
+/* Sends the next stanza, returns FALSE when all items have been sent */
+static gboolean
+outgoing_suggestion_send_next(OutgoingSuggestion *out)
+{
+	gsize max_stanza = MAX(purple_prefs_get_int(PREF_MAX_STANZA_BYTES), 0);
+	gsize max_body = MAX(purple_prefs_get_int(PREF_MAX_BODY_BYTES), 0);
+	/* The <x/> and the body of the fallback <message/> share the stanza */
+	gsize budget = max_stanza > max_body ? max_stanza - max_body : 0;
+	GList *start = out->next, *l;
+	gint64 start_usec = g_get_monotonic_time();
+	guint nitems = 0, nstanzas;
+	OutgoingChunk *chunk;
+	xmlnode *xnode;
+	char *text;
+
+	xnode = xnode_new_from_itemlist(start, budget, &out->next);
+	for (l = start; l != out->next; l = g_list_next(l))
+		nitems++;
+	metrics_record(STAGE_ITEMLIST_TO_XNODE, start_usec, nitems);
+
+	text = create_message_from_itemlist(start, out->next,
+			purple_account_get_name_for_display(purple_connection_get_account(out->pc)));
+
+	chunk = g_new0(OutgoingChunk, 1);
+	chunk->out = out;
+	chunk->start = start;
+	chunk->end = out->next;
+	out->chunks = g_list_prepend(out->chunks, chunk);
+
+	/* A <message/> is delivered, and chunk is gone, before this returns */
+	nstanzas = send_iqs_or_message(out->pc, out->to, xnode, text,
+			outgoing_suggestion_chunk_done, chunk);
+	if (nstanzas == 0) {
+		out->chunks = g_list_remove(out->chunks, chunk);
+		g_free(chunk);
+		out->failed = TRUE;
+	}
+	pace_take(out->pc, out->to, nstanzas);
+	out->nchunks++;
 
-/*
- * Generic sending of an iq or message
- */
+	g_free(text);
+	return (out->next != NULL);
+}
+
+static gboolean outgoing_suggestion_timeout_cb(gpointer _out);
+
+/* Sends the next stanza as soon as the recipient takes it, and schedules
+ * the one after; finishes out when all stanzas have been answered */
 static void
-send_iq(PurpleConnection *pc, const char *full_to, xmlnode *xnode)
+outgoing_suggestion_continue(OutgoingSuggestion *out)
 {
-	xmlnode *iq;
-	const char *from = purple_account_get_username(
-			purple_connection_get_account(pc));
+	guint delay;
 
-	iq = xmlnode_new("iq");
-	xmlnode_set_attrib(iq, "type", "set");
-	xmlnode_set_attrib(iq, "id", generate_next_id());
-	xmlnode_set_attrib(iq, "to", full_to);
-	xmlnode_set_attrib(iq, "from", from);
-	xmlnode_insert_child(iq, xnode);
+	if (!PURPLE_CONNECTION_IS_VALID(out->pc)) {
+		outgoing_suggestion_destroy(out);
+		return;
+	}
 
-	// purple_debug_info(PLUGIN_ID, "Sending request iq from '%s' to '%s'...\n", from, full_to);
-	purple_signal_emit(purple_connection_get_prpl(pc), "jabber-sending-xmlnode", pc, &iq);
+	delay = pace_delay_msec(out->pc, out->to);
+	if (delay == 0) {
+		if (!outgoing_suggestion_send_next(out)) {
+			out->sent_all = TRUE;
+			if (!out->chunks)
+				outgoing_suggestion_finish(out);
+			return;
+		}
+		delay = MAX(pace_delay_msec(out->pc, out->to), SEND_INTERVAL_MSEC);
+	}
+	out->timer = purple_timeout_add(delay, outgoing_suggestion_timeout_cb, out);
+}
 
-	xmlnode_free(iq);
+static gboolean
+outgoing_suggestion_timeout_cb(gpointer _out)
+{
+	OutgoingSuggestion *out = (OutgoingSuggestion *) _out;
+
+	out->timer = 0;
+	outgoing_suggestion_continue(out);
+	return FALSE;
 }
 
 static void
-send_message(PurpleConnection *pc, const char *to, xmlnode *xnode, const char *text)
+outgoing_confirm_send_cb(gpointer _out, int action)
 {
-	xmlnode *message, *node;
-	const char *from = purple_account_get_username(
-			purple_connection_get_account(pc));
+	OutgoingSuggestion *out = (OutgoingSuggestion *) _out;
 
-	message = xmlnode_new("message");
-	xmlnode_set_attrib(message, "id", generate_next_id());
-	xmlnode_set_attrib(message, "to", to);
-	xmlnode_set_attrib(message, "from", from);
-	xmlnode_insert_child(message, xnode);
+	out->ui_handle = NULL;
+	outgoing_suggestion_continue(out);
+}
 
-	/* We don't want the message echoed back to our other devices */
-	node = xmlnode_new_child(message, "private");
-	xmlnode_set_namespace(node, NS_CARBONS);
-	if (text) {
-		node = xmlnode_new_child(message, "body");
-		xmlnode_insert_data(node, text, -1);
-	}
+static gboolean
+_item_is_not_deleted(Item *item, AuxData *aux)
+{
+	return item->action != ITEM_ACTION_DELETE;
+}
 
-	// purple_debug_info(PLUGIN_ID, "Sending request message to '%s'...\n", to);
-	purple_signal_emit(purple_connection_get_prpl(pc), "jabber-sending-xmlnode", pc, &message);
+static void
+outgoing_confirm_keep_cb(gpointer _out, int action)
+{
+	OutgoingSuggestion *out = (OutgoingSuggestion *) _out;
 
-	xmlnode_free(message);
-}
+	out->ui_handle = NULL;
+	itemlist_filter(out->itemlist, _item_is_not_deleted, NULL);
+	out->next = itemlist_get_items(out->itemlist);
+
+	/* The removed contacts are no longer suggested either way */
+	if (itemlist_is_empty(out->itemlist))
+		outgoing_suggestion_finish(out);
+	else
+		outgoing_suggestion_continue(out);
+}
 
-/* 
- * If entity is online, this implementation sends <iq/> requests
- * to _all_ RosterX-capable resources.
- *
- * NOTE: This behaviour is inconsistent
- * with XEP-0144 (5. Recommended Stanza Types).
- * This is because it is not known which resource would be the most
- * adequate to address.
- *
- * If the entity is offline, send a message to the bare jid instead.
- */
 static void
-send_iqs_or_message(PurpleConnection *pc, const char *to, xmlnode *xnode, const char *text)
+outgoing_confirm_cancel_cb(gpointer _out, int action)
 {
-	PurpleBuddy *b = purple_find_buddy(
-			purple_connection_get_account(pc), to);
-	GList *resources;
-	g_return_if_fail(b);
+	OutgoingSuggestion *out = (OutgoingSuggestion *) _out;
 
-	resources = g_list_first(find_resources_with_feature(b, NS_ROSTERX));
+	out->ui_handle = NULL;
+	outgoing_suggestion_destroy(out);
+}
 
-	if (STRICT_XEP && PURPLE_BUDDY_IS_ONLINE(b) && resources) {
-		while (resources) {  // TODO: choose exactly one resource
-			char *full_jid = create_full_jid(to, resources->data);
+#define CONFIRM_MAX_LISTED  10
 
-			purple_debug_info(PLUGIN_ID, "send_iqs_or_message(): <iq/> to=%s\n", full_jid);
+/* Asks whether contacts that left the buddy list should be removed at "to" as well */
+static void
+outgoing_suggestion_confirm(OutgoingSuggestion *out, guint ndelete)
+{
+	GString *secondary = g_string_new(NULL);
+	guint nlisted = 0;
+	GList *i;
 
-			send_iq(pc, full_jid, xmlnode_copy(xnode));
+	g_string_printf(secondary, _("%u contacts you suggested to %s are no longer in your buddy list:"),
+			ndelete, out->to);
+	for (i = itemlist_get_items(out->itemlist); i && nlisted < CONFIRM_MAX_LISTED; i = g_list_next(i)) {
+		Item *item = (Item *) i->data;
 
-			g_free(full_jid);
-			resources = g_list_next(resources);
+		if (item->action == ITEM_ACTION_DELETE) {
+			g_string_append_printf(secondary, "\n%s", item->jid);
+			nlisted++;
 		}
-		xmlnode_free(xnode);
-
-	} else { /* fallback if buddy is offline or has no RosterX resource */
-		send_message(pc, to, xnode, text);
 	}
+	if (ndelete > nlisted)
+		g_string_append_printf(secondary, _("\nand %u more"), ndelete - nlisted);
+
+	out->ui_handle = purple_request_action(rosterx_plugin, _("Roster Item Exchange"),
+			_("Suggest to remove them as well?"), secondary->str, 1,
+			purple_connection_get_account(out->pc), out->to, NULL, out, 3,
+			_("Suggest removal"), G_CALLBACK(outgoing_confirm_send_cb),
+			_("Keep them"), G_CALLBACK(outgoing_confirm_keep_cb),
+			_("Cancel"), G_CALLBACK(outgoing_confirm_cancel_cb));
+	g_string_free(secondary, TRUE);
 }
 
+/* NOTE: Takes ownership of itemlist */
+static void
+outgoing_suggestion_start(PurpleConnection *pc, const char *to, ItemList *itemlist)
+{
+	OutgoingSuggestion *out;
+	GHashTable *delta_state = NULL;
+	guint ndelete = 0;
+	GList *i;
+
+	if (purple_prefs_get_bool(PREF_DELTA)) {
+		itemlist = suggestion_delta(pc, to, itemlist, &delta_state);
+		if (itemlist_is_empty(itemlist)) {
+			g_hash_table_destroy(delta_state);
+			itemlist_destroy(itemlist);
+			return;
+		}
+	}
+
+	out = g_new0(OutgoingSuggestion, 1);
 
-/*
- * Generate a RosterX suggestion
- */
-static char *
-create_message_from_itemlist(GList *itemlist, PurpleConnection *pc)
+	out->pc = pc;
+	out->to = g_strdup(to);
+	out->itemlist = itemlist;
+	out->next = itemlist_get_items(itemlist);
+	out->delta_state = delta_state;
+
+	outgoing_suggestions = g_list_prepend(outgoing_suggestions, out);
+
+	for (i = itemlist_get_items(itemlist); i; i = g_list_next(i))
+		if (((Item *) i->data)->action == ITEM_ACTION_DELETE)
+			ndelete++;
+	if (ndelete)
+		outgoing_suggestion_confirm(out, ndelete);
+	else
+		outgoing_suggestion_continue(out);
+}
+
+static void
+outgoing_signing_off_cb(PurpleConnection *pc, gpointer data)
 {
-	GList *l;
-	char *text = g_strdup_printf("%s has sent you a RosterX contact suggestion:\n",
-			purple_account_get_name_for_display(purple_connection_get_account(pc)));
+	GList *l = outgoing_suggestions;
 
-	for (l = g_list_first(itemlist); l; l = g_list_next(l)) {
-		Item *item = (Item *) l->data;
-		char *tmptext = text;
+	while (l) {
+		OutgoingSuggestion *out = (OutgoingSuggestion *) l->data;
 
-		text = g_strdup_printf("%s+ %s\nxmpp:%s", tmptext,
-				item->alias, item->jid);
-		g_free(tmptext);
+		l = g_list_next(l);
+		if (out->pc == pc)
+			outgoing_suggestion_destroy(out);
 	}
-	return text;
 }
 
+static void
+outgoing_destroy()
+{
+	while (outgoing_suggestions)
+		outgoing_suggestion_destroy(outgoing_suggestions->data);
+}
 
 static void
 select_contacts_ok(AuxData *aux, PurpleRequestFields *request)
 {
-	PurpleConnection *pc = aux->pc;
-	GList *itemlist = itemlist_new_from_request(request);
+	gint64 start = g_get_monotonic_time();
+	ItemList *itemlist = aux->itemlist;
 
-	if (itemlist) {
-		xmlnode *xnode = xnode_new_from_itemlist(itemlist);
-		const char *to = aux->target_jid;
-		char *text = create_message_from_itemlist(itemlist, pc);
+	itemlist_select_from_request(itemlist, request, aux->fields);
+	aux->itemlist = NULL;
+	metrics_record(STAGE_REQUEST_TO_ITEMLIST, start, g_queue_get_length(&itemlist->items));
 
-		send_iqs_or_message(pc, to, xnode, text);
+	if (aux->selected) /* whole groups from the group dialog */
+		itemlist_merge(itemlist, aux->selected, G_MAXINT, G_MAXINT);
 
-		g_free(text);
+	if (!itemlist_is_empty(itemlist))
+		outgoing_suggestion_start(aux->pc, aux->target_jid, itemlist);
+	else
 		itemlist_destroy(itemlist);
-	}
+
 	auxdata_destroy(aux);
 }
 
@@ -780,6 +3321,107 @@ select_contacts_cancel(AuxData *aux, PurpleRequestFields *request)
 	auxdata_destroy(aux);
 }
 
+/*
+ * Group dialog: for large rosters, the send dialog first lists the
+ * groups only. Each group can be sent whole, or its contacts can be
+ * chosen one by one in a second dialog that contains only the groups
+ * chosen this way.
+ */
+enum {
+	GROUP_CHOICE_NONE,
+	GROUP_CHOICE_ALL,
+	GROUP_CHOICE_CHOOSE
+};
+
+static void
+select_groups_ok(AuxData *aux, PurpleRequestFields *request)
+{
+	ItemList *chosen = itemlist_new();
+	PurpleRequestFields *contacts;
+	char id[16];
+	guint b, i;
+	gint64 start;
+
+	aux->selected = itemlist_new();
+	for (b = 0; b < aux->buckets->len; b++) {
+		GroupBucket *bucket = g_ptr_array_index(aux->buckets, b);
+		ItemList *target;
+
+		g_snprintf(id, sizeof(id), "%u", b);
+		switch (purple_request_fields_get_choice(request, id)) {
+			case GROUP_CHOICE_ALL:
+				target = aux->selected;
+				break;
+			case GROUP_CHOICE_CHOOSE:
+				target = chosen;
+				break;
+			default:
+				continue;
+		}
+		for (i = 0; i < bucket->items->len; i++)
+			itemlist_add_to_group(target, g_ptr_array_index(bucket->items, i), bucket->groupname);
+	}
+	g_ptr_array_free(aux->buckets, TRUE);
+	aux->buckets = NULL;
+
+	if (itemlist_is_empty(chosen)) {
+		itemlist_destroy(chosen);
+		if (!itemlist_is_empty(aux->selected)) {
+			outgoing_suggestion_start(aux->pc, aux->target_jid, aux->selected);
+			aux->selected = NULL;
+		}
+		auxdata_destroy(aux);
+		return;
+	}
+
+	/* The second dialog offers the chosen contacts only */
+	itemlist_destroy(aux->itemlist);
+	aux->itemlist = chosen;
+	start = g_get_monotonic_time();
+	aux->fields = g_hash_table_new(NULL, NULL);
+	contacts = request_new_from_itemlist(chosen, aux->fields);
+	metrics_record(STAGE_ITEMLIST_TO_REQUEST, start, g_queue_get_length(&chosen->items));
+
+	purple_request_fields(rosterx_plugin,
+			purple_account_get_username(purple_connection_get_account(aux->pc)),
+			_("Select Buddy"),
+			_("Choose the buddies to suggest from the selected groups:"),
+			contacts,
+			_("_Send"), G_CALLBACK(select_contacts_ok),
+			_("_Cancel"), G_CALLBACK(select_contacts_cancel),
+			NULL, NULL, NULL,
+			aux);
+}
+
+static PurpleRequestFields *
+request_new_from_buckets(GPtrArray *buckets)
+{
+	PurpleRequestFields *request = purple_request_fields_new();
+	PurpleRequestFieldGroup *rgroup = purple_request_field_group_new(NULL);
+	char id[16], *label, *all;
+	guint b;
+
+	purple_request_fields_add_group(request, rgroup);
+	for (b = 0; b < buckets->len; b++) {
+		GroupBucket *bucket = g_ptr_array_index(buckets, b);
+		PurpleRequestField *field;
+
+		g_snprintf(id, sizeof(id), "%u", b);
+		label = g_strdup_printf("%s (%u)", bucket->groupname, bucket->items->len);
+		all = g_strdup_printf(_("All %u buddies"), bucket->items->len);
+
+		field = purple_request_field_choice_new(id, label, GROUP_CHOICE_NONE);
+		purple_request_field_choice_add(field, _("None"));
+		purple_request_field_choice_add(field, all);
+		purple_request_field_choice_add(field, _("Choose\u2026"));
+		purple_request_field_group_add_field(rgroup, field);
+
+		g_free(all);
+		g_free(label);
+	}
+	return request;
+}
+
 static void
 select_contacts(PurpleBlistNode *node, gpointer plugin)
 {
@@ -787,16 +3429,40 @@ select_contacts(PurpleBlistNode *node, gpointer plugin)
 	PurpleConnection *pc = purple_account_get_connection(purple_buddy_get_account(b));
 	PurpleRequestFields *request;
 	AuxData *aux;
-	GList *itemlist;
+	ItemList *itemlist;
+	GCallback ok_cb;
 	char *tmpstring;
+	gint64 start;
+	int threshold;
 
 	g_return_if_fail(pc && b);
 
 	aux = auxdata_new(pc);
 	aux->target_jid = g_strdup(purple_buddy_get_name(b));
 
-	itemlist = itemlist_new_from_blist(_buddy_is_xmpp);
-	request = request_new_from_itemlist(itemlist);
+	start = g_get_monotonic_time();
+	itemlist = itemlist_new_from_snapshot();
+	metrics_record(STAGE_SNAPSHOT_TO_ITEMLIST, start, g_queue_get_length(&itemlist->items));
+
+	/* In delta mode, leaving them out would send them as deleted */
+	if (purple_prefs_get_bool(PREF_HISTORY) && !purple_prefs_get_bool(PREF_DELTA))
+		itemlist = itemlist_filter(itemlist, _item_was_not_sent, aux);
+
+	/* The itemlist stays until the dialog is closed */
+	aux->itemlist = itemlist;
+
+	threshold = purple_prefs_get_int(PREF_GROUP_DIALOG_THRESHOLD);
+	if (threshold > 0 && g_queue_get_length(&itemlist->items) > (guint) threshold) {
+		aux->buckets = itemlist_group_buckets(itemlist);
+		request = request_new_from_buckets(aux->buckets);
+		ok_cb = G_CALLBACK(select_groups_ok);
+	} else {
+		start = g_get_monotonic_time();
+		aux->fields = g_hash_table_new(NULL, NULL);
+		request = request_new_from_itemlist(itemlist, aux->fields);
+		metrics_record(STAGE_ITEMLIST_TO_REQUEST, start, g_queue_get_length(&itemlist->items));
+		ok_cb = G_CALLBACK(select_contacts_ok);
+	}
 
 	tmpstring = g_strdup_printf(
 			_("Suggest a selection of buddies to contact %s <%s>:"),
@@ -807,36 +3473,251 @@ select_contacts(PurpleBlistNode *node, gpointer plugin)
 			_("Select Buddy"),
 			tmpstring,
 			request,
-			_("_Send"), G_CALLBACK(select_contacts_ok),
+			_("_Send"), ok_cb,
 			_("_Cancel"), G_CALLBACK(select_contacts_cancel),
 			NULL, NULL, NULL,
 			aux);
 
 	g_free(tmpstring);
+}
+
+/*
+ * Rate limiting of received suggestions: one token bucket per bare jid
+ * of the sender. Only senders that passed the roster check get a bucket,
+ * so the table is bounded by the size of the roster.
+ */
+typedef struct _RateBucket RateBucket;
+struct _RateBucket {
+	gdouble tokens;
+	gint64 last_refill;  /* monotonic time in microseconds */
+	guint dropped;
+};
+
+static GHashTable *rate_buckets = NULL;  /* bare jid -> RateBucket* */
+static guint rate_dropped_total = 0;
+
+static gboolean
+rate_limit_allows(const char *from)
+{
+	int per_minute = purple_prefs_get_int(PREF_RATE_PER_MINUTE);
+	int burst = MAX(purple_prefs_get_int(PREF_RATE_BURST), 1);
+	gint64 now = g_get_monotonic_time();
+	char *bare_jid;
+	RateBucket *bucket;
+
+	if (per_minute <= 0)
+		return TRUE;
+
+	bare_jid = create_bare_jid(from);
+	bucket = g_hash_table_lookup(rate_buckets, bare_jid);
+	if (!bucket) {
+		bucket = g_new0(RateBucket, 1);
+		bucket->tokens = burst;
+		bucket->last_refill = now;
+		g_hash_table_insert(rate_buckets, bare_jid, bucket);
+	} else {
+		g_free(bare_jid);
+	}
+
+	bucket->tokens = MIN(burst, bucket->tokens +
+			(gdouble) (now - bucket->last_refill) * per_minute / (60 * G_USEC_PER_SEC));
+	bucket->last_refill = now;
+
+	if (bucket->tokens < 1.0) {
+		bucket->dropped++;
+		rate_dropped_total++;
+		purple_debug_warning(PLUGIN_ID, "Rate limit exceeded by %s, dropped %u (%u in total)\n",
+				from, bucket->dropped, rate_dropped_total);
+		return FALSE;
+	}
+	bucket->tokens -= 1.0;
+	return TRUE;
+}
+
+static void
+rate_limit_init()
+{
+	rate_buckets = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, g_free);
+}
+
+static void
+rate_limit_destroy()
+{
+	if (rate_buckets)
+		g_hash_table_destroy(rate_buckets);
+	rate_buckets = NULL;
+}
+
+
+/*
+ * Showing received suggestions
+ *
+ * Senders in XEP mode send one <iq/> per resource, and large sets may be
+ * split across several stanzas, so suggestions from the same sender are
+ * collected for a short window and then shown in a single window.
+ */
+typedef struct _PendingSuggestion PendingSuggestion;
+struct _PendingSuggestion {
+	char *key;           /* key in pending_suggestions */
+	ItemList *itemlist;  /* items received so far */
+	AuxData *aux;        /* allocated in the itemlist's arena */
+	guint timer;
+};
+
+static GHashTable *pending_suggestions = NULL;  /* account and sender bare jid -> PendingSuggestion* */
+
+/* NOTE: Takes ownership of itemlist */
+static void
+suggestion_show(ItemList *itemlist, AuxData *aux)
+{
+	gint64 start = g_get_monotonic_time();
+	guint nitems = g_queue_get_length(&itemlist->items);
+
+	itemlist = itemlist_filter(itemlist, _item_is_applicable, aux);
+	if (purple_prefs_get_bool(PREF_HISTORY))
+		itemlist = itemlist_filter(itemlist, _item_was_not_declined, aux);
+	metrics_record(STAGE_FILTER, start, nitems);
+
+	start = g_get_monotonic_time();
+	searchresults_new_from_itemlist(itemlist, aux);
+	metrics_record(STAGE_SEARCHRESULTS, start, g_queue_get_length(&itemlist->items));
+
 	itemlist_destroy(itemlist);
 }
 
+static void
+pending_suggestion_destroy(gpointer _pending)
+{
+	PendingSuggestion *pending = (PendingSuggestion *) _pending;
+
+	if (pending->timer)
+		purple_timeout_remove(pending->timer);
+	itemlist_destroy(pending->itemlist);
+	g_free(pending->key);
+	g_free(pending);
+}
+
+static gboolean
+pending_suggestion_timeout_cb(gpointer _pending)
+{
+	PendingSuggestion *pending = (PendingSuggestion *) _pending;
+
+	pending->timer = 0;
+	g_hash_table_steal(pending_suggestions, pending->key);
+
+	suggestion_show(pending->itemlist, pending->aux);
+
+	g_free(pending->key);
+	g_free(pending);
+	return FALSE;
+}
+
+/* NOTE: Takes ownership of itemlist */
+static void
+coalesce_suggestion(ItemList *itemlist, AuxData *aux)
+{
+	PurpleAccount *account = purple_connection_get_account(aux->pc);
+	char *key = g_strdup_printf("%s\n%s",
+			purple_account_get_username(account), aux->target_jid);
+	PendingSuggestion *pending = g_hash_table_lookup(pending_suggestions, key);
+
+	if (pending) {
+		guint ndropped;
+
+		purple_debug_info(PLUGIN_ID, "coalesce_suggestion(): merging %u items from %s\n",
+				g_queue_get_length(&itemlist->items), aux->target_jid);
+
+		/* The window gets the same limits as a single stanza */
+		ndropped = itemlist_merge(pending->itemlist, itemlist,
+				purple_prefs_get_int(PREF_MAX_ITEMS), purple_prefs_get_int(PREF_MAX_GROUPS));
+		if (ndropped)
+			purple_debug_warning(PLUGIN_ID, "Suggestions from %s exceed %d items or %d groups per item, "
+					"%u left out!\n", aux->target_jid, purple_prefs_get_int(PREF_MAX_ITEMS),
+					purple_prefs_get_int(PREF_MAX_GROUPS), ndropped);
+		itemlist_destroy(itemlist);
+		g_free(key);
+		return;
+	}
+
+	pending = g_new0(PendingSuggestion, 1);
+	pending->key = key;
+	pending->itemlist = itemlist;
+	pending->aux = aux;
+	/* The window starts with the first suggestion and is not extended,
+	 * so that a steady stream of stanzas cannot delay it forever */
+	pending->timer = purple_timeout_add(purple_prefs_get_int(PREF_COALESCE_MSEC),
+			pending_suggestion_timeout_cb, pending);
+
+	g_hash_table_insert(pending_suggestions, key, pending);
+}
+
+static gboolean
+_pending_suggestion_is_for(gpointer key, gpointer value, gpointer pc)
+{
+	return ((PendingSuggestion *) value)->aux->pc == pc;
+}
+
+static void
+coalesce_signing_off_cb(PurpleConnection *pc, gpointer data)
+{
+	/* The searchresults would not outlive the connection anyway */
+	g_hash_table_foreach_remove(pending_suggestions, _pending_suggestion_is_for, pc);
+}
+
+static void
+coalesce_init()
+{
+	pending_suggestions = g_hash_table_new_full(g_str_hash, g_str_equal,
+			NULL, pending_suggestion_destroy);
+}
+
+static void
+coalesce_destroy()
+{
+	if (pending_suggestions)
+		g_hash_table_destroy(pending_suggestions);
+	pending_suggestions = NULL;
+}
+
+
 /*
  * RosterX / XEP-0144 -specfic part of iq / message handling
  */
+static void
+iq_set_error(xmlnode *reply, const char *type, const char *condition)
+{
+	xmlnode *error, *errortype;
+
+	xmlnode_set_attrib(reply, "type", "error");
+
+	error = xmlnode_new_child(reply, "error");
+	xmlnode_set_attrib(error, "type", type);
+
+	errortype = xmlnode_new_child(error, condition);
+	xmlnode_set_namespace(errortype, NS_XMPP_STANZAS);
+}
+
+/* NOTE: Takes ownership of itemlist */
 static gboolean
 rosterx_process_common(PurpleConnection *pc, const char *type, const char *id,
-		const char *from, xmlnode *xnode, const char *text)
+		const char *from, ItemList *itemlist, const char *text)
 {
-	GList *itemlist;
 	AuxData *aux;
+	const char *resource;
 	
-	g_return_val_if_fail(xnode, FALSE);
-
-   	aux = auxdata_new(pc);
-	aux->target_jid = create_bare_jid(from);
-	itemlist = itemlist_new_from_xnode(xnode);
-	itemlist = itemlist_filter(itemlist, _item_is_not_in_roster, aux);
+	g_return_val_if_fail(itemlist, FALSE);
 
-	searchresults_new_from_itemlist(itemlist, aux);
+	/* Everything of this exchange lives in the itemlist's arena */
+	resource = strchr(from, '/');
+	aux = arena_new0(&itemlist->arena, AuxData);
+	aux->pc = pc;
+	aux->target_jid = arena_strndup(&itemlist->arena, from,
+			resource ? (gsize) (resource - from) : strlen(from));
 
-	itemlist_destroy(itemlist);
-	auxdata_destroy(aux);
+	if (purple_prefs_get_int(PREF_COALESCE_MSEC) > 0)
+		coalesce_suggestion(itemlist, aux);
+	else
+		suggestion_show(itemlist, aux);
 	return TRUE;
 }
 
@@ -844,7 +3725,7 @@ static gboolean
 rosterx_process_iq(PurpleConnection *pc, const char *type, const char *id,
 		const char *from, xmlnode *xnode)
 {
-	gboolean iq_is_ok = FALSE;
+	ItemList *itemlist = NULL;
 	PurpleBuddy *b = purple_find_buddy(purple_connection_get_account(pc), from);
 	xmlnode *reply = xmlnode_new("iq");
 
@@ -854,56 +3735,42 @@ rosterx_process_iq(PurpleConnection *pc, const char *type, const char *id,
 	if (equals("set", type)) {
 		gboolean is_subscribed = jid_is_subscribed(pc, from);
 
-		if (b && is_subscribed) {
-			iq_is_ok = TRUE;
-			xmlnode_set_attrib(reply, "type", "result");
-
-		} else { /* For error types, see XEP-0144, Section 5.1 */
-			// TODO: combine error handling for iqs and messges
-			xmlnode *error, *errortype;
+		if (b && is_subscribed && !rate_limit_allows(from)) {
+			/* cheap answer before any parsing */
+			iq_set_error(reply, "wait", "resource-constraint");
 
-			xmlnode_set_attrib(reply, "type", "error");
+		} else if (b && is_subscribed) {
+			gboolean too_large;
 
-			error = xmlnode_new_child(reply, "error");
-			xmlnode_set_attrib(error, "type", "auth");
+			itemlist = itemlist_new_from_xnode(xnode, &too_large);
+			if (itemlist)
+				xmlnode_set_attrib(reply, "type", "result");
+			else  /* exceeds our limits */
+				iq_set_error(reply, "modify", "not-acceptable");
 
+		} else { /* For error types, see XEP-0144, Section 5.1 */
 			if (!b) { /* sending entity is not in roster */
-				errortype = xmlnode_new_child(error, "not-authorized");
+				iq_set_error(reply, "auth", "not-authorized");
 			} else {  /* not subscribed */
-				errortype = xmlnode_new_child(error, "registration-required");
+				iq_set_error(reply, "auth", "registration-required");
 			}
-			xmlnode_set_namespace(errortype, NS_XMPP_STANZAS);
 		}
 	}
-	else if (equals("result", type)) {
-		// TODO: unregister iq tag in hash storage, or return FALSE
-		return TRUE;
-	}
-	else if (equals("error", type)) {
-		// TODO: unregister iq tag in hash storage, or return FALSE
-
-		// error processing
-		// TODO: show error message?
-		return TRUE;
+	else if (equals("result", type) || equals("error", type)) {
+		/* Not an answer to one of our <iq/>s, see pending_iq_answered() */
+		xmlnode_free(reply);
+		return FALSE;
 	}
 	else { /* e.g. type == 'get' */
-		xmlnode *error, *errortype;
-
-		xmlnode_set_attrib(reply, "type", "error");
-
-		error = xmlnode_new_child(reply, "error");
-		xmlnode_set_attrib(error, "type", "modify");
-
-		errortype = xmlnode_new_child(error, "bad-request");
-		xmlnode_set_namespace(errortype, NS_XMPP_STANZAS);
+		iq_set_error(reply, "modify", "bad-request");
 	}
 
 	purple_signal_emit(purple_connection_get_prpl(pc),
 			"jabber-sending-xmlnode", pc, &reply);
 	xmlnode_free(reply);
 
-	if (iq_is_ok)
-		return rosterx_process_common(pc, type, id, from, xnode, NULL);
+	if (itemlist)
+		return rosterx_process_common(pc, type, id, from, itemlist, NULL);
 	else
 		return TRUE;
 }
@@ -914,6 +3781,8 @@ rosterx_process_message(PurpleConnection *pc, const char *type, const char *id,
 {
 	PurpleBuddy *b = purple_find_buddy(purple_connection_get_account(pc), from);
 	gboolean is_subscribed = jid_is_subscribed(pc, from);
+	ItemList *itemlist;
+	gboolean too_large;
 
 	if (equals("error", type)) {
 		// error processing
@@ -924,7 +3793,15 @@ rosterx_process_message(PurpleConnection *pc, const char *type, const char *id,
 			purple_debug_warning(PLUGIN_ID, "process_message(): Message from unsubscribed or unknown entity %s, ignoring!\n", from);
 			return TRUE; /* consume message */
 		}
-		return rosterx_process_common(pc, type, id, from, xnode, text);
+		if (!rate_limit_allows(from))
+			return TRUE; /* consume message */
+
+		itemlist = itemlist_new_from_xnode(xnode, &too_large);
+		if (!itemlist) {
+			purple_debug_warning(PLUGIN_ID, "process_message(): Suggestion from %s exceeds our limits, ignoring!\n", from);
+			return TRUE;
+		}
+		return rosterx_process_common(pc, type, id, from, itemlist, text);
 	}
 }
 
@@ -939,6 +3816,11 @@ iq_received_cb(PurpleConnection *pc, const char *type, const char *id,
 	xmlnode *xnode;
 	const char *ns;
 
+	/* Answers to our <iq/>s usually carry no payload */
+	if ((equals("result", type) || equals("error", type)) &&
+			pending_iq_answered(pc, type, id, from, iq))
+		return TRUE;
+
 	xnode = xmlnode_get_child(iq, "x");
 	if (!xnode)
 		return FALSE;
@@ -993,7 +3875,7 @@ blist_node_extended_menu_cb(PurpleBlistNode *node, GList **menu, gpointer plugin
 
 		if (STRICT_XEP) {  /* extra constraints */
 			option_is_available = option_is_available &&
-				(!PURPLE_BUDDY_IS_ONLINE(b) || find_resources_with_feature(b, NS_ROSTERX));
+				(!PURPLE_BUDDY_IS_ONLINE(b) || buddycaps_lookup(b)->rosterx_capable);
 		}
 
 		if (equals("prpl-jabber", protocol_id)) {
@@ -1007,6 +3889,130 @@ blist_node_extended_menu_cb(PurpleBlistNode *node, GList **menu, gpointer plugin
 	}
 }
 
+/*
+ * Plugin actions: exchange statistics
+ */
+static int
+_compare_usec(gconstpointer a, gconstpointer b)
+{
+	gint64 x = *(const gint64 *) a, y = *(const gint64 *) b;
+
+	return (x > y) - (x < y);
+}
+
+static char *
+metrics_report(const char *newline)
+{
+	GString *report = g_string_new(NULL);
+	int s, b;
+
+	for (s = 0; s < NUM_STAGES; s++) {
+		StageMetrics *m = &stage_metrics[s];
+		gint64 sorted[STAGE_SAMPLES];
+		guint n = MIN(m->calls, STAGE_SAMPLES);
+
+		g_string_append_printf(report, "%s: %" G_GUINT64_FORMAT " calls, %" G_GUINT64_FORMAT " items",
+				stage_names[s], m->calls, m->items);
+		if (n > 0) {
+			memcpy(sorted, m->samples, n * sizeof(gint64));
+			qsort(sorted, n, sizeof(gint64), _compare_usec);
+
+			g_string_append_printf(report,
+					", total %" G_GINT64_FORMAT " us, p50 %" G_GINT64_FORMAT " us"
+					", p99 %" G_GINT64_FORMAT " us, max %" G_GINT64_FORMAT " us",
+					m->total_usec, sorted[(n - 1) * 50 / 100], sorted[(n - 1) * 99 / 100],
+					m->max_usec);
+		}
+		g_string_append(report, newline);
+
+		for (b = 0; b < HISTOGRAM_BUCKETS; b++) {
+			if (m->histogram[b])
+				g_string_append_printf(report, "    %u+ items: %" G_GUINT64_FORMAT "%s",
+						b ? 1u << (b - 1) : 0u, m->histogram[b], newline);
+		}
+	}
+	g_string_append_printf(report, "Suggestions dropped by rate limit: %u%s",
+			rate_dropped_total, newline);
+
+	return g_string_free(report, FALSE);
+}
+
+static void
+show_metrics_action_cb(PurplePluginAction *action)
+{
+	char *report = metrics_report("\n");
+	char *escaped = g_markup_escape_text(report, -1);
+	char *html = purple_strreplace(escaped, "\n", "<br/>");
+
+	purple_notify_formatted(action->plugin, _("RosterX statistics"),
+			_("Exchange pipeline statistics"), NULL, html, NULL, NULL);
+	g_free(html);
+	g_free(escaped);
+	g_free(report);
+}
+
+static void
+dump_metrics_action_cb(PurplePluginAction *action)
+{
+	char *report = metrics_report("\n");
+	char *filename = g_build_filename(purple_user_dir(), METRICS_FILENAME, NULL);
+
+	if (purple_util_write_data_to_file(METRICS_FILENAME, report, -1))
+		purple_notify_info(action->plugin, _("RosterX statistics"),
+				_("Exchange pipeline statistics written to:"), filename);
+	else
+		purple_notify_error(action->plugin, _("RosterX statistics"),
+				_("Could not write exchange pipeline statistics to:"), filename);
+
+	g_free(filename);
+	g_free(report);
+}
+
+static void
+dump_trace_action_cb(PurplePluginAction *action)
+{
+	char *trace = trace_format();
+	char *filename = g_build_filename(purple_user_dir(), TRACE_FILENAME, NULL);
+
+	if (purple_util_write_data_to_file(TRACE_FILENAME, trace, -1))
+		purple_notify_info(action->plugin, _("RosterX trace"),
+				_("Trace of the latest events written to:"), filename);
+	else
+		purple_notify_error(action->plugin, _("RosterX trace"),
+				_("Could not write the trace to:"), filename);
+
+	g_free(filename);
+	g_free(trace);
+}
+
+static void
+clear_history_action_cb(PurplePluginAction *action)
+{
+	if (history_clear())
+		purple_notify_info(action->plugin, _("RosterX history"),
+				_("The exchange history was cleared."),
+				_("Contacts sent before can be suggested again, and declined ones are shown again."));
+	else
+		purple_notify_error(action->plugin, _("RosterX history"),
+				_("Could not clear the exchange history."), NULL);
+}
+
+static GList *
+plugin_actions(PurplePlugin *plugin, gpointer context)
+{
+	GList *actions = NULL;
+
+	actions = g_list_append(actions,
+			purple_plugin_action_new(_("Show exchange statistics"), show_metrics_action_cb));
+	actions = g_list_append(actions,
+			purple_plugin_action_new(_("Write exchange statistics to file"), dump_metrics_action_cb));
+	actions = g_list_append(actions,
+			purple_plugin_action_new(_("Write trace to file"), dump_trace_action_cb));
+	actions = g_list_append(actions,
+			purple_plugin_action_new(_("Clear exchange history"), clear_history_action_cb));
+	return actions;
+}
+
 static gboolean
 add_feature_rosterx()
 {
@@ -1044,9 +4050,38 @@ plugin_load(PurplePlugin *plugin)
 			PURPLE_CALLBACK(iq_received_cb), NULL);
 	purple_signal_connect(jabber_handle, "jabber-receiving-message", plugin,
 			PURPLE_CALLBACK(message_received_cb), NULL);
+	purple_signal_connect(jabber_handle, "jabber-receiving-presence", plugin,
+			PURPLE_CALLBACK(presence_received_cb), NULL);
 
 	purple_signal_connect(blist_handle, "blist-node-extended-menu",
 			plugin, PURPLE_CALLBACK(blist_node_extended_menu_cb), NULL);
+	purple_signal_connect(blist_handle, "buddy-added",
+			plugin, PURPLE_CALLBACK(buddy_added_cb), NULL);
+	purple_signal_connect(blist_handle, "buddy-removed",
+			plugin, PURPLE_CALLBACK(buddy_removed_cb), NULL);
+	purple_signal_connect(blist_handle, "buddy-removed",
+			plugin, PURPLE_CALLBACK(buddycaps_buddy_removed_cb), NULL);
+	purple_signal_connect(blist_handle, "buddy-caps-changed",
+			plugin, PURPLE_CALLBACK(buddy_caps_changed_cb), NULL);
+	purple_signal_connect(purple_connections_get_handle(), "signing-off",
+			plugin, PURPLE_CALLBACK(signing_off_cb), NULL);
+	purple_signal_connect(purple_connections_get_handle(), "signing-off",
+			plugin, PURPLE_CALLBACK(coalesce_signing_off_cb), NULL);
+	purple_signal_connect(purple_connections_get_handle(), "signing-off",
+			plugin, PURPLE_CALLBACK(outgoing_signing_off_cb), NULL);
+	purple_signal_connect(purple_connections_get_handle(), "signing-off",
+			plugin, PURPLE_CALLBACK(pending_iqs_signing_off_cb), NULL);
+	purple_signal_connect(purple_connections_get_handle(), "signing-off",
+			plugin, PURPLE_CALLBACK(bulk_add_signing_off_cb), NULL);
+
+	caps_cache_init();
+	rate_limit_init();
+	coalesce_init();
+	pending_iqs_init();
+	pace_init();
+	snapshot_init();
+	delta_init();
+	history_init();
 
 	rosterx_plugin = plugin;
 	return TRUE;
@@ -1062,6 +4097,17 @@ plugin_unload(PurplePlugin *plugin)
 
 	purple_signals_disconnect_by_handle(jabber_handle);
 
+	snapshot_destroy();
+	caps_cache_destroy();
+	rate_limit_destroy();
+	coalesce_destroy();
+	outgoing_destroy();
+	pace_destroy();
+	pending_iqs_destroy();
+	searchresults_close_all();
+	bulk_add_destroy_all();
+	delta_destroy();
+	history_destroy();
 	return TRUE;
 }
 
@@ -1084,6 +4130,67 @@ get_plugin_pref_frame(PurplePlugin *plugin)
 
 	purple_plugin_pref_frame_add(frame, pref);
 
+	pref = purple_plugin_pref_new_with_name_and_label(PREF_TARGET,
+			_("In XEP compliant mode, send to:"));
+
+	purple_plugin_pref_set_type(pref, PURPLE_PLUGIN_PREF_CHOICE);
+	purple_plugin_pref_add_choice(pref,
+			"Best resource (by priority)",  GINT_TO_POINTER(TARGET_BEST_RESOURCE));
+	purple_plugin_pref_add_choice(pref,
+			"Most recently active resource", GINT_TO_POINTER(TARGET_RECENT_RESOURCE));
+	purple_plugin_pref_add_choice(pref,
+			"All resources",                GINT_TO_POINTER(TARGET_ALL_RESOURCES));
+
+	purple_plugin_pref_frame_add(frame, pref);
+
+	pref = purple_plugin_pref_new_with_name_and_label(PREF_HISTORY,
+			_("Leave out buddies already suggested to or declined from a buddy"));
+	purple_plugin_pref_frame_add(frame, pref);
+
+	pref = purple_plugin_pref_new_with_name_and_label(PREF_DELTA,
+			_("Send only changes since the last suggestion to a buddy"));
+	purple_plugin_pref_frame_add(frame, pref);
+
+	pref = purple_plugin_pref_new_with_name_and_label(PREF_MAX_STANZA_BYTES,
+			_("Maximum size of a sent stanza (bytes):"));
+	purple_plugin_pref_set_bounds(pref, 1024, 1048576);
+	purple_plugin_pref_frame_add(frame, pref);
+
+	pref = purple_plugin_pref_new_with_name_and_label(PREF_MAX_BODY_BYTES,
+			_("Maximum size of the plaintext message body (bytes):"));
+	purple_plugin_pref_set_bounds(pref, 256, 1048576);
+	purple_plugin_pref_frame_add(frame, pref);
+
+	pref = purple_plugin_pref_new_with_name_and_label(PREF_GROUP_DIALOG_THRESHOLD,
+			_("Offer whole groups first above this many buddies (0: never):"));
+	purple_plugin_pref_set_bounds(pref, 0, 100000);
+	purple_plugin_pref_frame_add(frame, pref);
+
+	pref = purple_plugin_pref_new_with_name_and_label(PREF_MAX_ITEMS,
+			_("Maximum number of contacts in a received suggestion:"));
+	purple_plugin_pref_set_bounds(pref, 1, 100000);
+	purple_plugin_pref_frame_add(frame, pref);
+
+	pref = purple_plugin_pref_new_with_name_and_label(PREF_MAX_GROUPS,
+			_("Maximum number of groups per received contact:"));
+	purple_plugin_pref_set_bounds(pref, 1, 1000);
+	purple_plugin_pref_frame_add(frame, pref);
+
+	pref = purple_plugin_pref_new_with_name_and_label(PREF_RATE_PER_MINUTE,
+			_("Suggestions accepted per contact and minute (0: unlimited):"));
+	purple_plugin_pref_set_bounds(pref, 0, 600);
+	purple_plugin_pref_frame_add(frame, pref);
+
+	pref = purple_plugin_pref_new_with_name_and_label(PREF_RATE_BURST,
+			_("Suggestions accepted per contact in a burst:"));
+	purple_plugin_pref_set_bounds(pref, 1, 100);
+	purple_plugin_pref_frame_add(frame, pref);
+
+	pref = purple_plugin_pref_new_with_name_and_label(PREF_COALESCE_MSEC,
+			_("Combine suggestions from one contact within (ms, 0: never):"));
+	purple_plugin_pref_set_bounds(pref, 0, 60000);
+	purple_plugin_pref_frame_add(frame, pref);
+
 	return frame;
 }
 
@@ -1131,7 +4238,7 @@ static PurplePluginInfo info = {
 	NULL,                             /* ui info */
 	NULL,                             /* extra info */
 	&prefs_info,                      /* prefs info */
-	NULL,                             /* actions */
+	plugin_actions,                   /* actions */
 	NULL,                             /* reserved */
 	NULL,                             /* reserved */
 	NULL,                             /* reserved */
@@ -1143,6 +4250,17 @@ init_plugin(PurplePlugin *plugin)
 {
 	purple_prefs_add_none(PREFS_BASE);
 	purple_prefs_add_int(PREF_COMPATIBLE, COMPATIBLE_MESSAGE);
+	purple_prefs_add_int(PREF_TARGET, TARGET_BEST_RESOURCE);
+	purple_prefs_add_bool(PREF_HISTORY, FALSE);
+	purple_prefs_add_bool(PREF_DELTA, FALSE);
+	purple_prefs_add_int(PREF_MAX_STANZA_BYTES, MAX_STANZA_BYTES_DEFAULT);
+	purple_prefs_add_int(PREF_MAX_BODY_BYTES, MAX_BODY_BYTES_DEFAULT);
+	purple_prefs_add_int(PREF_GROUP_DIALOG_THRESHOLD, GROUP_DIALOG_THRESHOLD_DEFAULT);
+	purple_prefs_add_int(PREF_MAX_ITEMS, MAX_ITEMS_DEFAULT);
+	purple_prefs_add_int(PREF_MAX_GROUPS, MAX_GROUPS_DEFAULT);
+	purple_prefs_add_int(PREF_RATE_PER_MINUTE, RATE_PER_MINUTE_DEFAULT);
+	purple_prefs_add_int(PREF_RATE_BURST, RATE_BURST_DEFAULT);
+	purple_prefs_add_int(PREF_COALESCE_MSEC, COALESCE_MSEC_DEFAULT);
 }
 
 PURPLE_INIT_PLUGIN(core-dzzinstant-rosterx, init_plugin, info)
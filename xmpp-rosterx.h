@@ -24,7 +24,7 @@ struct _JabberBuddy {
 	 * details).  Don't play with this yourself, let
 	 * jabber_buddy_track_resource and jabber_buddy_remove_resource do it.
 	 */
-	GList *resources;     /* needed in find_resources() */
+	GList *resources;     /* needed in buddycaps_new() */
 	char *error_msg;
 	enum {
 		JABBER_INVISIBLE_NONE   = 0,
@@ -42,11 +42,50 @@ struct _JabberBuddy {
 };
 
 
+typedef struct _JabberCapsClientInfo {
+	GList *identities;
+	GList *features;
+	GList *forms;
+	gpointer /* JabberCapsNodeExts * */ exts;
+
+	const struct {
+		const char *node;
+		const char *ver;    /* needed in _resource_has_rosterx() */
+		const char *hash;   /* needed in _resource_has_rosterx() */
+	} tuple;
+
+	char NOTE_This_struct_is_only_a_stub_of_JabberCapsClientInfo[0];
+} DummyJabberCapsClientInfo;
+
 typedef struct _JabberBuddyResource {
 	DummyJabberBuddy *jb;
-	char *name;           /* needed in find_resources() */
-	int priority;         /* maybe needed later */
-	enum {DUMMY_0}/* JabberBuddyState */  state;
+	char *name;           /* needed in buddycaps_new() */
+	int priority;         /* needed in buddycaps_new() */
+	enum {
+		JABBER_BUDDY_STATE_UNKNOWN     = -2,
+		JABBER_BUDDY_STATE_ERROR       = -1,
+		JABBER_BUDDY_STATE_UNAVAILABLE =  0,
+		JABBER_BUDDY_STATE_ONLINE,
+		JABBER_BUDDY_STATE_CHAT,
+		JABBER_BUDDY_STATE_AWAY,
+		JABBER_BUDDY_STATE_XA,
+		JABBER_BUDDY_STATE_DND
+	} state;              /* needed in buddycaps_new() */
+	char *status;
+	time_t idle;          /* needed in buddycaps_new() */
+	enum {DUMMY_2} /* JabberCapabilities */ capabilities;
+	char *thread_id;
+	enum {DUMMY_3} chat_states;
+	struct {
+		char *version;
+		char *name;
+		char *os;
+	} client;
+	int tz_off;
+	struct {
+		DummyJabberCapsClientInfo *info;   /* needed in _resource_has_rosterx() */
+		GList *exts;
+	} caps;
 
 	char NOTE_This_struct_is_only_a_stub_of_JabberBuddyResource[0];
 } DummyJabberBuddyResource;
@@ -69,7 +108,7 @@ struct _JabberStream
 	char *stream_id;
 	enum {DUMMY_1} /* JabberStreamState */  state;
 
-	GHashTable *buddies;   /* needed in jid_is_subscribed(), find_resources() */
+	GHashTable *buddies;   /* needed in jid_is_subscribed(), buddycaps_new() */
 
 	char NOTE_This_struct_is_only_a_stub_of_JabberStream[0];
 };